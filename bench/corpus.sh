@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Build the detection benchmark corpus into the given directory: the
+# example programs dynamic, stripped and static, a large binary with
+# thousands of functions and strings, and a shell script. Static
+# variants are skipped when the toolchain cannot link statically.
+#
+
+set -e
+
+out=${1:?usage: corpus.sh <output_dir>}
+cc=${CC:-cc}
+here=$(dirname "$0")
+examples=$here/../examples
+
+mkdir -p "$out"
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/isolate-corpus.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+for prog in hello server; do
+    $cc -O2 -o "$out/$prog" "$examples/$prog.c"
+    $cc -O2 -s -o "$out/$prog-stripped" "$examples/$prog.c"
+    if $cc -O2 -static -o "$out/$prog-static" "$examples/$prog.c" 2>/dev/null; then
+        :
+    else
+        echo "corpus.sh: static linking unavailable, skipping $prog-static" >&2
+    fi
+done
+
+# Mostly plain messages with a configuration path every so often, which
+# is what the string scanner sees in large real-world binaries
+awk 'BEGIN {
+    print "#include <stdio.h>"
+    print "#include <math.h>"
+    print "#include <pthread.h>"
+    for (i = 0; i < 4000; i++) {
+        printf "double work_%d(double x) {\n", i
+        if (i % 400 == 0) {
+            printf "    FILE *f = fopen(\"/etc/bench/component%d.conf\", \"r\");\n", i
+            printf "    if (f) fclose(f);\n"
+        }
+        printf "    if (x < %d) fprintf(stderr, \"work_%d: value %%f below threshold %d\\n\", x);\n", i, i, i
+        printf "    return sqrt(x + %d);\n}\n", i
+    }
+    print "static void *run(void *arg) { (void)arg; return NULL; }"
+    print "int main(int argc, char **argv) {"
+    print "    pthread_t t; double sum = 0;"
+    print "    (void)argv; pthread_create(&t, NULL, run, NULL); pthread_join(t, NULL);"
+    for (i = 0; i < 4000; i++) printf "    sum += work_%d(argc);\n", i
+    print "    printf(\"%f\\n\", sum);"
+    print "    return 0;"
+    print "}"
+}' > "$tmp/large.c"
+$cc -O0 -pthread -o "$out/large" "$tmp/large.c" -lm
+$cc -O0 -pthread -s -o "$out/large-stripped" "$tmp/large.c" -lm
+
+cat > "$out/script.sh" <<'EOF'
+#!/bin/sh
+# Fetch the configured feed and keep a copy
+config="/etc/feed/feed.conf"
+url=$(cat "$config")
+curl -fsS "https://feeds.example.com/$url" > /var/cache/feed/latest
+EOF
+chmod 755 "$out/script.sh"
+
+touch "$out/.built"
@@ -0,0 +1,422 @@
+/*
+ * Capability detection benchmark
+ *
+ * "detect-bench [-n rounds] [-g golden] [-o output] [-u] <dir|file>..."
+ * runs every detection phase on each ELF file and "#!" script found
+ * under the given paths, timing the phases separately, and reports
+ * throughput and peak RSS. The capability file written for each input
+ * is compared with the golden file recorded for it (-u records them),
+ * so a change to detection shows up both as a timing and as a diff. A
+ * missing golden file fails the run like a difference does; a missing
+ * golden directory only means nothing has been recorded yet, so the run
+ * just times detection.
+ * Rounds after the first reuse the libraries the resolver has already
+ * parsed, as a batch run would; the detection cache is never consulted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "common.h"
+
+enum bench_phase {
+    PHASE_DEPENDENCIES,
+    PHASE_SYMBOLS,
+    PHASE_STRINGS,
+    PHASE_PATTERNS,
+    PHASE_GENERATE,
+    PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "dependencies", "symbols", "strings", "patterns", "generate"
+};
+
+struct bench_file {
+    char *path;
+    char *name;                 /* root basename/relative path, keys the golden file */
+    off_t size;
+    double phase[PHASE_COUNT];  /* seconds, summed over rounds */
+    int hints;
+};
+
+struct bench {
+    struct bench_file *files;
+    int count, capacity;
+    off_t bytes;
+};
+
+// ELF files of any type and executable scripts; everything else is skipped
+static int is_detectable(const char *path, const struct stat *st) {
+    char magic[4];
+
+    if (!S_ISREG(st->st_mode)) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n == sizeof(magic) && memcmp(magic, "\177ELF", 4) == 0) {
+        return 1;
+    }
+    return n >= 2 && magic[0] == '#' && magic[1] == '!' && (st->st_mode & S_IXUSR);
+}
+
+static int add_file(struct bench *bench, const char *path, const char *name, off_t size) {
+    if (bench->count == bench->capacity) {
+        int capacity = bench->capacity ? bench->capacity * 2 : 64;
+        struct bench_file *files = realloc(bench->files, capacity * sizeof(*files));
+        if (!files) {
+            return -1;
+        }
+        bench->files = files;
+        bench->capacity = capacity;
+    }
+
+    struct bench_file *file = &bench->files[bench->count];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->name = strdup(name);
+    file->size = size;
+    if (!file->path || !file->name) {
+        free(file->path);
+        free(file->name);
+        return -1;
+    }
+    bench->count++;
+    bench->bytes += size;
+    return 0;
+}
+
+static void walk_tree(struct bench *bench, const char *root, const char *relative, int depth) {
+    const char *base = strrchr(root, '/');
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    char name[PATH_MAX];
+    struct dirent *de;
+
+    snprintf(path, sizeof(path), "%s%s%s", root, *relative ? "/" : "", relative);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Warning: Cannot read %s: %s\n", path, strerror(errno));
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", relative, *relative ? "/" : "",
+                     de->d_name) >= (int)sizeof(child) ||
+            snprintf(path, sizeof(path), "%s/%s", root, child) >= (int)sizeof(path)) {
+            fprintf(stderr, "Warning: Skipping %s under %s: %s\n", de->d_name, root, strerror(ENAMETOOLONG));
+            continue;
+        }
+
+        // Symlinks are not followed, so the walk cannot loop
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && depth < 32) {
+            walk_tree(bench, root, child, depth + 1);
+        } else if (is_detectable(path, &st)) {
+            if (snprintf(name, sizeof(name), "%s/%s", base ? base + 1 : root, child) < (int)sizeof(name)) {
+                add_file(bench, path, name, st.st_size);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const struct bench_file *)a)->name, ((const struct bench_file *)b)->name);
+}
+
+// The same analyses, in the same order, as detect_capabilities_log
+static int run_file(struct bench_file *file, const char *output, FILE *log) {
+    struct detection_result result = {0};
+    uint64_t start, end;
+
+    result.log = log;
+    start = timing_now();
+    analyze_binary_dependencies(file->path, &result);
+    end = timing_now();
+    file->phase[PHASE_DEPENDENCIES] += (end - start) / 1e9;
+
+    start = end;
+    analyze_binary_symbols(file->path, &result);
+    end = timing_now();
+    file->phase[PHASE_SYMBOLS] += (end - start) / 1e9;
+
+    start = end;
+    analyze_binary_strings(file->path, &result);
+    end = timing_now();
+    file->phase[PHASE_STRINGS] += (end - start) / 1e9;
+
+    start = end;
+    analyze_application_patterns(file->path, &result);
+    end = timing_now();
+    file->phase[PHASE_PATTERNS] += (end - start) / 1e9;
+
+    start = end;
+    int ret = generate_capability_file(file->path, output, &result);
+    end = timing_now();
+    file->phase[PHASE_GENERATE] += (end - start) / 1e9;
+
+    file->hints = result.hint_count;
+    free_detection_result(&result);
+    return ret;
+}
+
+// Read a capability file without the lines that name the input or the time
+static char *read_caps(const char *path) {
+    char line[1024];
+    char *text = NULL;
+    size_t size = 0;
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    FILE *out = open_memstream(&text, &size);
+    if (!out) {
+        fclose(file);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "# Auto-generated capability file for ", 37) == 0 ||
+            strncmp(line, "# Generated on: ", 16) == 0) {
+            continue;
+        }
+        fputs(line, out);
+    }
+    fclose(file);
+    fclose(out);
+    return text;
+}
+
+static int copy_file(const char *from, const char *to) {
+    char buf[8192];
+    size_t n;
+
+    FILE *in = fopen(from, "r");
+    if (!in) {
+        return -1;
+    }
+    FILE *out = fopen(to, "w");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    return fclose(out);
+}
+
+static void make_parent(const char *path) {
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        fsops_mkdirs(AT_FDCWD, dir, 0755);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n rounds] [-g golden_dir] [-o output_dir] [-u] <dir|file>...\n", prog);
+    fprintf(stderr, "  -n rounds      Analyze the corpus this many times (default: 1)\n");
+    fprintf(stderr, "  -g golden_dir  Compare with (or with -u, record) golden capability files\n");
+    fprintf(stderr, "  -o output_dir  Where capability files are written (default: bench-output)\n");
+    fprintf(stderr, "  -u             Record the current output as the golden files\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench bench;
+    const char *golden_dir = NULL;
+    const char *output_dir = "bench-output";
+    char output[PATH_MAX];
+    char golden[PATH_MAX];
+    int rounds = 1, update = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:g:o:uh")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atoi(optarg);
+                if (rounds <= 0) {
+                    fprintf(stderr, "Error: Invalid round count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                golden_dir = optarg;
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'u':
+                update = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || (update && !golden_dir)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (golden_dir && !update) {
+        struct stat st;
+        if (stat(golden_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Warning: No golden directory %s, timing only; record it with -u "
+                    "(make bench-golden)\n", golden_dir);
+            golden_dir = NULL;
+        }
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        char root[PATH_MAX];
+        snprintf(root, sizeof(root), "%s", argv[i]);
+        size_t len = strlen(root);
+        while (len > 1 && root[len - 1] == '/') {
+            root[--len] = '\0';
+        }
+
+        if (stat(root, &st) != 0) {
+            fprintf(stderr, "Warning: Skipping %s: %s\n", root, strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            walk_tree(&bench, root, "", 0);
+        } else if (is_detectable(root, &st)) {
+            const char *base = strrchr(root, '/');
+            add_file(&bench, root, base ? base + 1 : root, st.st_size);
+        }
+    }
+    if (bench.count == 0) {
+        fprintf(stderr, "Error: No ELF files or scripts found\n");
+        return 1;
+    }
+    qsort(bench.files, bench.count, sizeof(*bench.files), by_name);
+
+    // Progress messages would only time the terminal
+    FILE *log = fopen("/dev/null", "w");
+    if (!log) {
+        fprintf(stderr, "Error: Cannot open /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("Detection Benchmark\n");
+    printf("===================\n");
+    printf("Corpus: %d files, %.1f MB, %d round%s\n\n", bench.count,
+           bench.bytes / (1024.0 * 1024.0), rounds, rounds == 1 ? "" : "s");
+
+    int failed = 0;
+    uint64_t start = timing_now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < bench.count; i++) {
+            struct bench_file *file = &bench.files[i];
+            snprintf(output, sizeof(output), "%s/%s.caps", output_dir, file->name);
+            make_parent(output);
+            if (run_file(file, output, log) != 0 && round == 0) {
+                fprintf(stderr, "Warning: Detection failed for %s\n", file->path);
+                failed++;
+            }
+        }
+    }
+    double elapsed = (timing_now() - start) / 1e9;
+    fclose(log);
+
+    // Per-phase totals, with the file that took longest in each
+    printf("%-14s %12s %12s %12s  %s\n", "Phase", "Total (ms)", "Mean (us)", "Max (us)", "Slowest");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        double total = 0, max = 0;
+        const char *slowest = "-";
+        for (int i = 0; i < bench.count; i++) {
+            double t = bench.files[i].phase[p] / rounds;
+            total += bench.files[i].phase[p];
+            if (t > max) {
+                max = t;
+                slowest = bench.files[i].name;
+            }
+        }
+        printf("%-14s %12.3f %12.1f %12.1f  %s\n", phase_names[p], total * 1e3,
+               total * 1e6 / ((double)bench.count * rounds), max * 1e6, slowest);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double analyzed = (double)bench.count * rounds;
+    printf("\nElapsed: %.3fs\n", elapsed);
+    if (elapsed > 0) {
+        printf("Throughput: %.1f binaries/s, %.1f MB/s\n", analyzed / elapsed,
+               bench.bytes * (double)rounds / (1024 * 1024) / elapsed);
+    }
+    // ru_maxrss is in kilobytes on both Linux and FreeBSD
+    printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+
+    if (!golden_dir) {
+        return failed ? 1 : 0;
+    }
+
+    int matched = 0, differed = 0, missing = 0, recorded = 0;
+    for (int i = 0; i < bench.count; i++) {
+        struct bench_file *file = &bench.files[i];
+        snprintf(output, sizeof(output), "%s/%s.caps", output_dir, file->name);
+        snprintf(golden, sizeof(golden), "%s/%s.caps", golden_dir, file->name);
+
+        if (update) {
+            make_parent(golden);
+            if (copy_file(output, golden) != 0) {
+                fprintf(stderr, "Warning: Cannot record %s: %s\n", golden, strerror(errno));
+                continue;
+            }
+            recorded++;
+            continue;
+        }
+
+        char *expected = read_caps(golden);
+        if (!expected) {
+            printf("  missing %s\n", file->name);
+            missing++;
+            continue;
+        }
+        char *actual = read_caps(output);
+        if (actual && strcmp(expected, actual) == 0) {
+            matched++;
+        } else {
+            printf("  differs %s (diff -u %s %s)\n", file->name, golden, output);
+            differed++;
+        }
+        free(expected);
+        free(actual);
+    }
+
+    if (update) {
+        printf("Golden: %d files recorded under %s\n", recorded, golden_dir);
+    } else {
+        printf("Golden: %d match, %d differ, %d missing\n", matched, differed, missing);
+        // Nothing compared is not a pass; leave out -g to only time
+        if (missing) {
+            fprintf(stderr, "Error: No golden file for %d inputs under %s; record them with -u "
+                    "(make bench-golden)\n", missing, golden_dir);
+        }
+    }
+    return failed || differed || missing ? 1 : 0;
+}
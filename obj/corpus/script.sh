@@ -0,0 +1,5 @@
+#!/bin/sh
+# Fetch the configured feed and keep a copy
+config="/etc/feed/feed.conf"
+url=$(cat "$config")
+curl -fsS "https://feeds.example.com/$url" > /var/cache/feed/latest
@@ -0,0 +1,192 @@
+/*
+ * Aho-Corasick multi-pattern matcher
+ *
+ * Patterns are compiled into a deterministic automaton: every state has
+ * a transition for every input class, so a search is one table lookup
+ * per byte no matter how many patterns are loaded. Bytes that appear in
+ * no pattern share a single class, which keeps the table small.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "common.h"
+
+struct ac_pattern {
+    char *text;
+    int id;
+};
+
+struct ac_output {
+    int id;
+    int length;
+    int next;
+};
+
+int ac_add(struct ac_automaton *ac, const char *pattern, int id) {
+    if (ac->built || *pattern == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ac->pattern_count == ac->pattern_capacity) {
+        int capacity = ac->pattern_capacity ? ac->pattern_capacity * 2 : 64;
+        struct ac_pattern *patterns = realloc(ac->patterns, capacity * sizeof(*patterns));
+        if (!patterns) {
+            return -1;
+        }
+        ac->patterns = patterns;
+        ac->pattern_capacity = capacity;
+    }
+    char *text = strdup(pattern);
+    if (!text) {
+        return -1;
+    }
+    ac->patterns[ac->pattern_count].text = text;
+    ac->patterns[ac->pattern_count].id = id;
+    ac->pattern_count++;
+    return 0;
+}
+
+static int add_output(struct ac_automaton *ac, int state, int id, int length) {
+    if (ac->output_count == ac->output_capacity) {
+        int capacity = ac->output_capacity ? ac->output_capacity * 2 : 64;
+        struct ac_output *outputs = realloc(ac->outputs, capacity * sizeof(*outputs));
+        if (!outputs) {
+            return -1;
+        }
+        ac->outputs = outputs;
+        ac->output_capacity = capacity;
+    }
+    struct ac_output *out = &ac->outputs[ac->output_count];
+    out->id = id;
+    out->length = length;
+    out->next = ac->output[state];
+    ac->output[state] = ac->output_count++;
+    return 0;
+}
+
+int ac_build(struct ac_automaton *ac) {
+    size_t max_states = 1;
+    int *fail = NULL;
+    int *queue = NULL;
+
+    if (ac->built) {
+        return 0;
+    }
+
+    // Class 0 is every byte no pattern uses
+    memset(ac->byte_class, 0, sizeof(ac->byte_class));
+    ac->classes = 1;
+    for (int i = 0; i < ac->pattern_count; i++) {
+        const unsigned char *p = (const unsigned char *)ac->patterns[i].text;
+        for (; *p; p++) {
+            if (ac->byte_class[*p] == 0) {
+                ac->byte_class[*p] = ac->classes++;
+            }
+            max_states++;
+        }
+    }
+
+    ac->next = calloc(max_states * ac->classes, sizeof(*ac->next));
+    ac->output = malloc(max_states * sizeof(*ac->output));
+    ac->dict = calloc(max_states, sizeof(*ac->dict));
+    fail = calloc(max_states, sizeof(*fail));
+    queue = malloc(max_states * sizeof(*queue));
+    if (!ac->next || !ac->output || !ac->dict || !fail || !queue) {
+        goto fail;
+    }
+    for (size_t s = 0; s < max_states; s++) {
+        ac->output[s] = -1;
+    }
+
+    // Trie; the root is state 0, so 0 doubles as "no edge" while building
+    ac->states = 1;
+    for (int i = 0; i < ac->pattern_count; i++) {
+        const unsigned char *p = (const unsigned char *)ac->patterns[i].text;
+        int state = 0;
+        for (; *p; p++) {
+            int *edge = &ac->next[state * ac->classes + ac->byte_class[*p]];
+            if (*edge == 0) {
+                *edge = ac->states++;
+            }
+            state = *edge;
+        }
+        if (add_output(ac, state, ac->patterns[i].id, (int)strlen(ac->patterns[i].text)) != 0) {
+            goto fail;
+        }
+    }
+
+    // Breadth-first: a state's failure target is always shallower, so its
+    // transitions are final by the time they are borrowed
+    int head = 0, tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        int state = queue[head++];
+        int *row = &ac->next[state * ac->classes];
+        for (int c = 0; c < ac->classes; c++) {
+            int fallback = state == 0 ? 0 : ac->next[fail[state] * ac->classes + c];
+            if (row[c] == 0) {
+                row[c] = fallback;
+                continue;
+            }
+            int child = row[c];
+            fail[child] = fallback;
+            ac->dict[child] = ac->output[fallback] >= 0 ? fallback : ac->dict[fallback];
+            queue[tail++] = child;
+        }
+    }
+
+    free(fail);
+    free(queue);
+    for (int i = 0; i < ac->pattern_count; i++) {
+        free(ac->patterns[i].text);
+    }
+    free(ac->patterns);
+    ac->patterns = NULL;
+    ac->pattern_count = ac->pattern_capacity = 0;
+    ac->built = 1;
+    return 0;
+
+fail:
+    free(fail);
+    free(queue);
+    errno = ENOMEM;
+    return -1;
+}
+
+int ac_search(const struct ac_automaton *ac, const char *text, size_t len,
+              int (*visit)(int id, size_t start, size_t end, void *ctx), void *ctx) {
+    const unsigned char *p = (const unsigned char *)text;
+    int state = 0;
+
+    if (!ac->built) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        state = ac->next[state * ac->classes + ac->byte_class[p[i]]];
+        // Root has no output, so 0 ends the dictionary-suffix chain
+        for (int s = ac->output[state] >= 0 ? state : ac->dict[state]; s > 0; s = ac->dict[s]) {
+            for (int o = ac->output[s]; o >= 0; o = ac->outputs[o].next) {
+                const struct ac_output *out = &ac->outputs[o];
+                if (visit(out->id, i + 1 - out->length, i + 1, ctx) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void ac_free(struct ac_automaton *ac) {
+    for (int i = 0; i < ac->pattern_count; i++) {
+        free(ac->patterns[i].text);
+    }
+    free(ac->patterns);
+    free(ac->next);
+    free(ac->output);
+    free(ac->dict);
+    free(ac->outputs);
+    memset(ac, 0, sizeof(*ac));
+}
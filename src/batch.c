@@ -0,0 +1,350 @@
+/*
+ * Batch capability detection
+ *
+ * "isolate -d -j N <dir|@list>" finds ELF executables under a directory
+ * (or in a list file, one path per line) and runs detection on each of
+ * them from a pool of worker threads. The job list is split evenly
+ * between workers up front; a worker that runs out steals from the back
+ * of another worker's share, so a few slow binaries do not leave the
+ * rest of the pool idle. Each job's progress is captured in memory and
+ * only a one-line result is printed, so output never interleaves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "common.h"
+
+#define ET_EXEC 2
+#define ET_DYN 3
+#define BATCH_MAX_JOBS 256
+
+struct batch_job {
+    char *path;
+    char *output;
+    off_t size;
+    int status;
+    struct detection_report report;
+};
+
+struct batch;
+
+struct batch_worker {
+    uint64_t range;             /* next job in the low half, end in the high half */
+    pthread_t thread;
+    struct batch *batch;
+    int index;
+};
+
+struct batch {
+    struct batch_job *jobs;
+    int count, capacity;
+    struct batch_worker *workers;
+    int worker_count;
+    pthread_mutex_t print_lock;
+};
+
+// Executables, not shared libraries: ET_EXEC, or ET_DYN with an interpreter
+static int is_elf_executable(const char *path, const struct stat *st) {
+    struct elf_info elf;
+    char magic[4];
+
+    if (!S_ISREG(st->st_mode) || !(st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n != sizeof(magic) || memcmp(magic, "\177ELF", 4) != 0 || elf_open(path, &elf) != 0) {
+        return 0;
+    }
+    int executable = elf.type == ET_EXEC || (elf.type == ET_DYN && elf.interp);
+    elf_close(&elf);
+    return executable;
+}
+
+static int add_job(struct batch *batch, const char *path, const char *relative,
+                   const char *output_dir, off_t size) {
+    char output[PATH_MAX];
+
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        struct batch_job *jobs = realloc(batch->jobs, capacity * sizeof(*jobs));
+        if (!jobs) {
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->capacity = capacity;
+    }
+
+    // Next to the binary, or mirrored under the output directory
+    if (output_dir) {
+        snprintf(output, sizeof(output), "%s/%s.caps", output_dir, relative);
+    } else {
+        snprintf(output, sizeof(output), "%s.caps", path);
+    }
+
+    struct batch_job *job = &batch->jobs[batch->count];
+    memset(job, 0, sizeof(*job));
+    job->path = strdup(path);
+    job->output = strdup(output);
+    job->size = size;
+    if (!job->path || !job->output) {
+        free(job->path);
+        free(job->output);
+        return -1;
+    }
+    batch->count++;
+    return 0;
+}
+
+static void walk_tree(struct batch *batch, const char *root, const char *relative,
+                      const char *output_dir, int depth) {
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    struct dirent *de;
+
+    snprintf(path, sizeof(path), "%s%s%s", root, *relative ? "/" : "", relative);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Warning: Cannot read %s: %s\n", path, strerror(errno));
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", relative, *relative ? "/" : "",
+                     de->d_name) >= (int)sizeof(child) ||
+            snprintf(path, sizeof(path), "%s/%s", root, child) >= (int)sizeof(path)) {
+            fprintf(stderr, "Warning: Skipping %s under %s: %s\n", de->d_name, root, strerror(ENAMETOOLONG));
+            continue;
+        }
+
+        // Symlinks are not followed, so the walk cannot loop
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && depth < 32) {
+            walk_tree(batch, root, child, output_dir, depth + 1);
+        } else if (is_elf_executable(path, &st)) {
+            add_job(batch, path, child, output_dir, st.st_size);
+        }
+    }
+    closedir(dir);
+}
+
+static int read_list(struct batch *batch, const char *list, const char *output_dir) {
+    char line[PATH_MAX];
+    FILE *file = fopen(list, "r");
+
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", list, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        struct stat st;
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (stat(line, &st) != 0 || !is_elf_executable(line, &st)) {
+            fprintf(stderr, "Warning: Skipping %s: not an ELF executable\n", line);
+            continue;
+        }
+        const char *base = strrchr(line, '/');
+        add_job(batch, line, base ? base + 1 : line, output_dir, st.st_size);
+    }
+    fclose(file);
+    return 0;
+}
+
+static int take_front(struct batch_worker *worker) {
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+
+    while ((uint32_t)range < (uint32_t)(range >> 32)) {
+        if (__atomic_compare_exchange_n(&worker->range, &range, range + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int)(uint32_t)range;
+        }
+    }
+    return -1;
+}
+
+static int steal_back(struct batch_worker *victim) {
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+    while ((uint32_t)range < (uint32_t)(range >> 32)) {
+        uint64_t end = (range >> 32) - 1;
+        if (__atomic_compare_exchange_n(&victim->range, &range, (end << 32) | (uint32_t)range, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int)end;
+        }
+    }
+    return -1;
+}
+
+// No job is ever added after start, so one empty pass means all are taken
+static int next_job(struct batch_worker *worker) {
+    struct batch *batch = worker->batch;
+    int job = take_front(worker);
+
+    for (int i = 1; job < 0 && i < batch->worker_count; i++) {
+        job = steal_back(&batch->workers[(worker->index + i) % batch->worker_count]);
+    }
+    return job;
+}
+
+static void run_job(struct batch *batch, struct batch_job *job) {
+    char *captured = NULL;
+    size_t captured_size = 0;
+    char dir[PATH_MAX];
+
+    FILE *log = open_memstream(&captured, &captured_size);
+    if (!log) {
+        job->status = -1;
+        return;
+    }
+
+    snprintf(dir, sizeof(dir), "%s", job->output);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        fsops_mkdirs(AT_FDCWD, dir, 0755);
+    }
+    job->status = detect_capabilities_log(job->path, job->output, log, &job->report);
+    fclose(log);
+
+    pthread_mutex_lock(&batch->print_lock);
+    if (job->status == 0) {
+        printf("  %-7s %s (%d hints)\n", job->report.cached ? "cached" : "ok",
+               job->path, job->report.hint_count);
+    } else {
+        printf("  %-7s %s\n", "failed", job->path);
+        fputs(captured, stderr);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->print_lock);
+    free(captured);
+}
+
+static void *batch_worker_main(void *arg) {
+    struct batch_worker *worker = arg;
+    int job;
+
+    while ((job = next_job(worker)) >= 0) {
+        run_job(worker->batch, &worker->batch->jobs[job]);
+    }
+    return NULL;
+}
+
+int detect_batch(const char *target, const char *output_dir, int jobs) {
+    struct batch batch;
+    uint64_t start;
+    struct stat st;
+
+    memset(&batch, 0, sizeof(batch));
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (jobs > BATCH_MAX_JOBS) {
+        jobs = BATCH_MAX_JOBS;
+    }
+    if (output_dir && fsops_mkdirs(AT_FDCWD, output_dir, 0755) != 0) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", output_dir, strerror(errno));
+        return -1;
+    }
+
+    printf("Collecting binaries from %s...\n", target);
+    start = timing_now();
+    if (target[0] == '@') {
+        if (read_list(&batch, target + 1, output_dir) != 0) {
+            return -1;
+        }
+    } else if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+        walk_tree(&batch, target, "", output_dir, 0);
+    } else {
+        fprintf(stderr, "Error: %s is neither a directory nor an @list file\n", target);
+        return -1;
+    }
+    if (batch.count == 0) {
+        printf("No ELF executables found.\n");
+        free(batch.jobs);
+        return 0;
+    }
+    if (jobs > batch.count) {
+        jobs = batch.count;
+    }
+    printf("Analyzing %d binaries with %d workers\n\n", batch.count, jobs);
+
+    batch.workers = calloc(jobs, sizeof(*batch.workers));
+    if (!batch.workers) {
+        free(batch.jobs);
+        return -1;
+    }
+    pthread_mutex_init(&batch.print_lock, NULL);
+    batch.worker_count = jobs;
+    for (int i = 0; i < jobs; i++) {
+        uint64_t first = (uint64_t)batch.count * i / jobs;
+        uint64_t end = (uint64_t)batch.count * (i + 1) / jobs;
+        batch.workers[i].range = (end << 32) | first;
+        batch.workers[i].batch = &batch;
+        batch.workers[i].index = i;
+    }
+
+    // The calling thread is worker 0
+    int started = 1;
+    for (int i = 1; i < jobs; i++, started++) {
+        if (pthread_create(&batch.workers[i].thread, NULL, batch_worker_main, &batch.workers[i]) != 0) {
+            fprintf(stderr, "Warning: Could only start %d workers\n", started);
+            break;
+        }
+    }
+    batch_worker_main(&batch.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+    double elapsed = (timing_now() - start) / 1e9;
+
+    int failed = 0, cached = 0;
+    double bytes = 0;
+    for (int i = 0; i < batch.count; i++) {
+        struct batch_job *job = &batch.jobs[i];
+        if (job->status != 0) failed++;
+        if (job->report.cached) cached++;
+        bytes += job->size;
+        free(job->path);
+        free(job->output);
+    }
+
+    printf("\nBatch Summary:\n");
+    printf("==============\n");
+    printf("Binaries analyzed: %d (%d cached, %d failed)\n", batch.count, cached, failed);
+    printf("Elapsed: %.3fs with %d workers\n", elapsed, started);
+    if (elapsed > 0) {
+        printf("Throughput: %.1f binaries/s, %.1f MB/s\n",
+               batch.count / elapsed, bytes / (1024 * 1024) / elapsed);
+    }
+    if (output_dir) {
+        printf("Capability files written under %s\n", output_dir);
+    }
+
+    pthread_mutex_destroy(&batch.print_lock);
+    free(batch.workers);
+    free(batch.jobs);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,613 @@
+/*
+ * Capability hint merging
+ *
+ * Detection produces overlapping hints: several libraries suggest the
+ * same ports, a directory rule makes rules for files below it
+ * redundant, and rules differ only in spacing or permission order.
+ * Each hint line is parsed into a typed rule and merged: filesystem
+ * rules into a path trie (a rule is dropped when an ancestor grants at
+ * least the same access), ports into interval sets per protocol,
+ * address and direction, resource limits to the largest value, and
+ * everything else through a hash set. The result is written as a
+ * minimal, canonical capability file body.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "common.h"
+
+#define MERGE_LINE_MAX 1024
+
+enum merge_kind {
+    MERGE_PATH,
+    MERGE_PORT,
+    MERGE_LINE
+};
+
+struct path_node {
+    char *name;
+    char *path;
+    int perms;                  /* R_OK | W_OK | X_OK granted at this path */
+    struct path_node *parent;
+    struct path_node *child;
+    struct path_node *sibling;
+};
+
+struct port_interval {
+    int lo, hi;
+};
+
+// Ports of one protocol, address ("" is any) and direction
+struct port_set {
+    char protocol[8];
+    char address[64];
+    int direction;              /* 0 both, 1 outbound, 2 inbound */
+    struct port_interval *intervals;
+    int count, capacity;
+    struct port_set *next;
+};
+
+// One rule to write, attributed to the strongest hint that produced it
+struct merge_item {
+    enum merge_kind kind;
+    int hint;
+    struct path_node *node;
+    struct port_set *ports;
+    int port;
+    char *line;
+};
+
+struct merge_limit {
+    const char *key;
+    const char *comment;        /* shown when no hint raised the default */
+    char value[32];             /* text of the largest value so far */
+    size_t amount;
+    int hint;                   /* -1 while the default stands */
+};
+
+struct merge {
+    struct path_node root;
+    struct port_set *port_sets;
+    char **lines;               /* open-addressed set of canonical lines */
+    size_t line_capacity, line_count;
+    struct merge_item *items;
+    int item_count, item_capacity;
+    struct merge_limit limits[4];
+    const struct capability_hint **hints;
+};
+
+static size_t hash_line(const char *str) {
+    size_t h = 5381;
+    while (*str) {
+        h = h * 33 + (unsigned char)*str++;
+    }
+    return h;
+}
+
+static char *trim(char *str) {
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+static int add_item(struct merge *merge, enum merge_kind kind, int hint) {
+    if (merge->item_count == merge->item_capacity) {
+        int capacity = merge->item_capacity ? merge->item_capacity * 2 : 64;
+        struct merge_item *items = realloc(merge->items, capacity * sizeof(*items));
+        if (!items) {
+            return -1;
+        }
+        merge->items = items;
+        merge->item_capacity = capacity;
+    }
+    struct merge_item *item = &merge->items[merge->item_count++];
+    memset(item, 0, sizeof(*item));
+    item->kind = kind;
+    item->hint = hint;
+    return 0;
+}
+
+// Returns 1 if the line was new, 0 if already present, -1 on failure
+static int line_set_add(struct merge *merge, const char *line, char **stored) {
+    if ((merge->line_count + 1) * 2 > merge->line_capacity) {
+        size_t capacity = merge->line_capacity ? merge->line_capacity * 2 : 64;
+        char **lines = calloc(capacity, sizeof(*lines));
+        if (!lines) {
+            return -1;
+        }
+        for (size_t i = 0; i < merge->line_capacity; i++) {
+            if (merge->lines[i]) {
+                size_t j = hash_line(merge->lines[i]) & (capacity - 1);
+                while (lines[j]) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                lines[j] = merge->lines[i];
+            }
+        }
+        free(merge->lines);
+        merge->lines = lines;
+        merge->line_capacity = capacity;
+    }
+
+    size_t mask = merge->line_capacity - 1;
+    size_t i = hash_line(line) & mask;
+    while (merge->lines[i]) {
+        if (strcmp(merge->lines[i], line) == 0) {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    if (!(merge->lines[i] = strdup(line))) {
+        return -1;
+    }
+    merge->line_count++;
+    *stored = merge->lines[i];
+    return 1;
+}
+
+static int merge_line(struct merge *merge, const char *line, int hint) {
+    char *stored;
+    int added = line_set_add(merge, line, &stored);
+    if (added <= 0) {
+        return added;
+    }
+    if (add_item(merge, MERGE_LINE, hint) != 0) {
+        return -1;
+    }
+    merge->items[merge->item_count - 1].line = stored;
+    return 0;
+}
+
+static struct path_node *path_child(struct path_node *parent, const char *name, size_t len) {
+    struct path_node *node;
+
+    for (node = parent->child; node; node = node->sibling) {
+        if (strlen(node->name) == len && strncmp(node->name, name, len) == 0) {
+            return node;
+        }
+    }
+    node = calloc(1, sizeof(*node));
+    if (!node || !(node->name = strndup(name, len))) {
+        free(node);
+        return NULL;
+    }
+    // The root's own path is "/", which its children must not repeat
+    const char *base = parent->parent ? parent->path : "";
+    size_t size = strlen(base) + len + 2;
+    if (!(node->path = malloc(size))) {
+        free(node->name);
+        free(node);
+        return NULL;
+    }
+    snprintf(node->path, size, "%s/%.*s", base, (int)len, name);
+    node->parent = parent;
+    node->sibling = parent->child;
+    parent->child = node;
+    return node;
+}
+
+static int merge_path(struct merge *merge, const char *path, int perms, int hint) {
+    struct path_node *node = &merge->root;
+
+    // "//", trailing slashes and "." components do not make a new path
+    for (const char *p = path; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len > 0 && !(len == 1 && p[0] == '.')) {
+            if (!(node = path_child(node, p, len))) {
+                return -1;
+            }
+        }
+        p += len;
+        p += strspn(p, "/");
+    }
+
+    // The first (strongest) hint owns the rule; later ones may widen it
+    if (!node->perms && add_item(merge, MERGE_PATH, hint) == 0) {
+        merge->items[merge->item_count - 1].node = node;
+    }
+    node->perms |= perms;
+    return 0;
+}
+
+static struct port_set *port_set_get(struct merge *merge, const char *protocol,
+                                     const char *address, int direction, int create) {
+    struct port_set *set;
+
+    for (set = merge->port_sets; set; set = set->next) {
+        if (set->direction == direction && strcmp(set->protocol, protocol) == 0 &&
+            strcmp(set->address, address) == 0) {
+            return set;
+        }
+    }
+    if (!create || !(set = calloc(1, sizeof(*set)))) {
+        return NULL;
+    }
+    snprintf(set->protocol, sizeof(set->protocol), "%s", protocol);
+    snprintf(set->address, sizeof(set->address), "%s", address);
+    set->direction = direction;
+    set->next = merge->port_sets;
+    merge->port_sets = set;
+    return set;
+}
+
+// Index of the first interval ending at or after port
+static int port_find(const struct port_set *set, int port) {
+    int lo = 0, hi = set->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (set->intervals[mid].hi < port) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int port_contains(const struct port_set *set, int port) {
+    if (!set) {
+        return 0;
+    }
+    int i = port_find(set, port);
+    return i < set->count && set->intervals[i].lo <= port;
+}
+
+// Adds a port, joining it with neighbouring intervals; 1 if it was new
+static int port_insert(struct port_set *set, int port) {
+    int i = port_find(set, port);
+
+    if (i < set->count && set->intervals[i].lo <= port) {
+        return 0;
+    }
+    int joins_prev = i > 0 && set->intervals[i - 1].hi == port - 1;
+    int joins_next = i < set->count && set->intervals[i].lo == port + 1;
+    if (joins_prev && joins_next) {
+        set->intervals[i - 1].hi = set->intervals[i].hi;
+        memmove(&set->intervals[i], &set->intervals[i + 1], (set->count - i - 1) * sizeof(*set->intervals));
+        set->count--;
+    } else if (joins_prev) {
+        set->intervals[i - 1].hi = port;
+    } else if (joins_next) {
+        set->intervals[i].lo = port;
+    } else {
+        if (set->count == set->capacity) {
+            int capacity = set->capacity ? set->capacity * 2 : 8;
+            struct port_interval *grown = realloc(set->intervals, capacity * sizeof(*grown));
+            if (!grown) {
+                return -1;
+            }
+            set->intervals = grown;
+            set->capacity = capacity;
+        }
+        memmove(&set->intervals[i + 1], &set->intervals[i], (set->count - i) * sizeof(*set->intervals));
+        set->intervals[i].lo = set->intervals[i].hi = port;
+        set->count++;
+    }
+    return 1;
+}
+
+static int parse_direction(const char *str) {
+    if (!str) {
+        return 0;
+    }
+    if (strcmp(str, "outbound") == 0 || strcmp(str, "out") == 0) {
+        return 1;
+    }
+    if (strcmp(str, "inbound") == 0 || strcmp(str, "in") == 0) {
+        return 2;
+    }
+    return strcmp(str, "both") == 0 ? 0 : -1;
+}
+
+static int parse_port(const char *str) {
+    char *end;
+    long port = str ? strtol(str, &end, 10) : 0;
+    return str && *end == '\0' && port > 0 && port < 65536 ? (int)port : -1;
+}
+
+// tcp/udp rules with a fixed port go into port sets; anything else
+// (unix sockets, "none", any-port rules) is kept as a plain line
+static int merge_network(struct merge *merge, const char *rule, const char *line, int hint) {
+    char copy[MERGE_LINE_MAX];
+    char *fields[4] = { NULL };
+    char *save = NULL;
+    int n = 0;
+
+    snprintf(copy, sizeof(copy), "%s", rule);
+    for (char *field = strtok_r(copy, ":", &save); field && n < 4; field = strtok_r(NULL, ":", &save)) {
+        fields[n++] = trim(field);
+    }
+    if (n < 2 || (strcmp(fields[0], "tcp") != 0 && strcmp(fields[0], "udp") != 0)) {
+        return merge_line(merge, line, hint);
+    }
+
+    const char *address = "";
+    int port = parse_port(fields[1]);
+    int direction = parse_direction(fields[2]);
+    if (port < 0) {
+        address = fields[1];
+        port = parse_port(fields[2]);
+        direction = parse_direction(fields[3]);
+    } else if (n > 3) {
+        direction = -1;
+    }
+    if (port < 0 || direction < 0 || strlen(address) >= sizeof(((struct port_set *)0)->address)) {
+        return merge_line(merge, line, hint);
+    }
+
+    struct port_set *set = port_set_get(merge, fields[0], address, direction, 1);
+    if (!set) {
+        return -1;
+    }
+    int added = port_insert(set, port);
+    if (added == 1 && add_item(merge, MERGE_PORT, hint) == 0) {
+        merge->items[merge->item_count - 1].ports = set;
+        merge->items[merge->item_count - 1].port = port;
+    }
+    return added < 0 ? -1 : 0;
+}
+
+// Resource limits keep the most generous value any hint asked for
+static void merge_limit(struct merge_limit *limit, const char *value, int hint) {
+    size_t amount;
+    char *end;
+
+    if (strcmp(limit->key, "memory") == 0) {
+        if (parse_memory_size(value, &amount) != 0) {
+            return;
+        }
+    } else {
+        // cpu is a percentage and may say so, as the parser allows
+        long number = strtol(value, &end, 10);
+        if ((*end != '\0' && !(strcmp(limit->key, "cpu") == 0 && strcmp(end, "%") == 0)) ||
+            number <= 0) {
+            return;
+        }
+        amount = (size_t)number;
+    }
+    if (amount > limit->amount && strlen(value) < sizeof(limit->value)) {
+        limit->amount = amount;
+        snprintf(limit->value, sizeof(limit->value), "%s", value);
+        limit->hint = hint;
+    }
+}
+
+static int merge_hint_line(struct merge *merge, char *text, int hint) {
+    char line[MERGE_LINE_MAX];
+
+    // Trailing comments are advice for the reader, not part of the rule
+    char *comment = strchr(text, '#');
+    if (comment) {
+        *comment = '\0';
+    }
+    text = trim(text);
+    char *colon = strchr(text, ':');
+    if (!colon) {
+        return *text ? merge_line(merge, text, hint) : 0;
+    }
+    *colon = '\0';
+    char *key = trim(text);
+    char *value = trim(colon + 1);
+    snprintf(line, sizeof(line), "%s: %s", key, value);
+
+    if (strcmp(key, "filesystem") == 0 || strcmp(key, "file") == 0) {
+        char *perms = strrchr(value, ':');
+        int bits = 0;
+        if (!perms || value[0] != '/') {
+            return merge_line(merge, line, hint);
+        }
+        *perms++ = '\0';
+        if (strpbrk(perms, "rR")) bits |= R_OK;
+        if (strpbrk(perms, "wW")) bits |= W_OK;
+        if (strpbrk(perms, "xX")) bits |= X_OK;
+        return bits ? merge_path(merge, value, bits, hint) : 0;
+    }
+    if (strcmp(key, "network") == 0) {
+        return merge_network(merge, value, line, hint);
+    }
+    for (int i = 0; i < (int)(sizeof(merge->limits) / sizeof(merge->limits[0])); i++) {
+        if (strcmp(key, merge->limits[i].key) == 0) {
+            merge_limit(&merge->limits[i], value, hint);
+            return 0;
+        }
+    }
+    return merge_line(merge, line, hint);
+}
+
+// A path rule is redundant under an ancestor granting at least its access
+static int path_covered(const struct path_node *node) {
+    for (const struct path_node *up = node->parent; up; up = up->parent) {
+        if ((up->perms & node->perms) == node->perms) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Ports are covered by the same port in both directions or on any address
+static int port_covered(struct merge *merge, const struct merge_item *item) {
+    const struct port_set *set = item->ports;
+
+    if (set->direction != 0 &&
+        port_contains(port_set_get(merge, set->protocol, set->address, 0, 0), item->port)) {
+        return 1;
+    }
+    if (set->address[0] &&
+        (port_contains(port_set_get(merge, set->protocol, "", set->direction, 0), item->port) ||
+         port_contains(port_set_get(merge, set->protocol, "", 0, 0), item->port))) {
+        return 1;
+    }
+    return 0;
+}
+
+static void format_item(const struct merge_item *item, char *out, size_t size) {
+    static const char *directions[] = { "", ":outbound", ":inbound" };
+    int perms;
+
+    switch (item->kind) {
+    case MERGE_PATH:
+        perms = item->node->perms;
+        snprintf(out, size, "filesystem: %s:%s%s%s", item->node->path,
+                 perms & R_OK ? "r" : "", perms & W_OK ? "w" : "", perms & X_OK ? "x" : "");
+        break;
+    case MERGE_PORT:
+        snprintf(out, size, "network: %s:%s%s%d%s", item->ports->protocol, item->ports->address,
+                 item->ports->address[0] ? ":" : "", item->port, directions[item->ports->direction]);
+        break;
+    case MERGE_LINE:
+        snprintf(out, size, "%s", item->line);
+        break;
+    }
+}
+
+static int item_emitted(struct merge *merge, const struct merge_item *item) {
+    if (item->kind == MERGE_PATH) {
+        return !path_covered(item->node);
+    }
+    if (item->kind == MERGE_PORT) {
+        return !port_covered(merge, item);
+    }
+    return 1;
+}
+
+static void free_path_nodes(struct path_node *node) {
+    while (node) {
+        struct path_node *next = node->sibling;
+        free_path_nodes(node->child);
+        free(node->name);
+        free(node->path);
+        free(node);
+        node = next;
+    }
+}
+
+static void free_merge(struct merge *merge) {
+    free_path_nodes(merge->root.child);
+    while (merge->port_sets) {
+        struct port_set *next = merge->port_sets->next;
+        free(merge->port_sets->intervals);
+        free(merge->port_sets);
+        merge->port_sets = next;
+    }
+    for (size_t i = 0; i < merge->line_capacity; i++) {
+        free(merge->lines[i]);
+    }
+    free(merge->lines);
+    free(merge->items);
+    free(merge->hints);
+}
+
+static int stronger_first(const void *a, const void *b) {
+    const struct capability_hint *x = *(const struct capability_hint *const *)a;
+    const struct capability_hint *y = *(const struct capability_hint *const *)b;
+    if (x->confidence != y->confidence) {
+        return y->confidence - x->confidence;
+    }
+    return (x > y) - (x < y);
+}
+
+static int confidence_band(int confidence) {
+    return (confidence > 99 ? 99 : confidence) / 10 * 10;
+}
+
+int write_merged_capabilities(FILE *file, const struct detection_result *result) {
+    static const struct merge_limit defaults[] = {
+        {"memory", "Adjust based on application requirements", "128M", 128 * 1024 * 1024, -1},
+        {"processes", "Adjust if application spawns child processes", "5", 5, -1},
+        {"files", "File descriptor limit", "256", 256, -1},
+        {"cpu", NULL, "", 0, -1},
+    };
+    struct merge merge;
+    char line[MERGE_LINE_MAX];
+    int ret = 0;
+
+    memset(&merge, 0, sizeof(merge));
+    merge.root.name = "";
+    merge.root.path = "/";
+    memcpy(merge.limits, defaults, sizeof(defaults));
+
+    // Strongest hints first, so they own the rules they share with weaker ones
+    merge.hints = malloc((result->hint_count ? result->hint_count : 1) * sizeof(*merge.hints));
+    if (!merge.hints) {
+        return -1;
+    }
+    for (int i = 0; i < result->hint_count; i++) {
+        merge.hints[i] = &result->hints[i];
+    }
+    qsort(merge.hints, result->hint_count, sizeof(*merge.hints), stronger_first);
+
+    for (int i = 0; i < result->hint_count && ret == 0; i++) {
+        char *copy = strdup(merge.hints[i]->capability);
+        char *save = NULL;
+        if (!copy) {
+            ret = -1;
+            break;
+        }
+        if (merge.hints[i]->confidence >= 50) {
+            for (char *text = strtok_r(copy, "\n", &save); text && ret == 0; text = strtok_r(NULL, "\n", &save)) {
+                ret = merge_hint_line(&merge, text, i);
+            }
+        }
+        free(copy);
+    }
+    if (ret != 0) {
+        free_merge(&merge);
+        return -1;
+    }
+
+    fprintf(file, "# Default resource limits (adjust based on application needs)\n");
+    for (int i = 0; i < (int)(sizeof(merge.limits) / sizeof(merge.limits[0])); i++) {
+        const struct merge_limit *limit = &merge.limits[i];
+        if (!limit->value[0]) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s: %s", limit->key, limit->value);
+        fprintf(file, "%-15s # %s\n", line,
+                limit->hint >= 0 ? merge.hints[limit->hint]->description : limit->comment);
+    }
+    fprintf(file, "\n");
+
+    fprintf(file, "# Detected capabilities (sorted by confidence)\n");
+    fprintf(file, "# Higher confidence suggestions are listed first\n\n");
+
+    // Items were added strongest hint first, so each hint's rules are contiguous
+    int band = -1;
+    for (int i = 0; i < merge.item_count; ) {
+        int hint = merge.items[i].hint;
+        int written = 0;
+
+        for (; i < merge.item_count && merge.items[i].hint == hint; i++) {
+            if (!item_emitted(&merge, &merge.items[i])) {
+                continue;
+            }
+            if (!written) {
+                int hint_band = confidence_band(merge.hints[hint]->confidence);
+                if (hint_band != band) {
+                    fprintf(file, "%s# Confidence: %d-%d%%\n", band < 0 ? "" : "\n", hint_band, hint_band + 9);
+                    band = hint_band;
+                }
+                fprintf(file, "# %s\n", merge.hints[hint]->description);
+                written = 1;
+            }
+            format_item(&merge.items[i], line, sizeof(line));
+            fprintf(file, "%s\n", line);
+        }
+        if (written) {
+            fprintf(file, "\n");
+        }
+    }
+    if (band >= 0) {
+        fprintf(file, "\n");
+    }
+
+    free_merge(&merge);
+    return 0;
+}
@@ -10,6 +10,25 @@
 #include <unistd.h>
 #include "common.h"
 
+static int parse_errors;
+
+#define ARENA_CHUNK_SIZE 4096
+#define INTERN_INITIAL_SLOTS 64
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct caps_arena {
+    struct arena_chunk *chunks;
+    const char **intern_slots;      /* open-addressed set of arena strings */
+    size_t intern_capacity;
+    size_t intern_count;
+};
+
 void init_default_capabilities(struct capabilities *caps) {
     memset(caps, 0, sizeof(*caps));
     strcpy(caps->username, "auto");
@@ -21,6 +40,159 @@ void init_default_capabilities(struct capabilities *caps) {
     caps->env_clear = 0;             /* Inherit environment */
 }
 
+void free_capabilities(struct capabilities *caps) {
+    struct caps_arena *arena = caps->arena;
+
+    if (arena) {
+        struct arena_chunk *chunk = arena->chunks;
+        while (chunk) {
+            struct arena_chunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(arena->intern_slots);
+        free(arena);
+    }
+    init_default_capabilities(caps);
+}
+
+static struct caps_arena *arena_get(struct capabilities *caps) {
+    if (!caps->arena) {
+        caps->arena = calloc(1, sizeof(*caps->arena));
+    }
+    return caps->arena;
+}
+
+static void *arena_alloc(struct capabilities *caps, size_t size) {
+    struct caps_arena *arena = arena_get(caps);
+    if (!arena) {
+        return NULL;
+    }
+
+    size = (size + 7) & ~(size_t)7;
+    struct arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static size_t hash_string(const char *str) {
+    size_t h = 5381;
+    while (*str) {
+        h = h * 33 + (unsigned char)*str++;
+    }
+    return h;
+}
+
+static int intern_grow(struct caps_arena *arena) {
+    size_t capacity = arena->intern_capacity ? arena->intern_capacity * 2 : INTERN_INITIAL_SLOTS;
+    const char **slots = calloc(capacity, sizeof(*slots));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < arena->intern_capacity; i++) {
+        const char *str = arena->intern_slots[i];
+        if (str) {
+            size_t j = hash_string(str) & (capacity - 1);
+            while (slots[j]) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = str;
+        }
+    }
+    free(arena->intern_slots);
+    arena->intern_slots = slots;
+    arena->intern_capacity = capacity;
+    return 0;
+}
+
+/* Returns one shared arena copy per distinct string */
+const char *caps_intern(struct capabilities *caps, const char *str) {
+    struct caps_arena *arena = arena_get(caps);
+    if (!arena) {
+        return NULL;
+    }
+    if ((arena->intern_count + 1) * 2 > arena->intern_capacity && intern_grow(arena) != 0) {
+        return NULL;
+    }
+
+    size_t mask = arena->intern_capacity - 1;
+    size_t i = hash_string(str) & mask;
+    while (arena->intern_slots[i]) {
+        if (strcmp(arena->intern_slots[i], str) == 0) {
+            return arena->intern_slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(caps, len);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    arena->intern_slots[i] = copy;
+    arena->intern_count++;
+    return copy;
+}
+
+/* Appends a zeroed element, doubling the vector inside the arena when full */
+static void *vector_push(struct capabilities *caps, void **items, int *count, int *capacity, size_t size) {
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 8;
+        void *grown = arena_alloc(caps, new_capacity * size);
+        if (!grown) {
+            return NULL;
+        }
+        if (*count > 0) {
+            memcpy(grown, *items, *count * size);
+        }
+        *items = grown;
+        *capacity = new_capacity;
+    }
+
+    void *item = (char *)*items + *count * size;
+    memset(item, 0, size);
+    (*count)++;
+    return item;
+}
+
+struct network_rule *caps_add_network_rule(struct capabilities *caps) {
+    void *items = caps->network;
+    struct network_rule *rule = vector_push(caps, &items, &caps->network_count,
+                                            &caps->network_capacity, sizeof(*rule));
+    caps->network = items;
+    return rule;
+}
+
+struct file_rule *caps_add_file_rule(struct capabilities *caps) {
+    void *items = caps->files;
+    struct file_rule *rule = vector_push(caps, &items, &caps->file_count,
+                                         &caps->file_capacity, sizeof(*rule));
+    caps->files = items;
+    return rule;
+}
+
+struct env_var *caps_add_env_var(struct capabilities *caps) {
+    void *items = caps->env_vars;
+    struct env_var *var = vector_push(caps, &items, &caps->env_count,
+                                      &caps->env_capacity, sizeof(*var));
+    caps->env_vars = items;
+    return var;
+}
+
 static char *trim_whitespace(char *str) {
     char *end;
     
@@ -69,7 +241,7 @@ int parse_memory_size(const char *size_str, size_t *bytes) {
     return 0;
 }
 
-int parse_network_rule(const char *rule_str, struct network_rule *rule) {
+int parse_network_rule(struct capabilities *caps, const char *rule_str, struct network_rule *rule) {
     /* Examples:
      * tcp:8080
      * udp:53:outbound
@@ -101,7 +273,7 @@ int parse_network_rule(const char *rule_str, struct network_rule *rule) {
     if (strcmp(proto, "unix") == 0) {
         /* Unix socket path */
         if (addr_or_port) {
-            strncpy(rule->address, addr_or_port, sizeof(rule->address) - 1);
+            rule->address = caps_intern(caps, addr_or_port);
         }
         rule->port = -1;
     } else {
@@ -113,10 +285,10 @@ int parse_network_rule(const char *rule_str, struct network_rule *rule) {
             if (*endptr == '\0' && port > 0 && port < 65536) {
                 /* It's just a port */
                 rule->port = port;
-                strcpy(rule->address, "0.0.0.0");
+                rule->address = caps_intern(caps, "0.0.0.0");
             } else {
                 /* It's an address */
-                strncpy(rule->address, addr_or_port, sizeof(rule->address) - 1);
+                rule->address = caps_intern(caps, addr_or_port);
                 if (port_or_dir) {
                     rule->port = atoi(port_or_dir);
                     direction = strtok(NULL, ":");
@@ -141,7 +313,7 @@ int parse_network_rule(const char *rule_str, struct network_rule *rule) {
     return 0;
 }
 
-int parse_file_rule(const char *rule_str, struct file_rule *rule) {
+int parse_file_rule(struct capabilities *caps, const char *rule_str, struct file_rule *rule) {
     /* Examples:
      * /tmp/myapp:rw
      * /etc/resolv.conf:r
@@ -160,7 +332,11 @@ int parse_file_rule(const char *rule_str, struct file_rule *rule) {
         return -1;
     }
     
-    strncpy(rule->path, path, sizeof(rule->path) - 1);
+    rule->path = caps_intern(caps, path);
+    if (!rule->path) {
+        free(rule_copy);
+        return -1;
+    }
     
     /* Parse permissions */
     rule->permissions = 0;
@@ -184,11 +360,14 @@ int load_capabilities(const char *filename, struct capabilities *caps) {
     }
     
     init_default_capabilities(caps);
+    parse_errors = 0;
     
-    char line[1024];
+    /* getline grows the buffer, so long rules are never split */
+    char *line = NULL;
+    size_t line_size = 0;
     int line_num = 0;
     
-    while (fgets(line, sizeof(line), file)) {
+    while (getline(&line, &line_size, file) != -1) {
         line_num++;
         
         /* Remove newline */
@@ -200,6 +379,7 @@ int load_capabilities(const char *filename, struct capabilities *caps) {
         
         char *key, *value;
         if (parse_key_value(trimmed, &key, &value) != 0) {
+            parse_errors++;
             fprintf(stderr, "Warning: Invalid syntax at line %d: %s\n", line_num, line);
             continue;
         }
@@ -211,6 +391,7 @@ int load_capabilities(const char *filename, struct capabilities *caps) {
             
         } else if (strcmp(key, "memory") == 0) {
             if (parse_memory_size(value, &caps->limits.memory_bytes) != 0) {
+                parse_errors++;
                 fprintf(stderr, "Warning: Invalid memory size at line %d: %s\n", line_num, value);
             }
             
@@ -224,34 +405,33 @@ int load_capabilities(const char *filename, struct capabilities *caps) {
             caps->limits.max_cpu_percent = atoi(value);
             
         } else if (strcmp(key, "network") == 0) {
-            if (caps->network_count < MAX_NETWORK_RULES) {
-                if (parse_network_rule(value, &caps->network[caps->network_count]) == 0) {
-                    caps->network_count++;
-                } else {
-                    fprintf(stderr, "Warning: Invalid network rule at line %d: %s\n", line_num, value);
-                }
+            struct network_rule *rule = caps_add_network_rule(caps);
+            if (!rule || parse_network_rule(caps, value, rule) != 0) {
+                if (rule) caps->network_count--;
+                parse_errors++;
+                fprintf(stderr, "Warning: Invalid network rule at line %d: %s\n", line_num, value);
             }
             
         } else if (strcmp(key, "filesystem") == 0 || strcmp(key, "file") == 0) {
-            if (caps->file_count < MAX_FILE_RULES) {
-                if (parse_file_rule(value, &caps->files[caps->file_count]) == 0) {
-                    caps->file_count++;
-                } else {
-                    fprintf(stderr, "Warning: Invalid file rule at line %d: %s\n", line_num, value);
-                }
+            struct file_rule *rule = caps_add_file_rule(caps);
+            if (!rule || parse_file_rule(caps, value, rule) != 0) {
+                if (rule) caps->file_count--;
+                parse_errors++;
+                fprintf(stderr, "Warning: Invalid file rule at line %d: %s\n", line_num, value);
             }
             
         } else if (strcmp(key, "env") == 0) {
-            if (caps->env_count < MAX_ENV_VARS) {
-                char *eq = strchr(value, '=');
-                if (eq) {
-                    *eq = '\0';
-                    strncpy(caps->env_vars[caps->env_count].name, value, 
-                            sizeof(caps->env_vars[caps->env_count].name) - 1);
-                    strncpy(caps->env_vars[caps->env_count].value, eq + 1, 
-                            sizeof(caps->env_vars[caps->env_count].value) - 1);
-                    caps->env_count++;
-                }
+            char *eq = strchr(value, '=');
+            struct env_var *var = eq ? caps_add_env_var(caps) : NULL;
+            if (var) {
+                *eq = '\0';
+                var->name = caps_intern(caps, value);
+                var->value = caps_intern(caps, eq + 1);
+            }
+            if (!var || !var->name || !var->value) {
+                if (var) caps->env_count--;
+                parse_errors++;
+                fprintf(stderr, "Warning: Invalid env rule at line %d: %s\n", line_num, value);
             }
             
         } else if (strcmp(key, "network_default") == 0) {
@@ -264,14 +444,21 @@ int load_capabilities(const char *filename, struct capabilities *caps) {
             caps->env_clear = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
             
         } else {
+            parse_errors++;
             fprintf(stderr, "Warning: Unknown capability at line %d: %s\n", line_num, key);
         }
     }
     
+    free(line);
     fclose(file);
     return 0;
 }
 
+/* Number of rejected lines in the last load_capabilities() call */
+int capability_parse_errors(void) {
+    return parse_errors;
+}
+
 void print_capabilities(const struct capabilities *caps) {
     printf("Capabilities:\n");
     printf("  User: %s%s\n", caps->username, caps->create_user ? " (auto-create)" : "");
@@ -285,13 +472,16 @@ void print_capabilities(const struct capabilities *caps) {
     if (caps->limits.max_files > 0) {
         printf("  Files: %d\n", caps->limits.max_files);
     }
+    if (caps->limits.max_cpu_percent > 0) {
+        printf("  CPU: %d%%\n", caps->limits.max_cpu_percent);
+    }
     
     printf("  Network rules: %d\n", caps->network_count);
     for (int i = 0; i < caps->network_count; i++) {
         const struct network_rule *rule = &caps->network[i];
         printf("    %s:", rule->protocol);
         if (rule->port > 0) printf("%d", rule->port);
-        if (strlen(rule->address) > 0) printf("%s", rule->address);
+        if (rule->address && *rule->address) printf("%s", rule->address);
         printf("\n");
     }
     
@@ -0,0 +1,438 @@
+/*
+ * Compiled capability files (.capsb)
+ *
+ * `isolate -C app.caps` validates and canonicalizes a capability file
+ * and writes app.capsb: a versioned header followed by a struct
+ * capabilities image whose rule vectors and strings follow it, with
+ * pointers stored as image offsets. Launches map the file privately,
+ * relocate those pointers and use the image in place instead of
+ * re-parsing text. The header records the source's mtime, size and
+ * content hash, so an edited source makes the compiled file stale and
+ * launches fall back to the text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "common.h"
+
+#define CAPSB_MAGIC "ISOCAPB"
+#define CAPSB_VERSION 2
+#define CAPSB_PAYLOAD_OFFSET 128
+
+struct capsb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t payload_offset;
+    uint64_t payload_size;      /* struct, vectors and strings */
+    uint32_t struct_size;       /* sizeof(struct capabilities) when written */
+    uint32_t reserved;
+    uint64_t source_hash;       /* FNV-1a of the source text */
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+};
+
+static int compiled_path(const char *filename, char *path, size_t path_size) {
+    size_t len = strlen(filename);
+
+    if (len > 6 && strcmp(filename + len - 6, ".capsb") == 0) {
+        return snprintf(path, path_size, "%s", filename) < (int)path_size ? 0 : -1;
+    }
+    return snprintf(path, path_size, "%sb", filename) < (int)path_size ? 0 : -1;
+}
+
+// The text a compiled file was built from: app.capsb -> app.caps
+static void source_path(const char *compiled, char *path, size_t path_size) {
+    snprintf(path, path_size, "%.*s", (int)strlen(compiled) - 1, compiled);
+}
+
+static int hash_file(const char *path, uint64_t *hash) {
+    char buf[8192];
+    ssize_t n;
+    uint64_t h = FNV_OFFSET;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        h = fnv1a64(h, buf, (size_t)n);
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    *hash = h;
+    return 0;
+}
+
+static int compare_file_rules(const void *a, const void *b) {
+    return strcmp(((const struct file_rule *)a)->path, ((const struct file_rule *)b)->path);
+}
+
+// One rule per path, parents before children; one value per env name
+static void canonicalize(struct capabilities *caps) {
+    int out = 0;
+
+    if (caps->file_count > 1) {
+        qsort(caps->files, caps->file_count, sizeof(caps->files[0]), compare_file_rules);
+    }
+    for (int i = 0; i < caps->file_count; i++) {
+        // Paths are interned, so equal paths share one string
+        if (out > 0 && caps->files[out - 1].path == caps->files[i].path) {
+            caps->files[out - 1].permissions |= caps->files[i].permissions;
+            continue;
+        }
+        if (out != i) {
+            caps->files[out] = caps->files[i];
+        }
+        out++;
+    }
+    caps->file_count = out;
+
+    // The last assignment of a name wins, as it does when applied in order
+    out = 0;
+    for (int i = 0; i < caps->env_count; i++) {
+        int overridden = 0;
+        for (int j = i + 1; j < caps->env_count; j++) {
+            if (caps->env_vars[i].name == caps->env_vars[j].name) {
+                overridden = 1;
+                break;
+            }
+        }
+        if (overridden) {
+            continue;
+        }
+        if (out != i) {
+            caps->env_vars[out] = caps->env_vars[i];
+        }
+        out++;
+    }
+    caps->env_count = out;
+}
+
+struct image_writer {
+    char *buf;
+    size_t used;
+};
+
+// Pointers inside the image are stored as offset + 1 so NULL stays NULL
+static void *image_put(struct image_writer *w, const void *data, size_t len, size_t align) {
+    if (!data) {
+        return NULL;
+    }
+    w->used = (w->used + align - 1) & ~(align - 1);
+    memcpy(w->buf + w->used, data, len);
+    uintptr_t encoded = w->used + 1;
+    w->used += len;
+    return (void *)encoded;
+}
+
+static const char *image_put_string(struct image_writer *w, const char *str) {
+    return str ? image_put(w, str, strlen(str) + 1, 1) : NULL;
+}
+
+static void *image_at(struct image_writer *w, const void *encoded) {
+    return w->buf + ((uintptr_t)encoded - 1);
+}
+
+static size_t image_size(const struct capabilities *caps) {
+    size_t size = sizeof(*caps) + 3 * 8;
+
+    size += caps->network_count * sizeof(caps->network[0]);
+    size += caps->file_count * sizeof(caps->files[0]);
+    size += caps->env_count * sizeof(caps->env_vars[0]);
+    for (int i = 0; i < caps->network_count; i++) {
+        size += caps->network[i].address ? strlen(caps->network[i].address) + 1 : 0;
+    }
+    for (int i = 0; i < caps->file_count; i++) {
+        size += strlen(caps->files[i].path) + 1;
+    }
+    for (int i = 0; i < caps->env_count; i++) {
+        size += strlen(caps->env_vars[i].name) + strlen(caps->env_vars[i].value) + 2;
+    }
+    return size;
+}
+
+static char *build_image(const struct capabilities *caps, size_t *size) {
+    struct image_writer w;
+
+    *size = image_size(caps);
+    w.buf = calloc(1, *size);
+    if (!w.buf) {
+        return NULL;
+    }
+
+    struct capabilities *image = (struct capabilities *)w.buf;
+    *image = *caps;
+    image->workspace_path = NULL;
+    image->platform_data = NULL;
+    image->arena = NULL;
+    image->network_capacity = caps->network_count;
+    image->file_capacity = caps->file_count;
+    image->env_capacity = caps->env_count;
+    w.used = sizeof(*image);
+
+    image->network = image_put(&w, caps->network_count ? caps->network : NULL,
+                               caps->network_count * sizeof(caps->network[0]), 8);
+    image->files = image_put(&w, caps->file_count ? caps->files : NULL,
+                             caps->file_count * sizeof(caps->files[0]), 8);
+    image->env_vars = image_put(&w, caps->env_count ? caps->env_vars : NULL,
+                                caps->env_count * sizeof(caps->env_vars[0]), 8);
+
+    for (int i = 0; i < caps->network_count; i++) {
+        struct network_rule *rule = image_at(&w, image->network);
+        rule[i].address = image_put_string(&w, caps->network[i].address);
+    }
+    for (int i = 0; i < caps->file_count; i++) {
+        struct file_rule *rule = image_at(&w, image->files);
+        rule[i].path = image_put_string(&w, caps->files[i].path);
+    }
+    for (int i = 0; i < caps->env_count; i++) {
+        struct env_var *var = image_at(&w, image->env_vars);
+        var[i].name = image_put_string(&w, caps->env_vars[i].name);
+        var[i].value = image_put_string(&w, caps->env_vars[i].value);
+    }
+
+    *size = w.used;
+    return w.buf;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int compile_capabilities(const char *filename) {
+    struct capabilities caps;
+    struct capsb_header header;
+    char output[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct stat st;
+    size_t size;
+
+    if (compiled_path(filename, output, sizeof(output)) != 0 || strcmp(output, filename) == 0) {
+        fprintf(stderr, "Error: %s is not a text capability file\n", filename);
+        return 1;
+    }
+
+    int ret = load_capabilities(filename, &caps);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Cannot read %s: %s\n", filename, strerror(ret));
+        return 1;
+    }
+    if (capability_parse_errors() > 0) {
+        fprintf(stderr, "Error: %s has %d invalid line(s), not compiled\n",
+                filename, capability_parse_errors());
+        free_capabilities(&caps);
+        return 1;
+    }
+    canonicalize(&caps);
+
+    char *image = build_image(&caps, &size);
+    if (!image) {
+        free_capabilities(&caps);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPSB_MAGIC, sizeof(CAPSB_MAGIC));
+    header.version = CAPSB_VERSION;
+    header.payload_offset = CAPSB_PAYLOAD_OFFSET;
+    header.payload_size = size;
+    header.struct_size = sizeof(caps);
+    if (stat(filename, &st) != 0 || hash_file(filename, &header.source_hash) != 0) {
+        fprintf(stderr, "Error: Cannot read %s: %s\n", filename, strerror(errno));
+        free(image);
+        free_capabilities(&caps);
+        return 1;
+    }
+    header.source_size = st.st_size;
+    header.source_mtime_sec = st.st_mtim.tv_sec;
+    header.source_mtime_nsec = st.st_mtim.tv_nsec;
+
+    // Write aside and rename so a launch never maps a half-written image
+    char pad[CAPSB_PAYLOAD_OFFSET - sizeof(header)];
+    memset(pad, 0, sizeof(pad));
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", output, getpid()) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", output, strerror(ENAMETOOLONG));
+        free(image);
+        free_capabilities(&caps);
+        return 1;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 ||
+        write_all(fd, &header, sizeof(header)) != 0 ||
+        write_all(fd, pad, sizeof(pad)) != 0 ||
+        write_all(fd, image, size) != 0 ||
+        close(fd) != 0 ||
+        rename(tmp, output) != 0) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", output, strerror(errno));
+        unlink(tmp);
+        free(image);
+        free_capabilities(&caps);
+        return 1;
+    }
+
+    printf("Compiled %s -> %s (%d file rules, %d network rules, %d env vars, %zu bytes)\n",
+           filename, output, caps.file_count, caps.network_count, caps.env_count, size);
+    free(image);
+    free_capabilities(&caps);
+    return 0;
+}
+
+static int source_matches(const struct capsb_header *header, const char *source) {
+    struct stat st;
+    uint64_t hash;
+
+    if (stat(source, &st) != 0) {
+        // Shipped without its source: the compiled file is authoritative
+        return errno == ENOENT;
+    }
+    if ((uint64_t)st.st_size != header->source_size) {
+        return 0;
+    }
+    if (st.st_mtim.tv_sec == header->source_mtime_sec &&
+        st.st_mtim.tv_nsec == header->source_mtime_nsec) {
+        return 1;
+    }
+    // Touched but possibly unchanged (checkout, copy): compare content
+    return hash_file(source, &hash) == 0 && hash == header->source_hash;
+}
+
+// Turns a stored offset back into a pointer, rejecting anything outside the image
+static void *resolve(const void *encoded, char *base, size_t size, size_t bytes, int *ok) {
+    uintptr_t offset = (uintptr_t)encoded;
+
+    if (offset == 0) {
+        return NULL;
+    }
+    offset--;
+    if (offset > size || bytes > size - offset) {
+        *ok = 0;
+        return NULL;
+    }
+    return base + offset;
+}
+
+static const char *resolve_string(const char *encoded, char *base, size_t size, int *ok) {
+    char *str = resolve(encoded, base, size, 1, ok);
+    if (str && !memchr(str, '\0', size - (str - base))) {
+        *ok = 0;
+        return NULL;
+    }
+    return str;
+}
+
+static int relocate_image(struct capabilities *image, size_t size) {
+    char *base = (char *)image;
+    int ok = 1;
+
+    if (image->network_count < 0 || image->file_count < 0 || image->env_count < 0 ||
+        memchr(image->username, '\0', sizeof(image->username)) == NULL) {
+        return -1;
+    }
+
+    image->network = resolve(image->network, base, size,
+                             (size_t)image->network_count * sizeof(*image->network), &ok);
+    image->files = resolve(image->files, base, size,
+                           (size_t)image->file_count * sizeof(*image->files), &ok);
+    image->env_vars = resolve(image->env_vars, base, size,
+                              (size_t)image->env_count * sizeof(*image->env_vars), &ok);
+    if (!ok || (image->network_count && !image->network) ||
+        (image->file_count && !image->files) || (image->env_count && !image->env_vars)) {
+        return -1;
+    }
+
+    for (int i = 0; i < image->network_count; i++) {
+        image->network[i].address = resolve_string(image->network[i].address, base, size, &ok);
+    }
+    for (int i = 0; i < image->file_count && ok; i++) {
+        image->files[i].path = resolve_string(image->files[i].path, base, size, &ok);
+        ok = ok && image->files[i].path;
+    }
+    for (int i = 0; i < image->env_count && ok; i++) {
+        image->env_vars[i].name = resolve_string(image->env_vars[i].name, base, size, &ok);
+        image->env_vars[i].value = resolve_string(image->env_vars[i].value, base, size, &ok);
+        ok = ok && image->env_vars[i].name && image->env_vars[i].value;
+    }
+
+    image->workspace_path = NULL;
+    image->platform_data = NULL;
+    image->arena = NULL;
+    return ok ? 0 : -1;
+}
+
+int map_compiled_capabilities(const char *filename, struct capabilities **caps) {
+    char compiled[PATH_MAX];
+    char source[PATH_MAX];
+    struct stat st;
+
+    if (compiled_path(filename, compiled, sizeof(compiled)) != 0) {
+        return -1;
+    }
+    int fd = open(compiled, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < CAPSB_PAYLOAD_OFFSET + sizeof(**caps)) {
+        close(fd);
+        return -1;
+    }
+
+    // Private mapping: relocation and the launcher's own adjustments stay local
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct capsb_header *header = map;
+    struct capabilities *image = (struct capabilities *)((char *)map + CAPSB_PAYLOAD_OFFSET);
+    if (memcmp(header->magic, CAPSB_MAGIC, sizeof(CAPSB_MAGIC)) != 0 ||
+        header->version != CAPSB_VERSION ||
+        header->payload_offset != CAPSB_PAYLOAD_OFFSET ||
+        header->struct_size != sizeof(*image) ||
+        header->payload_size < sizeof(*image) ||
+        header->payload_size > (uint64_t)st.st_size - CAPSB_PAYLOAD_OFFSET) {
+        fprintf(stderr, "Warning: %s is not a usable compiled capability file, ignoring\n", compiled);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    source_path(compiled, source, sizeof(source));
+    if (!source_matches(header, source)) {
+        fprintf(stderr, "Warning: %s is out of date, using %s (recompile with -C)\n", compiled, source);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Only the pages holding pointers are touched (and privately copied)
+    if (relocate_image(image, header->payload_size) != 0) {
+        fprintf(stderr, "Warning: %s is corrupt, ignoring\n", compiled);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    *caps = image;
+    return 0;
+}
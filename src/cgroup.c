@@ -0,0 +1,204 @@
+/*
+ * cgroup v2 resource control for the Linux backend
+ *
+ * Each instance gets one leaf cgroup under <cgroup2 mount>/isolate.
+ * All control files are written with openat()/write() on directory
+ * descriptors, so no helper processes are involved.
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "common.h"
+
+#define CGROUP_PARENT "isolate"
+#define CGROUP_CONTROLLERS "+memory +pids +cpu"
+#define CPU_PERIOD_USEC 100000
+
+static int parent_fd = -1;
+static int instance_fd = -1;
+static char instance_name[64];
+
+static int open_cgroup2_mount(void) {
+    static const char *candidates[] = {
+        "/sys/fs/cgroup", "/sys/fs/cgroup/unified", NULL
+    };
+    struct statfs sfs;
+
+    // Pure v2 hosts mount it at the top, hybrid hosts under unified/
+    for (int i = 0; candidates[i]; i++) {
+        if (statfs(candidates[i], &sfs) == 0 && sfs.f_type == CGROUP2_SUPER_MAGIC) {
+            return open(candidates[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+static int write_control(int dirfd, const char *file, const char *value) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = (ssize_t)strlen(value);
+    ssize_t written = write(fd, value, len);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return written == len ? 0 : -1;
+}
+
+static void enable_controllers(int dirfd) {
+    // Controllers the kernel lacks are rejected as a whole; fall back per controller
+    if (write_control(dirfd, "cgroup.subtree_control", CGROUP_CONTROLLERS) == 0) {
+        return;
+    }
+    write_control(dirfd, "cgroup.subtree_control", "+memory");
+    write_control(dirfd, "cgroup.subtree_control", "+pids");
+    write_control(dirfd, "cgroup.subtree_control", "+cpu");
+}
+
+int cgroup_create_instance(const char *name, const struct resource_limits *limits) {
+    char value[64];
+
+    int root_fd = open_cgroup2_mount();
+    if (root_fd < 0) {
+        fprintf(stderr, "Warning: cgroup v2 not available, resource limits not enforced\n");
+        return -1;
+    }
+
+    // The root cgroup is exempt from the no-internal-processes rule
+    enable_controllers(root_fd);
+    if (mkdirat(root_fd, CGROUP_PARENT, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: Failed to create cgroup %s: %s\n", CGROUP_PARENT, strerror(errno));
+        close(root_fd);
+        return -1;
+    }
+    parent_fd = openat(root_fd, CGROUP_PARENT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(root_fd);
+    if (parent_fd < 0) {
+        return -1;
+    }
+    enable_controllers(parent_fd);
+
+    strncpy(instance_name, name, sizeof(instance_name) - 1);
+    instance_name[sizeof(instance_name) - 1] = '\0';
+    if (mkdirat(parent_fd, instance_name, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: Failed to create cgroup %s: %s\n", instance_name, strerror(errno));
+        cgroup_cleanup_instance();
+        return -1;
+    }
+    instance_fd = openat(parent_fd, instance_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (instance_fd < 0) {
+        cgroup_cleanup_instance();
+        return -1;
+    }
+
+    if (limits->memory_bytes > 0) {
+        printf("Setting memory limit: %zu bytes\n", limits->memory_bytes);
+        snprintf(value, sizeof(value), "%zu", limits->memory_bytes);
+        if (write_control(instance_fd, "memory.max", value) != 0) {
+            fprintf(stderr, "Warning: Failed to set memory limit: %s\n", strerror(errno));
+        }
+    }
+
+    if (limits->max_processes > 0) {
+        printf("Setting process limit: %d\n", limits->max_processes);
+        snprintf(value, sizeof(value), "%d", limits->max_processes);
+        if (write_control(instance_fd, "pids.max", value) != 0) {
+            fprintf(stderr, "Warning: Failed to set process limit: %s\n", strerror(errno));
+        }
+    }
+
+    if (limits->max_cpu_percent > 0) {
+        // Percent of one CPU; values above 100 span several CPUs
+        printf("Setting CPU limit: %d%%\n", limits->max_cpu_percent);
+        snprintf(value, sizeof(value), "%ld %d",
+                 (long)limits->max_cpu_percent * CPU_PERIOD_USEC / 100, CPU_PERIOD_USEC);
+        if (write_control(instance_fd, "cpu.max", value) != 0) {
+            fprintf(stderr, "Warning: Failed to set CPU limit: %s\n", strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+int cgroup_instance_fd(void) {
+    return instance_fd;
+}
+
+int cgroup_attach_instance(pid_t pid) {
+    char value[32];
+
+    if (instance_fd < 0) {
+        return -1;
+    }
+    snprintf(value, sizeof(value), "%d", pid);
+    return write_control(instance_fd, "cgroup.procs", value);
+}
+
+void cgroup_cleanup_instance(void) {
+    if (instance_fd >= 0) {
+        // Reap stragglers (kernel 5.14+) so the leaf can be removed
+        write_control(instance_fd, "cgroup.kill", "1");
+        close(instance_fd);
+        instance_fd = -1;
+    }
+
+    if (parent_fd >= 0) {
+        if (instance_name[0] != '\0') {
+            for (int i = 0; i < 100; i++) {
+                if (unlinkat(parent_fd, instance_name, AT_REMOVEDIR) == 0 || errno != EBUSY) {
+                    break;
+                }
+                usleep(1000);
+            }
+            instance_name[0] = '\0';
+        }
+        close(parent_fd);
+        parent_fd = -1;
+    }
+}
+
+// Forget the instance without removing it; whoever detached it cleans up later
+void cgroup_detach_instance(void) {
+    if (instance_fd >= 0) {
+        close(instance_fd);
+        instance_fd = -1;
+    }
+    if (parent_fd >= 0) {
+        close(parent_fd);
+        parent_fd = -1;
+    }
+    instance_name[0] = '\0';
+}
+
+// Reopen an existing instance cgroup so cgroup_cleanup_instance() can remove it
+int cgroup_open_instance(const char *name) {
+    int root_fd = open_cgroup2_mount();
+    if (root_fd < 0) {
+        return -1;
+    }
+    parent_fd = openat(root_fd, CGROUP_PARENT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(root_fd);
+    if (parent_fd < 0) {
+        return -1;
+    }
+
+    strncpy(instance_name, name, sizeof(instance_name) - 1);
+    instance_name[sizeof(instance_name) - 1] = '\0';
+    instance_fd = openat(parent_fd, instance_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return instance_fd >= 0 ? 0 : -1;
+}
+
+#endif /* __linux__ */
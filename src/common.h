@@ -1,34 +1,56 @@
 #ifndef ISOLATE_COMMON_H
 #define ISOLATE_COMMON_H
 
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <limits.h>
 
-#define MAX_NETWORK_RULES 16
-#define MAX_FILE_RULES 32
-#define MAX_ENV_VARS 32
-#define MAX_CAPABILITY_HINTS 64
+/* Persistent state (rootfs templates, UID allocations), overridable with ISOLATE_STATE_DIR */
+#ifdef __FreeBSD__
+#define ISOLATE_STATE_DIR "/var/db/isolate"
+#else
+#define ISOLATE_STATE_DIR "/var/lib/isolate"
+#endif
 
 /* Network access rule */
 struct network_rule {
     char protocol[8];    /* tcp, udp, unix */
-    char address[256];   /* IP or path for unix sockets */
+    const char *address; /* IP or path for unix sockets (arena string) */
     int port;           /* -1 for any port */
     int direction;      /* 0=both, 1=outbound, 2=inbound */
 };
 
 /* File access rule */
 struct file_rule {
-    char path[PATH_MAX];
+    const char *path;   /* interned arena string */
     int permissions;    /* R_OK, W_OK, X_OK bitfield */
 };
 
 /* Environment variable rule */
 struct env_var {
-    char name[256];
-    char value[1024];
+    const char *name;
+    const char *value;
 };
 
+/* FNV-1a for fingerprints, cache keys and hash tables (not collision resistant) */
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME 1099511628211ULL
+
+static inline uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/* Bump allocator owning a capability set's rules and strings */
+struct caps_arena;
+
 /* Resource limits */
 struct resource_limits {
     size_t memory_bytes;    /* 0 = no limit */
@@ -46,21 +68,21 @@ struct capabilities {
     gid_t target_gid;       /* GID to run as (0 = not set) */
 
     /* Workspace */
-    char workspace_path[PATH_MAX];  /* Host path to mount as /workspace */
+    const char *workspace_path;     /* Host path to mount as /workspace, NULL if none */
     
     /* Network access */
     int network_count;
-    struct network_rule network[MAX_NETWORK_RULES];
+    struct network_rule *network;
     int network_default_deny;  /* 1 = deny by default */
     
     /* File system access */
     int file_count;
-    struct file_rule files[MAX_FILE_RULES];
+    struct file_rule *files;
     int fs_default_deny;    /* 1 = deny by default */
     
     /* Environment */
     int env_count;
-    struct env_var env_vars[MAX_ENV_VARS];
+    struct env_var *env_vars;
     int env_clear;          /* 1 = clear all env vars first */
     
     /* Resource limits */
@@ -68,6 +90,12 @@ struct capabilities {
     
     /* Platform-specific data */
     void *platform_data;
+
+    /* Storage for the vectors and strings above (NULL when mapped) */
+    struct caps_arena *arena;
+    int network_capacity;
+    int file_capacity;
+    int env_capacity;
 };
 
 /* Capability detection structures */
@@ -78,8 +106,68 @@ struct capability_hint {
 };
 
 struct detection_result {
-    struct capability_hint hints[MAX_CAPABILITY_HINTS];
+    struct capability_hint *hints;
+    int hint_count;
+    int hint_capacity;
+    FILE *log;                  /* progress messages, stdout when NULL */
+};
+
+/* Outcome of one detection run, for batch reports */
+struct detection_report {
     int hint_count;
+    int cached;                 /* results came from the detection cache */
+};
+
+/* Decoded view of a mapped ELF file (strings point into the mapping) */
+#define ELF_MAX_NEEDED 64
+
+struct elf_info {
+    const unsigned char *map;
+    size_t size;
+    int is64;
+    int big_endian;
+    unsigned type;              /* e_type: executable, shared object, ... */
+    unsigned machine;           /* e_machine: the loader skips other architectures */
+    int is_dynamic;             /* has PT_DYNAMIC */
+    const char *interp;         /* PT_INTERP, NULL for static binaries */
+    const char *needed[ELF_MAX_NEEDED];
+    int needed_count;
+    const char *runpath;        /* DT_RUNPATH */
+    const char *rpath;          /* DT_RPATH */
+
+    /* Internal layout */
+    size_t phoff, phentsize, phnum;
+    size_t shoff, shentsize, shnum, shstrndx;
+    size_t dynstr_offset, dynstr_size;
+    size_t dynsym_offset, dynsym_entsize, dynsym_count;
+};
+
+/* Transitive shared library closure of a binary (strings live for the process) */
+struct lib_dependency {
+    const char *name;           /* DT_NEEDED entry */
+    const char *path;           /* where the loader finds it, NULL if nowhere */
+};
+
+struct lib_closure {
+    char *interp;               /* PT_INTERP, NULL for static binaries */
+    struct lib_dependency *deps;
+    int count, capacity;
+    int used_cache;             /* some library was found through the loader cache */
+};
+
+/* Multi-pattern matcher: patterns are added, then compiled once by ac_build */
+struct ac_automaton {
+    unsigned char byte_class[256];
+    int classes;
+    int states;
+    int *next;                  /* states x classes transition table */
+    int *output;                /* first output of each state, -1 if none */
+    int *dict;                  /* nearest suffix state with output, 0 if none */
+    struct ac_output *outputs;
+    int output_count, output_capacity;
+    struct ac_pattern *patterns;
+    int pattern_count, pattern_capacity;
+    int built;
 };
 
 /* Function prototypes */
@@ -87,19 +175,168 @@ struct detection_result {
 /* Capability file parsing */
 int load_capabilities(const char *filename, struct capabilities *caps);
 void init_default_capabilities(struct capabilities *caps);
+void free_capabilities(struct capabilities *caps);
 void print_capabilities(const struct capabilities *caps);
+const char *caps_intern(struct capabilities *caps, const char *str);
+struct network_rule *caps_add_network_rule(struct capabilities *caps);
+struct file_rule *caps_add_file_rule(struct capabilities *caps);
+struct env_var *caps_add_env_var(struct capabilities *caps);
+int capability_parse_errors(void);
+
+/* Compiled capability files */
+int compile_capabilities(const char *filename);
+int map_compiled_capabilities(const char *filename, struct capabilities **caps);
 
 /* Capability detection */
 int detect_capabilities(const char *binary, const char *output_file);
+int detect_capabilities_log(const char *binary, const char *output_file, FILE *log,
+                            struct detection_report *report);
+int detect_batch(const char *target, const char *output_dir, int jobs);
+int learn_capabilities(const char *binary, char *const argv[], const char *output_file, int seconds);
 int analyze_binary_dependencies(const char *binary, struct detection_result *result);
 int analyze_binary_symbols(const char *binary, struct detection_result *result);
 int analyze_binary_strings(const char *binary, struct detection_result *result);
 int analyze_application_patterns(const char *binary, struct detection_result *result);
 int generate_capability_file(const char *binary, const char *output_file, struct detection_result *result);
+int write_merged_capabilities(FILE *file, const struct detection_result *result);
+int add_capability_hint(struct detection_result *result, int confidence,
+                        const char *description, const char *capability);
+void free_detection_result(struct detection_result *result);
+
+/* Persistent detection cache */
+int detect_cache_key(const char *binary, unsigned long long salt, char *key, size_t size);
+int detect_cache_lookup(const char *key, struct detection_result *result);
+int detect_cache_store(const char *key, const struct detection_result *result);
+void detect_cache_counters(unsigned long long *hits, unsigned long long *misses, unsigned long long *evictions);
+
+/* Printable string scanning (strings(1) without the process) */
+int strscan_printable(const unsigned char *data, size_t size, size_t min_len,
+                      int (*visit)(const char *str, size_t len, void *ctx), void *ctx);
+const char *strscan_implementation(void);
+
+/* Shared library resolution (memoized across binaries) */
+int resolve_closure(const char *binary, struct lib_closure *closure);
+void free_lib_closure(struct lib_closure *closure);
+const char *resolver_cache_file(void);
+const char *const *resolver_config_files(void);
+
+/* Aho-Corasick matching */
+int ac_add(struct ac_automaton *ac, const char *pattern, int id);
+int ac_build(struct ac_automaton *ac);
+int ac_search(const struct ac_automaton *ac, const char *text, size_t len,
+              int (*visit)(int id, size_t start, size_t end, void *ctx), void *ctx);
+void ac_free(struct ac_automaton *ac);
+
+/* ELF inspection (no child processes) */
+int elf_open(const char *path, struct elf_info *elf);
+void elf_close(struct elf_info *elf);
+int elf_dynamic_symbols(const struct elf_info *elf, int (*visit)(const char *name, void *ctx), void *ctx);
+int elf_static_symbols(const struct elf_info *elf, int (*visit)(const char *name, void *ctx), void *ctx);
+int elf_section(const struct elf_info *elf, const char *name, const unsigned char **data, size_t *size);
+int elf_build_id(const struct elf_info *elf, const unsigned char **id, size_t *size);
+
+/* Launch timing (-T): monotonic timestamps taken by the launcher */
+enum timing_mark {
+    TIMING_START,               /* options parsed from here */
+    TIMING_FORK,
+    TIMING_FIRST_BYTE,          /* first byte of the instance's output */
+    TIMING_EXITED,
+    TIMING_CLEANED,
+    TIMING_MARK_COUNT
+};
+
+enum timing_format { TIMING_OFF, TIMING_TABLE, TIMING_JSON };
+
+// Monotonic nanoseconds, the one clock every isolate timer reads
+static inline uint64_t timing_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void timing_mark(enum timing_mark mark);
+int timing_parse_format(const char *name);
+
+/* Setup protocol: framed messages from the instance child to its launcher */
+#define SETUP_PROTOCOL_VERSION 1
+#define SETUP_MAX_NAMESPACES 8
+
+enum setup_phase {
+    SETUP_PHASE_NONE,
+    SETUP_PHASE_USER,           /* ephemeral user (FreeBSD) */
+    SETUP_PHASE_ROOTFS,         /* instance root and template layer */
+    SETUP_PHASE_FILESYSTEM,     /* binary, devices and capability mounts */
+    SETUP_PHASE_JAIL,           /* jail creation (FreeBSD) */
+    SETUP_PHASE_LIMITS,
+    SETUP_PHASE_NETWORK,
+    SETUP_PHASE_ATTACH,         /* jail_attach, or hostname and pivot_root */
+    SETUP_PHASE_CREDENTIALS,
+    SETUP_PHASE_EXEC,
+    SETUP_PHASE_COUNT
+};
+
+enum setup_message {
+    SETUP_MSG_TIMES = 1,        /* child: uint64 phase start times, then end */
+    SETUP_MSG_ERROR,            /* child: int32 errno, uint32 phase */
+    SETUP_MSG_JAIL,             /* child: int32 jail ID */
+    SETUP_MSG_USER,             /* child: uint32 ephemeral UID, user name */
+    SETUP_MSG_ROOT,             /* child: instance root path */
+    SETUP_MSG_NAMESPACES,       /* child: uint32 CLONE_NEW* per SCM_RIGHTS descriptor */
+    SETUP_MSG_READY,            /* child: about to exec, waiting for an answer */
+    SETUP_MSG_GO,               /* parent: exec */
+    SETUP_MSG_ABORT             /* parent: exit without exec */
+};
+
+enum setup_result { SETUP_PENDING, SETUP_READY, SETUP_EXECUTED, SETUP_FAILED };
+
+/* What the parent learned about one setup */
+struct setup_report {
+    int phase;                  /* phase in progress, or the one that failed */
+    int error;                  /* errno of a failed setup */
+    uint64_t released;          /* when GO was sent, or 0 */
+    uint64_t executed;          /* when the channel closed on execv */
+    uint64_t phase_start[SETUP_PHASE_COUNT];   /* child clock; [NONE]: setup began */
+    uint64_t setup_end;
+    int jid;
+    uid_t uid;
+    char username[64];
+    char root_path[PATH_MAX];
+    int ns_fds[SETUP_MAX_NAMESPACES];
+    unsigned int ns_types[SETUP_MAX_NAMESPACES];
+    int ns_count;
+};
+
+int setup_channel(int fds[2]);
+const char *setup_phase_name(int phase);
+void setup_child_channel(int fd);
+int setup_send(int type, const void *data, size_t len, const int *fds, int count);
+void setup_phase(enum setup_phase phase);
+void setup_fail(int error);
+int setup_ready(void);
+void setup_report_init(struct setup_report *report);
+int setup_step(int fd, struct setup_report *report);
+int setup_receive(int fd, struct setup_report *report);
+int setup_release(int fd, struct setup_report *report, int go);
+void setup_close_namespaces(struct setup_report *report);
+
+void timing_report(int format, const struct setup_report *report);
+
+/* Platform state of one instance, enough to clean it up after the
+ * backend has moved on to the next instance */
+struct isolation_state {
+    char name[64];              /* instance (Linux) or jail (FreeBSD) name */
+    uid_t uid;                  /* ephemeral UID to release, or (uid_t)-1 */
+    int jid;                    /* FreeBSD jail ID, or -1 */
+};
 
 /* Platform abstraction */
+pid_t fork_isolation_context(const struct capabilities *caps);
 int create_isolation_context(const struct capabilities *caps);
 void cleanup_isolation_context(void);
+int send_isolation_state(void);
+void receive_isolation_state(const struct setup_report *report);
+void detach_isolation_state(struct isolation_state *state);
+void cleanup_isolation_state(const struct isolation_state *state);
 
 /* Platform-specific implementations */
 #ifdef __FreeBSD__
@@ -111,16 +348,99 @@ void freebsd_set_jail_path(const char *path);
 int freebsd_get_jail_id(void);
 const char* freebsd_get_username(void);
 const char* freebsd_get_jail_path(void);
+void freebsd_set_ephemeral_uid(uid_t uid);
+uid_t freebsd_get_ephemeral_uid(void);
+void freebsd_detach_isolation(struct isolation_state *state);
+void freebsd_restore_isolation(const struct isolation_state *state);
 #endif
 
 #ifdef __linux__
+pid_t linux_fork_isolation(const struct capabilities *caps);
 int linux_create_isolation(const struct capabilities *caps);
 void linux_cleanup_isolation(void);
+void linux_detach_isolation(struct isolation_state *state);
+void linux_restore_isolation(const struct isolation_state *state);
+int linux_send_namespaces(void);
+
+/* cgroup v2 resource control */
+int cgroup_create_instance(const char *name, const struct resource_limits *limits);
+int cgroup_instance_fd(void);
+int cgroup_attach_instance(pid_t pid);
+void cgroup_cleanup_instance(void);
+void cgroup_detach_instance(void);
+int cgroup_open_instance(const char *name);
 #endif
 
+/* Target binary staging strategies, cheapest first */
+enum stage_method {
+    STAGE_NONE,
+    STAGE_BIND,      /* read-only bind/nullfs mount of the single file */
+    STAGE_WRITABLE_BIND, /* the same for a writable file rule */
+    STAGE_REFLINK,   /* FICLONE shared extents */
+    STAGE_HARDLINK,  /* same filesystem only */
+    STAGE_COPY       /* copy_file_range fallback */
+};
+
+/* Native filesystem operations (no helper processes) */
+int fsops_open_dir(const char *path);
+int fsops_mkdirs(int dirfd, const char *path, mode_t mode);
+int fsops_chmod(int dirfd, const char *path, mode_t mode);
+int fsops_create_file(int dirfd, const char *path, mode_t mode);
+int fsops_copy_file(const char *source, int dirfd, const char *target, mode_t mode);
+int fsops_bind_mount(const char *source, const char *target, int writable);
+int fsops_mount_fs(const char *fstype, const char *target, unsigned long flags, const char *data);
+int fsops_unmount_tree(const char *root);
+int fsops_remove_tree(const char *path);
+int fsops_reclaim_tree(const char *path);
+int fsops_stage_file(const char *source, int dirfd, const char *dir_path, const char *name,
+                     enum stage_method *method);
+int fsops_stage_path(const char *source, int root_fd, const char *root_path, int writable,
+                     enum stage_method *method);
+const char *fsops_stage_method_name(enum stage_method method);
+unsigned long fsops_syscall_count(void);
+
+/* Signal forwarding from the launcher to its instance */
+#define FORWARD_DEFAULT_GRACE 10   /* seconds between a stop signal and SIGKILL */
+
+struct forward_config {
+    sigset_t signals;               /* passed on to the instance */
+    int grace_seconds;              /* after SIGTERM/SIGINT/SIGQUIT; 0 waits forever */
+    int relay_fd;                   /* instance stdout to copy to ours (-T), or -1 */
+    int control_fd;                 /* int32 signal numbers relayed by a pool client, or -1 */
+};
+
+void forward_default_config(struct forward_config *config);
+int forward_parse_signals(const char *list, sigset_t *set);
+int forward_block_signals(const struct forward_config *config, sigset_t *saved);
+int forward_wait(pid_t pid, const struct forward_config *config, int *status);
+int forward_stop_pending(void);
+
+/* Warm pool of prepared contexts */
+int pool_socket_path(const char *target_binary, char *path, size_t path_size);
+int pool_serve(const char *target_binary, const struct capabilities *caps, int size,
+               const struct forward_config *forward);
+int pool_claim(const char *target_binary, char *const args[], const struct forward_config *forward,
+               int *status);
+#define SEND_FDS_MAX 8             /* descriptors per send_fds() message */
+int send_fds(int sock, const int *fds, int count, const void *data, size_t len);
+int recv_fds(int sock, int *fds, int max, void *data, size_t len);
+
+/* Manifest-driven launch of many instances */
+int fleet_launch(const char *manifest, int jobs, int supervise, int dry_run, int verbose);
+
+/* Ephemeral UID/GID allocation (no password database entries) */
+int uid_range_acquire(pid_t owner, uid_t *uid);
+void uid_range_release(uid_t uid);
+
+/* Rootfs templates */
+const char *template_state_dir(void);
+int template_prepare(const struct capabilities *caps, char *path, size_t path_size);
+int template_populate(int dirfd, const struct capabilities *caps);
+int template_mount(const char *template_path, const char *root);
+
 /* Utility functions */
 int parse_memory_size(const char *size_str, size_t *bytes);
-int parse_network_rule(const char *rule_str, struct network_rule *rule);
-int parse_file_rule(const char *rule_str, struct file_rule *rule);
+int parse_network_rule(struct capabilities *caps, const char *rule_str, struct network_rule *rule);
+int parse_file_rule(struct capabilities *caps, const char *rule_str, struct file_rule *rule);
 
 #endif /* ISOLATE_COMMON_H */
@@ -0,0 +1,304 @@
+/*
+ * Persistent detection cache
+ *
+ * Detection results depend only on the binary's contents (plus its name
+ * and the rule table, which the caller folds into a salt), so they are
+ * stored under a key made from the GNU build-id, or a content hash when
+ * the binary has none. Entries are refreshed on every hit and the least
+ * recently used ones are evicted once the directory grows past its
+ * size bound. Hit, miss and eviction counts live in a small shared
+ * counter file next to the entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "common.h"
+
+#define CACHE_MAGIC "ISODETC"
+#define CACHE_VERSION 1
+#define CACHE_DEFAULT_MAX (16 * 1024 * 1024)
+#define CACHE_STATS "stats"
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t hint_size;         /* sizeof(struct capability_hint) when written */
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct cache_counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct cache_entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    time_t mtime;
+};
+
+static char cache_dir[PATH_MAX];
+static int cache_state = -1;    /* 1 usable, -1 disabled */
+static struct cache_counters *counters;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static unsigned int temp_seq;
+
+static int cache_path(char *path, size_t size, const char *name) {
+    int len = snprintf(path, size, "%s/%s", cache_dir, name);
+    return len >= 0 && (size_t)len < size ? 0 : -1;
+}
+
+// ISOLATE_DETECT_CACHE names the directory ("off" disables caching);
+// otherwise root uses the state directory and users their cache home
+static void setup_cache(void) {
+    const char *dir = getenv("ISOLATE_DETECT_CACHE");
+    const char *home;
+
+    if (dir && strcmp(dir, "off") == 0) {
+        return;
+    }
+    if (dir && *dir) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    } else if (geteuid() == 0) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/detect", template_state_dir());
+    } else if ((home = getenv("XDG_CACHE_HOME")) && *home) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/isolate/detect", home);
+    } else if ((home = getenv("HOME")) && *home) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/isolate/detect", home);
+    } else {
+        return;
+    }
+    if (fsops_mkdirs(AT_FDCWD, cache_dir, 0755) != 0) {
+        return;
+    }
+
+    // A zero-filled counter file is valid, so concurrent first users agree
+    char path[PATH_MAX];
+    int fd = cache_path(path, sizeof(path), CACHE_STATS) == 0 ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 &&
+            ((size_t)st.st_size >= sizeof(*counters) || ftruncate(fd, sizeof(*counters)) == 0)) {
+            void *map = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                counters = map;
+            }
+        }
+        close(fd);
+    }
+
+    cache_state = 1;
+}
+
+// Set up once per process; batch detection shares it across threads
+static int open_cache(void) {
+    pthread_once(&cache_once, setup_cache);
+    return cache_state > 0 ? 0 : -1;
+}
+
+#define COUNT(field) do { \
+    if (counters) __atomic_fetch_add(&counters->field, 1, __ATOMIC_RELAXED); \
+} while (0)
+
+// FNV-1a over 64-bit words: cheap enough to hash large binaries on every run
+static uint64_t hash_content(const unsigned char *data, size_t size) {
+    uint64_t h = FNV_OFFSET ^ size;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h ^= word;
+        h *= FNV_PRIME;
+        h ^= h >> 32;
+    }
+    return fnv1a64(h, data + i, size - i);
+}
+
+int detect_cache_key(const char *binary, unsigned long long salt, char *key, size_t size) {
+    struct elf_info elf;
+    const unsigned char *id;
+    size_t id_size;
+
+    if (open_cache() != 0 || elf_open(binary, &elf) != 0) {
+        return -1;
+    }
+
+    int len = 0;
+    if (elf_build_id(&elf, &id, &id_size) == 0 && id_size <= 64) {
+        len = snprintf(key, size, "b");
+        for (size_t i = 0; i < id_size && len < (int)size; i++) {
+            len += snprintf(key + len, size - len, "%02x", id[i]);
+        }
+    } else {
+        len = snprintf(key, size, "h%016llx", (unsigned long long)hash_content(elf.map, elf.size));
+    }
+    if (len < (int)size) {
+        len += snprintf(key + len, size - len, "-%016llx", salt);
+    }
+    elf_close(&elf);
+    return len < (int)size ? 0 : -1;
+}
+
+int detect_cache_lookup(const char *key, struct detection_result *result) {
+    char path[PATH_MAX];
+    struct cache_header header;
+    struct stat st;
+
+    if (open_cache() != 0 || cache_path(path, sizeof(path), key) != 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        COUNT(misses);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_VERSION ||
+        header.hint_size != sizeof(struct capability_hint) ||
+        (uint64_t)st.st_size != sizeof(header) + (uint64_t)header.count * header.hint_size) {
+        close(fd);
+        COUNT(misses);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header.count; i++) {
+        struct capability_hint hint;
+        if (read(fd, &hint, sizeof(hint)) != sizeof(hint)) {
+            close(fd);
+            free_detection_result(result);
+            COUNT(misses);
+            return -1;
+        }
+        hint.description[sizeof(hint.description) - 1] = '\0';
+        hint.capability[sizeof(hint.capability) - 1] = '\0';
+        add_capability_hint(result, hint.confidence, hint.description, hint.capability);
+    }
+
+    // The modification time doubles as the last-used time for eviction
+    futimens(fd, NULL);
+    close(fd);
+    COUNT(hits);
+    return 0;
+}
+
+static int older_first(const void *a, const void *b) {
+    const struct cache_entry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Drop least recently used entries until the directory fits its bound
+static void evict(void) {
+    const char *limit = getenv("ISOLATE_DETECT_CACHE_MAX");
+    size_t max = CACHE_DEFAULT_MAX;
+    struct cache_entry *entries = NULL;
+    int count_entries = 0, capacity = 0;
+    off_t total = 0;
+    struct dirent *de;
+
+    if (limit && *limit && parse_memory_size(limit, &max) != 0) {
+        max = CACHE_DEFAULT_MAX;
+    }
+
+    int dirfd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dirfd >= 0 ? fdopendir(dirfd) : NULL;
+    if (!dir) {
+        if (dirfd >= 0) close(dirfd);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        // Skip the counters and in-progress writes
+        if (de->d_name[0] == '.' || strcmp(de->d_name, CACHE_STATS) == 0 ||
+            fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct cache_entry *grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) {
+                break;
+            }
+            entries = grown;
+        }
+        snprintf(entries[count_entries].name, sizeof(entries[count_entries].name), "%s", de->d_name);
+        entries[count_entries].size = st.st_size;
+        entries[count_entries].mtime = st.st_mtime;
+        count_entries++;
+        total += st.st_size;
+    }
+
+    if ((size_t)total > max) {
+        qsort(entries, count_entries, sizeof(*entries), older_first);
+        for (int i = 0; i < count_entries && (size_t)total > max; i++) {
+            if (unlinkat(dirfd, entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+                COUNT(evictions);
+            }
+        }
+    }
+
+    free(entries);
+    closedir(dir);
+}
+
+int detect_cache_store(const char *key, const struct detection_result *result) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    struct cache_header header;
+
+    if (open_cache() != 0 || cache_path(path, sizeof(path), key) != 0) {
+        return -1;
+    }
+    int len = snprintf(temp, sizeof(temp), "%s/.%s.%d.%u", cache_dir, key, (int)getpid(),
+                       __atomic_fetch_add(&temp_seq, 1, __ATOMIC_RELAXED));
+    if (len < 0 || (size_t)len >= sizeof(temp)) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.hint_size = sizeof(struct capability_hint);
+    header.count = result->hint_count;
+
+    // Write aside and rename, so readers never see a partial entry
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t hints_size = (size_t)result->hint_count * sizeof(*result->hints);
+    int ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+             (hints_size == 0 || write(fd, result->hints, hints_size) == (ssize_t)hints_size);
+    if (close(fd) != 0 || !ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+
+    evict();
+    return 0;
+}
+
+void detect_cache_counters(unsigned long long *hits, unsigned long long *misses, unsigned long long *evictions) {
+    *hits = *misses = *evictions = 0;
+    if (open_cache() != 0 || !counters) {
+        return;
+    }
+    *hits = __atomic_load_n(&counters->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&counters->misses, __ATOMIC_RELAXED);
+    *evictions = __atomic_load_n(&counters->evictions, __ATOMIC_RELAXED);
+}
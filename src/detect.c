@@ -8,184 +8,638 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include "common.h"
 
-// Analyze binary dependencies using ldd
-int analyze_binary_dependencies(const char *binary, struct detection_result *result) {
-    char cmd[512];
-    FILE *pipe;
-    char line[256];
-    
-    printf("Analyzing library dependencies...\n");
-    
-    snprintf(cmd, sizeof(cmd), "ldd %s 2>/dev/null", binary);
-    pipe = popen(cmd, "r");
-    if (!pipe) {
-        fprintf(stderr, "Warning: Could not analyze dependencies\n");
-        return -1;
+// Append a hint, growing the result as needed
+int add_capability_hint(struct detection_result *result, int confidence,
+                        const char *description, const char *capability) {
+    if (result->hint_count == result->hint_capacity) {
+        int capacity = result->hint_capacity ? result->hint_capacity * 2 : 32;
+        struct capability_hint *hints = realloc(result->hints, capacity * sizeof(*hints));
+        if (!hints) {
+            return -1;
+        }
+        result->hints = hints;
+        result->hint_capacity = capacity;
     }
     
-    while (fgets(line, sizeof(line), pipe) && result->hint_count < MAX_CAPABILITY_HINTS - 4) {
-        struct capability_hint *hint = &result->hints[result->hint_count];
-        
-        if (strstr(line, "libc.so")) {
-            strcpy(hint->description, "Standard C library - basic filesystem access");
-            strcpy(hint->capability, "filesystem: /lib:r\nfilesystem: /usr/lib:r\nfilesystem: /libexec:r\nfilesystem: /usr/local/lib:r");
-            hint->confidence = 95;
-            result->hint_count++;
+    struct capability_hint *hint = &result->hints[result->hint_count++];
+    snprintf(hint->description, sizeof(hint->description), "%s", description);
+    snprintf(hint->capability, sizeof(hint->capability), "%s", capability);
+    hint->confidence = confidence;
+    return 0;
+}
+
+// Progress messages go to the caller's log, so batch workers never interleave
+static FILE *progress(const struct detection_result *result) {
+    return result->log ? result->log : stdout;
+}
+
+void free_detection_result(struct detection_result *result) {
+    free(result->hints);
+    result->hints = NULL;
+    result->hint_count = 0;
+    result->hint_capacity = 0;
+}
+
+/*
+ * Detection rules. Every library, symbol, string and name rule is
+ * compiled into one Aho-Corasick automaton, so the cost of scanning a
+ * name does not grow with the number of rules. A pattern may list
+ * alternatives separated by '|'; a rule reports at most once per name.
+ */
+enum rule_domain {
+    RULE_LIBRARY,       /* shared library soname */
+    RULE_SYMBOL,        /* dynamic symbol name */
+    RULE_STRING,        /* embedded string; first matching rule wins */
+    RULE_NAME           /* binary basename; first matching rule wins */
+};
+
+#define MATCH_START   0x01  /* pattern must begin the name */
+#define MATCH_END     0x02  /* pattern must end the name */
+#define MATCH_PATH    0x04  /* name must be an absolute path */
+#define MATCH_PLAIN   0x08  /* name must not contain '%' or spaces */
+#define MATCH_ABBREV  0x10  /* description shows at most 50 characters */
+#define MATCH_MORE    0x20  /* something must follow the pattern */
+
+#define SYMBOL_SOCKET   0x01
+#define SYMBOL_BIND     0x02
+#define SYMBOL_FILE     0x04
+#define SYMBOL_PROCESS  0x08
+
+struct detection_rule {
+    enum rule_domain domain;
+    const char *patterns;
+    int match;
+    int flag;               /* symbol rules: SYMBOL_* bit to set */
+    int confidence;
+    const char *description;    /* string rules: format taking the string */
+    const char *capability;     /* string rules: format taking the string */
+};
+
+static const struct detection_rule rules[] = {
+    {RULE_LIBRARY, "libssl|libcrypto", 0, 0, 80, "SSL/TLS library - likely needs network access", "network: tcp:443:outbound\nnetwork: tcp:80:outbound"},
+    {RULE_LIBRARY, "libpq", 0, 0, 85, "PostgreSQL library - needs database connection", "network: tcp:5432:outbound"},
+    {RULE_LIBRARY, "libmysql|libmariadb", 0, 0, 85, "MySQL library - needs database connection", "network: tcp:3306:outbound"},
+    {RULE_LIBRARY, "libX11|libgtk|libQt", 0, 0, 90, "GUI library - needs X11 access", "filesystem: /tmp/.X11-unix:rw\nenv: DISPLAY=/tmp/.X11-unix/X0"},
+    {RULE_LIBRARY, "libcurl", 0, 0, 85, "HTTP client library", "network: tcp:80:outbound\nnetwork: tcp:443:outbound"},
+
+    {RULE_SYMBOL, "socket", 0, SYMBOL_SOCKET, 0, NULL, NULL},
+    {RULE_SYMBOL, "bind|listen", 0, SYMBOL_BIND, 0, NULL, NULL},
+    {RULE_SYMBOL, "open|read|write", 0, SYMBOL_FILE, 0, NULL, NULL},
+    {RULE_SYMBOL, "fork|exec", 0, SYMBOL_PROCESS, 0, NULL, NULL},
+
+    {RULE_STRING, "/etc/", MATCH_START, 0, 60, "Configuration file: %s", "filesystem: %s:r"},
+    {RULE_STRING, "/var/", MATCH_START, 0, 65, "Data directory: %s", "filesystem: %s:rw"},
+    {RULE_STRING, "http://|https://", MATCH_START | MATCH_MORE | MATCH_ABBREV, 0, 70, "HTTP URL found: %s", "network: tcp:80:outbound\nnetwork: tcp:443:outbound"},
+    {RULE_STRING, "ftp://", MATCH_START | MATCH_MORE | MATCH_ABBREV, 0, 60, "FTP URL found: %s", "network: tcp:21:outbound"},
+    {RULE_STRING, ".conf|.cfg", MATCH_END | MATCH_PATH | MATCH_PLAIN, 0, 60, "Configuration file: %s", "filesystem: %s:r"},
+
+    {RULE_NAME, "httpd", 0, 0, 90, "Web server detected", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 256M"},
+    {RULE_NAME, "nginx", 0, 0, 90, "Nginx web server", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 128M"},
+    {RULE_NAME, "apache", 0, 0, 90, "Apache web server", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 256M"},
+    {RULE_NAME, "sshd", 0, 0, 95, "SSH server", "network: tcp:22:inbound\nfilesystem: /etc/ssh:r\nprocesses: 20"},
+    {RULE_NAME, "mysqld", 0, 0, 90, "MySQL database server", "network: tcp:3306:inbound\nfilesystem: /var/lib/mysql:rw\nmemory: 512M\nprocesses: 50"},
+    {RULE_NAME, "postgres", 0, 0, 90, "PostgreSQL database", "network: tcp:5432:inbound\nfilesystem: /var/lib/postgresql:rw\nmemory: 256M\nprocesses: 20"},
+    {RULE_NAME, "redis", 0, 0, 90, "Redis server", "network: tcp:6379:inbound\nfilesystem: /var/lib/redis:rw\nmemory: 128M"},
+    {RULE_NAME, "server", 0, 0, 60, "Generic server application", "network: tcp:8080:inbound\nmemory: 128M"},
+    {RULE_NAME, "client", 0, 0, 60, "Generic client application", "network: tcp:80:outbound\nnetwork: tcp:443:outbound"},
+    {RULE_NAME, "daemon", 0, 0, 70, "System daemon", "processes: 5\nfilesystem: /var/run:rw\nfilesystem: /var/log:w"},
+    {RULE_NAME, "bot", 0, 0, 65, "Bot application", "network: tcp:443:outbound\nfilesystem: /tmp:rw\nmemory: 64M"},
+};
+
+#define RULE_COUNT ((int)(sizeof(rules) / sizeof(rules[0])))
+
+static struct ac_automaton rule_matcher;
+static pthread_once_t rule_matcher_once = PTHREAD_ONCE_INIT;
+
+static void compile_rules(void) {
+    for (int i = 0; i < RULE_COUNT; i++) {
+        char *copy = strdup(rules[i].patterns);
+        char *save = NULL;
+        if (!copy) {
+            break;
         }
-        
-        if (strstr(line, "libssl") || strstr(line, "libcrypto")) {
-            strcpy(hint->description, "SSL/TLS library - likely needs network access");
-            strcpy(hint->capability, "network: tcp:443:outbound\nnetwork: tcp:80:outbound");
-            hint->confidence = 80;
-            result->hint_count++;
+        for (char *p = strtok_r(copy, "|", &save); p; p = strtok_r(NULL, "|", &save)) {
+            ac_add(&rule_matcher, p, i);
         }
-        
-        if (strstr(line, "libpq")) {
-            strcpy(hint->description, "PostgreSQL library - needs database connection");
-            strcpy(hint->capability, "network: tcp:5432:outbound");
-            hint->confidence = 85;
-            result->hint_count++;
+        free(copy);
+    }
+    if (ac_build(&rule_matcher) != 0) {
+        fprintf(stderr, "Warning: Could not compile detection rules: %s\n", strerror(errno));
+    }
+}
+
+// Compile the rule table on first use; batch workers share the result
+static const struct ac_automaton *detection_rules(void) {
+    pthread_once(&rule_matcher_once, compile_rules);
+    return &rule_matcher;
+}
+
+struct rule_hits {
+    enum rule_domain domain;
+    const char *name;
+    size_t len;
+    unsigned char hit[RULE_COUNT];
+    int first;              /* lowest matching rule, -1 if none */
+};
+
+static int record_hit(int id, size_t start, size_t end, void *ctx) {
+    struct rule_hits *hits = ctx;
+    const struct detection_rule *rule = &rules[id];
+
+    if (rule->domain != hits->domain || hits->hit[id]) {
+        return 0;
+    }
+    if (((rule->match & MATCH_START) && start != 0) ||
+        ((rule->match & MATCH_END) && end != hits->len) ||
+        ((rule->match & MATCH_MORE) && end == hits->len) ||
+        ((rule->match & MATCH_PATH) && hits->name[0] != '/') ||
+        ((rule->match & MATCH_PLAIN) && strpbrk(hits->name, "% "))) {
+        return 0;
+    }
+    hits->hit[id] = 1;
+    if (hits->first < 0 || id < hits->first) {
+        hits->first = id;
+    }
+    return 0;
+}
+
+// The terminating NUL keeps adjacent strings from running together
+static unsigned long long hash_string(unsigned long long h, const char *str) {
+    str = str ? str : "";
+    return fnv1a64(h, str, strlen(str) + 1);
+}
+
+static unsigned long long hash_identity(unsigned long long h, const char *path) {
+    struct stat st;
+    char identity[96];
+
+    if (stat(path, &st) != 0) {
+        return hash_string(h, "-");
+    }
+    snprintf(identity, sizeof(identity), "%llu:%llu:%lld:%lld", (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino, (long long)st.st_mtime, (long long)st.st_size);
+    return hash_string(h, identity);
+}
+
+// $ORIGIN ties library lookup to where this copy of the binary lives
+static unsigned long long hash_origin(unsigned long long h, const char *binary) {
+    struct elf_info elf;
+    char dir[PATH_MAX];
+
+    if (elf_open(binary, &elf) != 0) {
+        return h;
+    }
+    int origin = (elf.runpath && strstr(elf.runpath, "ORIGIN")) ||
+                 (elf.rpath && strstr(elf.rpath, "ORIGIN"));
+    elf_close(&elf);
+    if (origin && realpath(binary, dir)) {
+        char *slash = strrchr(dir, '/');
+        if (slash) {
+            *slash = '\0';
         }
+        h = hash_string(h, dir);
+    }
+    return h;
+}
+
+// Everything besides the binary's contents that detection results depend on:
+// the rules, and whatever decides which host paths the results name
+static unsigned long long detection_salt(const char *binary) {
+    const char *basename = strrchr(binary, '/');
+    const char *const *config = resolver_config_files();
+    unsigned long long h = FNV_OFFSET;
+    char number[32];
+    
+    for (int i = 0; i < RULE_COUNT; i++) {
+        snprintf(number, sizeof(number), "%d:%d:%d:%d", rules[i].domain, rules[i].match,
+                 rules[i].flag, rules[i].confidence);
+        h = hash_string(h, number);
+        h = hash_string(h, rules[i].patterns);
+        h = hash_string(h, rules[i].description);
+        h = hash_string(h, rules[i].capability);
+    }
+    h = hash_string(h, basename ? basename + 1 : binary);
+    h = hash_string(h, getenv("LD_LIBRARY_PATH"));
+    h = hash_string(h, getenv("PATH"));     // script interpreters
+    for (int i = 0; config[i]; i++) {
+        h = hash_identity(h, config[i]);
+    }
+    return hash_origin(h, binary);
+}
+
+// Find the rules of one domain that match a NUL-terminated name
+static void match_rules(enum rule_domain domain, const char *name, size_t len, struct rule_hits *hits) {
+    memset(hits->hit, 0, sizeof(hits->hit));
+    hits->domain = domain;
+    hits->name = name;
+    hits->len = len;
+    hits->first = -1;
+    ac_search(detection_rules(), name, len, record_hit, hits);
+}
+
+#define MAX_SCRIPT_DEPTH 4     /* nested "#!" interpreters the kernel follows */
+#define SHEBANG_MAX 256         /* bytes of the "#!" line the kernel reads */
+
+static int analyze_executable(const char *path, struct detection_result *result, int depth);
+
+// File rules for the loader, its cache and every library the loader would map;
+// library names also feed the library rules
+static void add_closure_hints(const char *binary, const struct lib_closure *closure,
+                              struct detection_result *result) {
+    struct rule_hits hits;
+    char description[256];
+    char capability[512];
+    
+    if (!closure->interp && closure->count == 0) {
+        fprintf(progress(result), "Static executable %s: no shared libraries needed\n", binary);
+        return;
+    }
+    if (closure->interp) {
+        snprintf(description, sizeof(description), "Program interpreter: %s", closure->interp);
+        snprintf(capability, sizeof(capability), "filesystem: %s:r", closure->interp);
+        add_capability_hint(result, 95, description, capability);
+    }
+    if (closure->used_cache) {
+        snprintf(capability, sizeof(capability), "filesystem: %s:r", resolver_cache_file());
+        add_capability_hint(result, 95, "Runtime loader cache", capability);
+    }
+    
+    for (int i = 0; i < closure->count; i++) {
+        const struct lib_dependency *dep = &closure->deps[i];
         
-        if (strstr(line, "libmysql") || strstr(line, "libmariadb")) {
-            strcpy(hint->description, "MySQL library - needs database connection");
-            strcpy(hint->capability, "network: tcp:3306:outbound");
-            hint->confidence = 85;
-            result->hint_count++;
+        if (dep->path) {
+            snprintf(description, sizeof(description), "Shared library: %s", dep->name);
+            snprintf(capability, sizeof(capability), "filesystem: %s:r", dep->path);
+            add_capability_hint(result, 95, description, capability);
+        } else {
+            fprintf(stderr, "Warning: Cannot locate %s needed by %s\n", dep->name, binary);
         }
         
-        if (strstr(line, "libX11") || strstr(line, "libgtk") || strstr(line, "libQt")) {
-            strcpy(hint->description, "GUI library - needs X11 access");
-            strcpy(hint->capability, "filesystem: /tmp/.X11-unix:rw\nenv: DISPLAY=/tmp/.X11-unix/X0");
-            hint->confidence = 90;
-            result->hint_count++;
+        match_rules(RULE_LIBRARY, dep->name, strlen(dep->name), &hits);
+        for (int r = hits.first; r >= 0 && r < RULE_COUNT; r++) {
+            if (hits.hit[r]) {
+                add_capability_hint(result, rules[r].confidence, rules[r].description, rules[r].capability);
+            }
         }
-        
-        if (strstr(line, "libcurl")) {
-            strcpy(hint->description, "HTTP client library");
-            strcpy(hint->capability, "network: tcp:80:outbound\nnetwork: tcp:443:outbound");
-            hint->confidence = 85;
-            result->hint_count++;
+    }
+}
+
+// Split a "#!" line into the interpreter and its single optional argument
+static int read_shebang(const char *path, char *interp, size_t interp_size, char *arg, size_t arg_size) {
+    char line[SHEBANG_MAX + 1];
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, line, SHEBANG_MAX);
+    close(fd);
+    if (len < 2 || line[0] != '#' || line[1] != '!') {
+        return -1;
+    }
+    line[len] = 0;
+    line[strcspn(line, "\n")] = 0;
+    
+    char *p = line + 2 + strspn(line + 2, " \t");
+    size_t n = strcspn(p, " \t");
+    if (n == 0 || n >= interp_size) {
+        return -1;
+    }
+    memcpy(interp, p, n);
+    interp[n] = 0;
+    
+    // Like the kernel, everything after the interpreter is one argument
+    p += n;
+    p += strspn(p, " \t");
+    n = strlen(p);
+    while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t' || p[n - 1] == '\r')) {
+        n--;
+    }
+    snprintf(arg, arg_size, "%.*s", (int)n, p);
+    return 0;
+}
+
+// Search PATH the way env(1) does
+static int find_in_path(const char *name, char *path, size_t size) {
+    const char *search = getenv("PATH");
+    if (!search || !*search) {
+        search = "/usr/local/bin:/usr/bin:/bin";
+    }
+    
+    while (*search) {
+        size_t n = strcspn(search, ":");
+        snprintf(path, size, "%.*s/%s", (int)n, search, name);
+        if (n > 0 && access(path, X_OK) == 0) {
+            return 0;
+        }
+        search += n;
+        search += *search == ':';
+    }
+    return -1;
+}
+
+// Language runtimes keep their modules next to the binary: /P/bin/python3.11
+// reads /P/lib/python3.11, perl /P/share/perl, and so on
+static void add_interpreter_dirs(const char *interp, struct detection_result *result) {
+    static const char *subdirs[] = {"lib", "share", NULL};
+    char real[PATH_MAX];
+    char names[3][NAME_MAX + 1];
+    char dir[PATH_MAX];
+    char description[PATH_MAX + 64];
+    char capability[PATH_MAX + 64];
+    struct stat st;
+    
+    if (!realpath(interp, real)) {
+        return;
+    }
+    char *base = strrchr(real, '/');
+    *base++ = 0;
+    char *bin = strrchr(real, '/');
+    if (!bin || strcmp(bin + 1, "bin") != 0) {
+        return;
+    }
+    *bin = 0;
+    
+    // python3.11, then python3, then python
+    snprintf(names[0], sizeof(names[0]), "%s", base);
+    snprintf(names[1], sizeof(names[1]), "%.*s", (int)strcspn(base, "."), base);
+    snprintf(names[2], sizeof(names[2]), "%s", names[1]);
+    size_t n = strlen(names[2]);
+    while (n > 1 && strchr("0123456789.", names[2][n - 1])) {
+        names[2][--n] = 0;
+    }
+    
+    for (int i = 0; i < 3; i++) {
+        if ((i > 0 && strcmp(names[i], names[i - 1]) == 0) || names[i][0] == 0) {
+            continue;
+        }
+        for (int s = 0; subdirs[s]; s++) {
+            int len = snprintf(dir, sizeof(dir), "%s/%s/%s", real, subdirs[s], names[i]);
+            if (len < 0 || (size_t)len >= sizeof(dir) || stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            snprintf(description, sizeof(description), "Interpreter library directory: %s", dir);
+            snprintf(capability, sizeof(capability), "filesystem: %s:r", dir);
+            add_capability_hint(result, 85, description, capability);
         }
     }
+}
+
+// A script needs its interpreter (and that interpreter's closure) in place
+// of any libraries of its own
+static int analyze_script(const char *script, struct detection_result *result, int depth) {
+    char interp[PATH_MAX];
+    char arg[SHEBANG_MAX];
+    char program[PATH_MAX];
+    char description[PATH_MAX + 64];
+    char capability[PATH_MAX + 64];
+    
+    if (read_shebang(script, interp, sizeof(interp), arg, sizeof(arg)) != 0) {
+        fprintf(stderr, "Warning: %s is neither an ELF executable nor a script\n", script);
+        return -1;
+    }
+    if (depth >= MAX_SCRIPT_DEPTH) {
+        fprintf(stderr, "Warning: Too many levels of script interpreters at %s\n", script);
+        return -1;
+    }
     
-    pclose(pipe);
+    snprintf(description, sizeof(description), "Script interpreter: %s", interp);
+    snprintf(capability, sizeof(capability), "filesystem: %s:rx", interp);
+    add_capability_hint(result, 95, description, capability);
+    if (analyze_executable(interp, result, depth + 1) != 0) {
+        return -1;
+    }
+    
+    // "#!/usr/bin/env prog" runs prog from PATH, which needs the same treatment
+    const char *name = strrchr(interp, '/');
+    if (strcmp(name ? name + 1 : interp, "env") != 0 || arg[0] == 0) {
+        add_interpreter_dirs(interp, result);
+        return 0;
+    }
+    char *word = arg;
+    if (strncmp(word, "-S", 2) == 0) {
+        word += 2;
+        word += strspn(word, " \t");
+    }
+    word[strcspn(word, " \t")] = 0;
+    if (word[0] == 0 || word[0] == '-') {
+        return 0;
+    }
+    if (strchr(word, '/')) {
+        snprintf(program, sizeof(program), "%s", word);
+    } else if (find_in_path(word, program, sizeof(program)) != 0) {
+        fprintf(stderr, "Warning: Cannot find %s in PATH for %s\n", word, script);
+        return -1;
+    }
+    
+    snprintf(description, sizeof(description), "Script interpreter (via env): %s", program);
+    snprintf(capability, sizeof(capability), "filesystem: %s:rx", program);
+    add_capability_hint(result, 95, description, capability);
+    if (analyze_executable(program, result, depth + 1) != 0) {
+        return -1;
+    }
+    add_interpreter_dirs(program, result);
     return 0;
 }
 
-// Analyze binary symbols for system calls
-int analyze_binary_symbols(const char *binary, struct detection_result *result) {
-    char cmd[512];
-    FILE *pipe;
-    char line[256];
-    
-    printf("Analyzing dynamic symbols...\n");
-    
-    snprintf(cmd, sizeof(cmd), "objdump -T %s 2>/dev/null | grep -E '(socket|bind|listen|connect|open|read|write|fork|exec)'", binary);
-    pipe = popen(cmd, "r");
-    if (!pipe) {
-        // Try nm as fallback
-        snprintf(cmd, sizeof(cmd), "nm -D %s 2>/dev/null | grep -E '(socket|bind|listen|connect|open|read|write|fork|exec)'", binary);
-        pipe = popen(cmd, "r");
-        if (!pipe) {
-            fprintf(stderr, "Warning: Could not analyze symbols\n");
-            return -1;
+static int analyze_executable(const char *path, struct detection_result *result, int depth) {
+    struct lib_closure closure;
+    
+    if (resolve_closure(path, &closure) != 0) {
+        if (errno == ENOEXEC) {
+            return analyze_script(path, result, depth);
         }
+        fprintf(stderr, "Warning: Could not analyze dependencies of %s: %s\n", path, strerror(errno));
+        return -1;
     }
+    add_closure_hints(path, &closure, result);
+    free_lib_closure(&closure);
+    return 0;
+}
+
+// Analyze what the binary needs in order to start: the shared library
+// closure for dynamic ELF, nothing for static ELF, and the interpreter
+// chain for "#!" scripts
+int analyze_binary_dependencies(const char *binary, struct detection_result *result) {
+    fprintf(progress(result), "Analyzing library dependencies...\n");
+    return analyze_executable(binary, result, 0);
+}
+
+static int scan_symbol(const char *name, void *ctx) {
+    int *flags = ctx;
+    struct rule_hits hits;
+    
+    match_rules(RULE_SYMBOL, name, strlen(name), &hits);
+    for (int r = hits.first; r >= 0 && r < RULE_COUNT; r++) {
+        if (hits.hit[r]) {
+            *flags |= rules[r].flag;
+        }
+    }
+    return 0;
+}
+
+// The Go runtime and internal packages are in every Go binary whatever
+// the program does, so only the packages it actually uses count
+static int scan_static_symbol(const char *name, void *ctx) {
+    if (strncmp(name, "runtime.", 8) == 0 || strncmp(name, "internal/", 9) == 0) {
+        return 0;
+    }
+    return scan_symbol(name, ctx);
+}
+
+// Analyze binary symbols for system calls
+int analyze_binary_symbols(const char *binary, struct detection_result *result) {
+    struct elf_info elf;
+    int flags = 0;
     
-    int has_socket = 0, has_bind = 0, has_file_ops = 0, has_process_ops = 0;
+    fprintf(progress(result), "Analyzing dynamic symbols...\n");
     
-    while (fgets(line, sizeof(line), pipe)) {
-        if (strstr(line, "socket")) has_socket = 1;
-        if (strstr(line, "bind") || strstr(line, "listen")) has_bind = 1;
-        if (strstr(line, "open") || strstr(line, "read") || strstr(line, "write")) has_file_ops = 1;
-        if (strstr(line, "fork") || strstr(line, "exec")) has_process_ops = 1;
+    if (elf_open(binary, &elf) != 0) {
+        // Scripts have no symbols; their interpreter is analyzed as a dependency
+        if (errno == ENOEXEC) {
+            return 0;
+        }
+        fprintf(stderr, "Warning: Could not analyze symbols: %s\n", strerror(errno));
+        return -1;
     }
+    // Static binaries import nothing, so look at what they link in instead
+    if (elf.dynsym_count > 0) {
+        elf_dynamic_symbols(&elf, scan_symbol, &flags);
+    } else {
+        elf_static_symbols(&elf, scan_static_symbol, &flags);
+    }
+    elf_close(&elf);
     
-    if (has_socket && result->hint_count < MAX_CAPABILITY_HINTS) {
-        struct capability_hint *hint = &result->hints[result->hint_count++];
-        strcpy(hint->description, "Socket operations detected");
-        if (has_bind) {
-            strcpy(hint->capability, "network: tcp:8080:inbound  # Server application");
-            hint->confidence = 85;
+    if (flags & SYMBOL_SOCKET) {
+        if (flags & SYMBOL_BIND) {
+            add_capability_hint(result, 85, "Socket operations detected",
+                                "network: tcp:8080:inbound  # Server application");
         } else {
-            strcpy(hint->capability, "network: tcp:80:outbound  # Client application");
-            hint->confidence = 75;
+            add_capability_hint(result, 75, "Socket operations detected",
+                                "network: tcp:80:outbound  # Client application");
         }
     }
     
-    if (has_file_ops && result->hint_count < MAX_CAPABILITY_HINTS) {
-        struct capability_hint *hint = &result->hints[result->hint_count++];
-        strcpy(hint->description, "File operations detected");
-        strcpy(hint->capability, "filesystem: /tmp:rw");
-        hint->confidence = 70;
+    if (flags & SYMBOL_FILE) {
+        add_capability_hint(result, 70, "File operations detected", "filesystem: /tmp:rw");
     }
     
-    if (has_process_ops && result->hint_count < MAX_CAPABILITY_HINTS) {
-        struct capability_hint *hint = &result->hints[result->hint_count++];
-        strcpy(hint->description, "Process management detected");
-        strcpy(hint->capability, "processes: 10  # Allow child processes");
-        hint->confidence = 80;
+    if (flags & SYMBOL_PROCESS) {
+        add_capability_hint(result, 80, "Process management detected",
+                            "processes: 10  # Allow child processes");
     }
     
-    pclose(pipe);
     return 0;
 }
 
-// Analyze embedded strings for paths and URLs
-int analyze_binary_strings(const char *binary, struct detection_result *result) {
-    char cmd[512];
-    FILE *pipe;
-    char line[256];
+#define MIN_STRING_LENGTH 4
+#define MAX_STRING_LENGTH 200
+
+// Classify one printable run as a path, URL or configuration file name
+static int scan_string(const char *str, size_t len, void *ctx) {
+    struct detection_result *result = ctx;
+    struct rule_hits hits;
+    char text[MAX_STRING_LENGTH + 1];
+    char shown[64];
+    char description[256];
+    char capability[512];
+    
+    // Very long runs are text or tables, not paths
+    if (len > MAX_STRING_LENGTH) {
+        return 0;
+    }
+    memcpy(text, str, len);
+    text[len] = 0;
     
-    printf("Analyzing embedded strings...\n");
+    match_rules(RULE_STRING, text, len, &hits);
+    if (hits.first < 0) {
+        return 0;
+    }
     
-    snprintf(cmd, sizeof(cmd), "strings %s | grep -E '^(/|http|ftp|.*\\.conf|.*\\.cfg)' | head -20", binary);
-    pipe = popen(cmd, "r");
-    if (!pipe) {
-        fprintf(stderr, "Warning: Could not analyze strings\n");
+    const struct detection_rule *rule = &rules[hits.first];
+    const char *subject = text;
+    if (rule->match & MATCH_ABBREV) {
+        snprintf(shown, sizeof(shown), "%.50s%s", text, len > 50 ? "..." : "");
+        subject = shown;
+    }
+    snprintf(description, sizeof(description), rule->description, subject);
+    snprintf(capability, sizeof(capability), rule->capability, text);
+    add_capability_hint(result, rule->confidence, description, capability);
+    return 0;
+}
+
+// Script text is split into words at whitespace, quotes and shell
+// punctuation, so a path in 'cat "/etc/app.conf"' is seen on its own
+static int scan_script(const char *script, struct detection_result *result) {
+    struct stat st;
+    
+    int fd = open(script, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    const char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
         return -1;
     }
     
-    while (fgets(line, sizeof(line), pipe) && result->hint_count < MAX_CAPABILITY_HINTS - 2) {
-        line[strcspn(line, "\n")] = 0; // Remove newline
-        
-        // Skip very long lines (likely not paths)
-        if (strlen(line) > 200) continue;
-        
-        struct capability_hint *hint = &result->hints[result->hint_count];
-        
-        if (strncmp(line, "/etc/", 5) == 0) {
-            snprintf(hint->description, sizeof(hint->description), 
-                    "Configuration file: %s", line);
-            snprintf(hint->capability, sizeof(hint->capability), 
-                    "filesystem: %s:r", line);
-            hint->confidence = 60;
-            result->hint_count++;
+    size_t size = st.st_size, start = 0;
+    for (size_t i = 0; i <= size; i++) {
+        if (i < size && text[i] != 0 && !strchr(" \t\r\n\"'`=;,()<>[]{}|&", text[i])) {
+            continue;
         }
-        else if (strncmp(line, "/var/", 5) == 0) {
-            snprintf(hint->description, sizeof(hint->description), 
-                    "Data directory: %s", line);
-            snprintf(hint->capability, sizeof(hint->capability), 
-                    "filesystem: %s:rw", line);
-            hint->confidence = 65;
-            result->hint_count++;
+        if (i - start >= MIN_STRING_LENGTH) {
+            scan_string(text + start, i - start, result);
         }
-        else if (strstr(line, "http://") || strstr(line, "https://")) {
-            snprintf(hint->description, sizeof(hint->description), 
-                    "HTTP URL found: %.50s%s", line, strlen(line) > 50 ? "..." : "");
-            strcpy(hint->capability, "network: tcp:80:outbound\nnetwork: tcp:443:outbound");
-            hint->confidence = 70;
-            result->hint_count++;
+        start = i + 1;
+    }
+    
+    munmap((void *)text, size);
+    return 0;
+}
+
+// Analyze embedded strings for paths and URLs
+int analyze_binary_strings(const char *binary, struct detection_result *result) {
+    static const char *sections[] = {".rodata", ".data", NULL};
+    struct elf_info elf;
+    const unsigned char *data;
+    size_t size;
+    int scanned = 0;
+    
+    fprintf(progress(result), "Analyzing embedded strings...\n");
+    
+    if (elf_open(binary, &elf) != 0) {
+        if (errno == ENOEXEC && scan_script(binary, result) == 0) {
+            return 0;
         }
+        fprintf(stderr, "Warning: Could not analyze strings: %s\n", strerror(errno));
+        return -1;
     }
     
-    pclose(pipe);
+    // Constant data is where paths and URLs live; code would only add noise
+    for (int i = 0; sections[i]; i++) {
+        if (elf_section(&elf, sections[i], &data, &size) == 0) {
+            strscan_printable(data, size, MIN_STRING_LENGTH, scan_string, result);
+            scanned++;
+        }
+    }
+    // Without section headers, fall back to the whole file like strings(1)
+    if (scanned == 0) {
+        strscan_printable(elf.map, elf.size, MIN_STRING_LENGTH, scan_string, result);
+    }
+    
+    elf_close(&elf);
     return 0;
 }
 
@@ -194,36 +648,15 @@ int analyze_application_patterns(const char *binary, struct detection_result *re
     const char *basename = strrchr(binary, '/');
     if (basename) basename++; else basename = binary;
     
-    printf("Analyzing application patterns...\n");
-    
-    struct {
-        char *pattern;
-        char *description;
-        char *capabilities;
-        int confidence;
-    } patterns[] = {
-        {"httpd", "Web server detected", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 256M", 90},
-        {"nginx", "Nginx web server", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 128M", 90},
-        {"apache", "Apache web server", "network: tcp:80:inbound\nnetwork: tcp:443:inbound\nfilesystem: /var/www:r\nmemory: 256M", 90},
-        {"sshd", "SSH server", "network: tcp:22:inbound\nfilesystem: /etc/ssh:r\nprocesses: 20", 95},
-        {"mysqld", "MySQL database server", "network: tcp:3306:inbound\nfilesystem: /var/lib/mysql:rw\nmemory: 512M\nprocesses: 50", 90},
-        {"postgres", "PostgreSQL database", "network: tcp:5432:inbound\nfilesystem: /var/lib/postgresql:rw\nmemory: 256M\nprocesses: 20", 90},
-        {"redis", "Redis server", "network: tcp:6379:inbound\nfilesystem: /var/lib/redis:rw\nmemory: 128M", 90},
-        {"server", "Generic server application", "network: tcp:8080:inbound\nmemory: 128M", 60},
-        {"client", "Generic client application", "network: tcp:80:outbound\nnetwork: tcp:443:outbound", 60},
-        {"daemon", "System daemon", "processes: 5\nfilesystem: /var/run:rw\nfilesystem: /var/log:w", 70},
-        {"bot", "Bot application", "network: tcp:443:outbound\nfilesystem: /tmp:rw\nmemory: 64M", 65},
-        {NULL, NULL, NULL, 0}
-    };
-    
-    for (int i = 0; patterns[i].pattern && result->hint_count < MAX_CAPABILITY_HINTS; i++) {
-        if (strstr(basename, patterns[i].pattern)) {
-            struct capability_hint *hint = &result->hints[result->hint_count++];
-            strcpy(hint->description, patterns[i].description);
-            strcpy(hint->capability, patterns[i].capabilities);
-            hint->confidence = patterns[i].confidence;
-            break; // Only match first pattern
-        }
+    fprintf(progress(result), "Analyzing application patterns...\n");
+    
+    struct rule_hits hits;
+    match_rules(RULE_NAME, basename, strlen(basename), &hits);
+    
+    // Only the first matching pattern applies
+    if (hits.first >= 0) {
+        const struct detection_rule *rule = &rules[hits.first];
+        add_capability_hint(result, rule->confidence, rule->description, rule->capability);
     }
     
     return 0;
@@ -238,9 +671,10 @@ int generate_capability_file(const char *binary, const char *output_file, struct
     }
     
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
+    struct tm tm_info;
     char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
     
     fprintf(file, "# Auto-generated capability file for %s\n", binary);
     fprintf(file, "# Generated on: %s\n", timestamp);
@@ -250,64 +684,9 @@ int generate_capability_file(const char *binary, const char *output_file, struct
     fprintf(file, "# User context - creates ephemeral user automatically\n");
     fprintf(file, "user: auto\n\n");
     
-    fprintf(file, "# Default resource limits (adjust based on application needs)\n");
-    fprintf(file, "memory: 128M    # Adjust based on application requirements\n");
-    fprintf(file, "processes: 5    # Adjust if application spawns child processes\n");
-    fprintf(file, "files: 256      # File descriptor limit\n\n");
-    
-    // Sort and deduplicate hints by confidence
-    fprintf(file, "# Detected capabilities (sorted by confidence)\n");
-    fprintf(file, "# Higher confidence suggestions are listed first\n\n");
-    
-    // Track added capabilities to avoid duplicates
-    char added_caps[MAX_CAPABILITY_HINTS][512];
-    int added_count = 0;
-    
-    for (int conf_threshold = 90; conf_threshold >= 50; conf_threshold -= 10) {
-        int section_written = 0;
-        
-        for (int i = 0; i < result->hint_count; i++) {
-            if (result->hints[i].confidence >= conf_threshold && 
-                result->hints[i].confidence < conf_threshold + 10) {
-                
-                // Check for duplicates
-                int duplicate = 0;
-                for (int j = 0; j < added_count; j++) {
-                    if (strcmp(added_caps[j], result->hints[i].capability) == 0) {
-                        duplicate = 1;
-                        break;
-                    }
-                }
-                
-                if (!duplicate) {
-                    if (!section_written) {
-                        fprintf(file, "# Confidence: %d-%d%%\n", conf_threshold, conf_threshold + 9);
-                        section_written = 1;
-                    }
-                    
-                    fprintf(file, "# %s\n", result->hints[i].description);
-                    
-                    // Split multi-line capabilities
-                    char *cap_copy = strdup(result->hints[i].capability);
-                    char *line = strtok(cap_copy, "\n");
-                    while (line) {
-                        fprintf(file, "%s\n", line);
-                        line = strtok(NULL, "\n");
-                    }
-                    free(cap_copy);
-                    
-                    fprintf(file, "\n");
-                    
-                    // Remember this capability
-                    strcpy(added_caps[added_count], result->hints[i].capability);
-                    added_count++;
-                }
-            }
-        }
-        
-        if (section_written) {
-            fprintf(file, "\n");
-        }
+    if (write_merged_capabilities(file, result) != 0) {
+        fclose(file);
+        return -1;
     }
     
     // Add some commented examples
@@ -323,10 +702,19 @@ int generate_capability_file(const char *binary, const char *output_file, struct
 
 // Main detection function
 int detect_capabilities(const char *binary, const char *output_file) {
+    return detect_capabilities_log(binary, output_file, stdout, NULL);
+}
+
+// Detection with progress written to log and the outcome returned in report
+int detect_capabilities_log(const char *binary, const char *output_file, FILE *log,
+                            struct detection_report *report) {
     struct detection_result result = {0};
     char default_output[PATH_MAX];
+    char key[NAME_MAX];
+    unsigned long long hits, misses, evictions;
     
-    printf("Detecting capabilities for: %s\n", binary);
+    result.log = log;
+    fprintf(log, "Detecting capabilities for: %s\n", binary);
     
     // Check if binary exists and is executable
     if (access(binary, F_OK) != 0) {
@@ -344,33 +732,52 @@ int detect_capabilities(const char *binary, const char *output_file) {
         output_file = default_output;
     }
     
-    printf("Output capability file: %s\n\n", output_file);
+    fprintf(log, "Output capability file: %s\n\n", output_file);
     
-    // Run all analysis methods
-    analyze_binary_dependencies(binary, &result);
-    analyze_binary_symbols(binary, &result);
-    analyze_binary_strings(binary, &result);
-    analyze_application_patterns(binary, &result);
+    // Unchanged binaries reuse earlier results
+    int cached = detect_cache_key(binary, detection_salt(binary), key, sizeof(key)) == 0;
+    int hit = cached && detect_cache_lookup(key, &result) == 0;
+    if (hit) {
+        fprintf(log, "Using cached detection results\n");
+    } else {
+        // Run all analysis methods
+        analyze_binary_dependencies(binary, &result);
+        analyze_binary_symbols(binary, &result);
+        analyze_binary_strings(binary, &result);
+        analyze_application_patterns(binary, &result);
+        
+        if (cached && detect_cache_store(key, &result) != 0) {
+            fprintf(stderr, "Warning: Could not cache detection results: %s\n", strerror(errno));
+        }
+    }
+    if (report) {
+        report->hint_count = result.hint_count;
+        report->cached = hit;
+    }
     
     // Display results summary
-    printf("\nDetection Summary:\n");
-    printf("==================\n");
-    printf("Found %d capability hints\n", result.hint_count);
+    fprintf(log, "\nDetection Summary:\n");
+    fprintf(log, "==================\n");
+    fprintf(log, "Found %d capability hints\n", result.hint_count);
+    if (cached) {
+        detect_cache_counters(&hits, &misses, &evictions);
+        fprintf(log, "Detection cache: %llu hits, %llu misses, %llu evictions\n", hits, misses, evictions);
+    }
     
     if (result.hint_count == 0) {
-        printf("No specific capabilities detected. Using minimal defaults.\n");
+        fprintf(log, "No specific capabilities detected. Using minimal defaults.\n");
         
         // Add a basic hint for minimal capabilities
-        struct capability_hint *hint = &result.hints[result.hint_count++];
-        strcpy(hint->description, "Minimal capabilities for unknown application");
-        strcpy(hint->capability, "filesystem: /tmp:rw");
-        hint->confidence = 50;
+        add_capability_hint(&result, 50, "Minimal capabilities for unknown application",
+                            "filesystem: /tmp:rw");
     }
     
     // Generate capability file
-    if (generate_capability_file(binary, output_file, &result) == 0) {
-        printf("\nGenerated capability file: %s\n", output_file);
-        printf("Review and edit the file before using with isolate.\n");
+    int ret = generate_capability_file(binary, output_file, &result);
+    free_detection_result(&result);
+    if (ret == 0) {
+        fprintf(log, "\nGenerated capability file: %s\n", output_file);
+        fprintf(log, "Review and edit the file before using with isolate.\n");
         return 0;
     } else {
         return -1;
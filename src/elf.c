@@ -0,0 +1,440 @@
+/*
+ * Minimal in-process ELF reader for capability detection
+ *
+ * Maps the binary read-only and decodes just what detection needs:
+ * PT_INTERP, the PT_DYNAMIC entries (DT_NEEDED, DT_RUNPATH, DT_RPATH),
+ * the dynamic symbol table and, for static binaries, the .symtab.
+ * Handles ELF32/ELF64 in either byte order and never runs the binary
+ * or its loader.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "common.h"
+
+#define EI_NIDENT 16
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ELFDATA2MSB 2
+
+#define PT_LOAD 1
+#define PT_DYNAMIC 2
+#define PT_INTERP 3
+#define PT_NOTE 4
+
+#define SHT_SYMTAB 2
+#define SHT_NOBITS 8
+#define SHT_DYNSYM 11
+
+#define DT_NULL 0
+#define DT_NEEDED 1
+#define DT_HASH 4
+#define DT_STRTAB 5
+#define DT_SYMTAB 6
+#define DT_STRSZ 10
+#define DT_SYMENT 11
+#define DT_RPATH 15
+#define DT_RUNPATH 29
+#define DT_GNU_HASH 0x6ffffef5
+
+#define NT_GNU_BUILD_ID 3
+
+#define STT_FUNC 2
+#define SHN_UNDEF 0
+
+// Bounds-checked field readers; out-of-range reads yield 0
+static uint64_t read_uint(const struct elf_info *elf, size_t offset, size_t width) {
+    uint64_t value = 0;
+
+    if (offset > elf->size || width > elf->size - offset) {
+        return 0;
+    }
+    const unsigned char *p = elf->map + offset;
+    for (size_t i = 0; i < width; i++) {
+        size_t shift = elf->big_endian ? (width - 1 - i) * 8 : i * 8;
+        value |= (uint64_t)p[i] << shift;
+    }
+    return value;
+}
+
+#define R16(elf, off) ((unsigned)read_uint((elf), (off), 2))
+#define R32(elf, off) ((uint32_t)read_uint((elf), (off), 4))
+#define RWORD(elf, off) read_uint((elf), (off), (elf)->is64 ? 8 : 4)
+
+// A NUL-terminated string inside [base, base + size) of the file, or NULL
+static const char *string_at(const struct elf_info *elf, size_t base, size_t size, uint64_t index) {
+    if (base > elf->size || size > elf->size - base || index >= size) {
+        return NULL;
+    }
+    const char *str = (const char *)elf->map + base + index;
+    return memchr(str, '\0', size - index) ? str : NULL;
+}
+
+// Translate a virtual address to a file offset through the PT_LOAD segments
+static int vaddr_to_offset(const struct elf_info *elf, uint64_t vaddr, size_t *offset) {
+    for (unsigned i = 0; i < elf->phnum; i++) {
+        size_t ph = elf->phoff + (size_t)i * elf->phentsize;
+        if (R32(elf, ph) != PT_LOAD) {
+            continue;
+        }
+        uint64_t p_offset, p_vaddr, p_filesz;
+        if (elf->is64) {
+            p_offset = read_uint(elf, ph + 8, 8);
+            p_vaddr = read_uint(elf, ph + 16, 8);
+            p_filesz = read_uint(elf, ph + 32, 8);
+        } else {
+            p_offset = R32(elf, ph + 4);
+            p_vaddr = R32(elf, ph + 8);
+            p_filesz = R32(elf, ph + 16);
+        }
+        if (vaddr >= p_vaddr && vaddr - p_vaddr < p_filesz) {
+            *offset = p_offset + (vaddr - p_vaddr);
+            return *offset < elf->size ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// Number of dynamic symbols from a GNU hash table (highest chained index + 1)
+static size_t gnu_hash_symbol_count(const struct elf_info *elf, size_t offset) {
+    uint32_t nbuckets = R32(elf, offset);
+    uint32_t symoffset = R32(elf, offset + 4);
+    uint32_t bloom_size = R32(elf, offset + 8);
+    size_t buckets = offset + 16 + (size_t)bloom_size * (elf->is64 ? 8 : 4);
+    size_t chains = buckets + (size_t)nbuckets * 4;
+    uint32_t last = 0;
+
+    if (nbuckets == 0 || chains > elf->size) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        uint32_t index = R32(elf, buckets + (size_t)i * 4);
+        if (index > last) {
+            last = index;
+        }
+    }
+    if (last < symoffset) {
+        return symoffset;
+    }
+    for (;;) {
+        size_t entry = chains + (size_t)(last - symoffset) * 4;
+        if (entry + 4 > elf->size) {
+            return 0;
+        }
+        if (R32(elf, entry) & 1) {
+            return (size_t)last + 1;
+        }
+        last++;
+    }
+}
+
+static void read_dynamic(struct elf_info *elf, size_t offset, size_t size) {
+    size_t entsize = elf->is64 ? 16 : 8;
+    uint64_t strtab = 0, symtab = 0, hash = 0, gnu_hash = 0;
+    uint64_t strsz = 0, syment = 0;
+    uint64_t needed[ELF_MAX_NEEDED];
+    uint64_t runpath = 0, rpath = 0;
+    int has_runpath = 0, has_rpath = 0;
+    int needed_count = 0;
+
+    for (size_t pos = offset; pos + entsize <= offset + size; pos += entsize) {
+        uint64_t tag = RWORD(elf, pos);
+        uint64_t val = RWORD(elf, pos + entsize / 2);
+
+        switch (tag) {
+            case DT_NULL: pos = offset + size; break;
+            case DT_NEEDED:
+                if (needed_count < ELF_MAX_NEEDED) needed[needed_count++] = val;
+                break;
+            case DT_STRTAB: strtab = val; break;
+            case DT_STRSZ: strsz = val; break;
+            case DT_SYMTAB: symtab = val; break;
+            case DT_SYMENT: syment = val; break;
+            case DT_HASH: hash = val; break;
+            case DT_GNU_HASH: gnu_hash = val; break;
+            case DT_RUNPATH: runpath = val; has_runpath = 1; break;
+            case DT_RPATH: rpath = val; has_rpath = 1; break;
+        }
+    }
+
+    size_t strtab_offset;
+    if (!strtab || vaddr_to_offset(elf, strtab, &strtab_offset) != 0) {
+        return;
+    }
+    if (strsz == 0 || strsz > elf->size - strtab_offset) {
+        strsz = elf->size - strtab_offset;
+    }
+    elf->dynstr_offset = strtab_offset;
+    elf->dynstr_size = strsz;
+
+    for (int i = 0; i < needed_count; i++) {
+        const char *name = string_at(elf, strtab_offset, strsz, needed[i]);
+        if (name) {
+            elf->needed[elf->needed_count++] = name;
+        }
+    }
+    if (has_runpath) {
+        elf->runpath = string_at(elf, strtab_offset, strsz, runpath);
+    }
+    if (has_rpath) {
+        elf->rpath = string_at(elf, strtab_offset, strsz, rpath);
+    }
+
+    size_t symtab_offset, hash_offset;
+    if (!symtab || vaddr_to_offset(elf, symtab, &symtab_offset) != 0) {
+        return;
+    }
+    elf->dynsym_offset = symtab_offset;
+    elf->dynsym_entsize = syment ? syment : (elf->is64 ? 24 : 16);
+    if (hash && vaddr_to_offset(elf, hash, &hash_offset) == 0) {
+        elf->dynsym_count = R32(elf, hash_offset + 4);   /* nchain */
+    } else if (gnu_hash && vaddr_to_offset(elf, gnu_hash, &hash_offset) == 0) {
+        elf->dynsym_count = gnu_hash_symbol_count(elf, hash_offset);
+    }
+}
+
+// Section headers are optional (stripped binaries), so they only fill gaps
+static void read_sections(struct elf_info *elf) {
+    size_t shoff = elf->is64 ? read_uint(elf, 40, 8) : R32(elf, 32);
+    unsigned shentsize = R16(elf, elf->is64 ? 58 : 46);
+    unsigned shnum = R16(elf, elf->is64 ? 60 : 48);
+
+    if (shoff == 0 || shentsize == 0 || shoff > elf->size ||
+        (size_t)shnum * shentsize > elf->size - shoff) {
+        return;
+    }
+    elf->shoff = shoff;
+    elf->shentsize = shentsize;
+    elf->shnum = shnum;
+    elf->shstrndx = R16(elf, elf->is64 ? 62 : 50);
+
+    if (elf->dynsym_count > 0) {
+        return;
+    }
+    for (unsigned i = 0; i < shnum; i++) {
+        size_t sh = shoff + (size_t)i * shentsize;
+        if (R32(elf, sh + 4) != SHT_DYNSYM) {
+            continue;
+        }
+        uint64_t offset = elf->is64 ? read_uint(elf, sh + 24, 8) : R32(elf, sh + 16);
+        uint64_t size = elf->is64 ? read_uint(elf, sh + 32, 8) : R32(elf, sh + 20);
+        uint64_t entsize = elf->is64 ? read_uint(elf, sh + 56, 8) : R32(elf, sh + 36);
+        if (entsize > 0 && offset < elf->size && size <= elf->size - offset) {
+            elf->dynsym_offset = offset;
+            elf->dynsym_entsize = entsize;
+            elf->dynsym_count = size / entsize;
+        }
+        break;
+    }
+}
+
+int elf_open(const char *path, struct elf_info *elf) {
+    struct stat st;
+
+    memset(elf, 0, sizeof(*elf));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 52) {
+        close(fd);
+        errno = ENOEXEC;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    elf->map = map;
+    elf->size = st.st_size;
+
+    const unsigned char *ident = elf->map;
+    if (memcmp(ident, "\177ELF", 4) != 0 ||
+        (ident[4] != ELFCLASS32 && ident[4] != ELFCLASS64) ||
+        (ident[5] != ELFDATA2LSB && ident[5] != ELFDATA2MSB) ||
+        (ident[4] == ELFCLASS64 && elf->size < 64)) {
+        elf_close(elf);
+        errno = ENOEXEC;
+        return -1;
+    }
+    elf->is64 = ident[4] == ELFCLASS64;
+    elf->big_endian = ident[5] == ELFDATA2MSB;
+    elf->type = R16(elf, EI_NIDENT);
+    elf->machine = R16(elf, EI_NIDENT + 2);
+
+    elf->phoff = elf->is64 ? read_uint(elf, 32, 8) : R32(elf, 28);
+    elf->phentsize = R16(elf, elf->is64 ? 54 : 42);
+    elf->phnum = R16(elf, elf->is64 ? 56 : 44);
+    if (elf->phoff > elf->size || (size_t)elf->phnum * elf->phentsize > elf->size - elf->phoff) {
+        elf->phnum = 0;
+    }
+
+    for (unsigned i = 0; i < elf->phnum; i++) {
+        size_t ph = elf->phoff + (size_t)i * elf->phentsize;
+        uint32_t type = R32(elf, ph);
+        uint64_t offset = elf->is64 ? read_uint(elf, ph + 8, 8) : R32(elf, ph + 4);
+        uint64_t filesz = elf->is64 ? read_uint(elf, ph + 32, 8) : R32(elf, ph + 16);
+
+        if (offset > elf->size || filesz > elf->size - offset) {
+            continue;
+        }
+        if (type == PT_INTERP) {
+            elf->interp = string_at(elf, offset, filesz, 0);
+        } else if (type == PT_DYNAMIC) {
+            elf->is_dynamic = 1;
+            read_dynamic(elf, offset, filesz);
+        }
+    }
+
+    read_sections(elf);
+    return 0;
+}
+
+void elf_close(struct elf_info *elf) {
+    if (elf->map) {
+        munmap((void *)elf->map, elf->size);
+    }
+    memset(elf, 0, sizeof(*elf));
+}
+
+int elf_dynamic_symbols(const struct elf_info *elf, int (*visit)(const char *name, void *ctx), void *ctx) {
+    if (elf->dynsym_count == 0 || elf->dynstr_size == 0) {
+        return 0;
+    }
+
+    // st_name is the first 32-bit field in both Elf32_Sym and Elf64_Sym
+    for (size_t i = 1; i < elf->dynsym_count; i++) {
+        size_t sym = elf->dynsym_offset + i * elf->dynsym_entsize;
+        if (sym + elf->dynsym_entsize > elf->size) {
+            break;
+        }
+        const char *name = string_at(elf, elf->dynstr_offset, elf->dynstr_size, R32(elf, sym));
+        if (name && *name) {
+            int ret = visit(name, ctx);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+// Defined functions from the .symtab; unstripped static binaries keep their
+// libc (or Go runtime) entry points there instead of in the .dynsym
+int elf_static_symbols(const struct elf_info *elf, int (*visit)(const char *name, void *ctx), void *ctx) {
+    for (unsigned i = 0; i < elf->shnum; i++) {
+        size_t sh = elf->shoff + (size_t)i * elf->shentsize;
+        if (R32(elf, sh + 4) != SHT_SYMTAB) {
+            continue;
+        }
+        uint64_t offset = elf->is64 ? read_uint(elf, sh + 24, 8) : R32(elf, sh + 16);
+        uint64_t size = elf->is64 ? read_uint(elf, sh + 32, 8) : R32(elf, sh + 20);
+        uint32_t link = R32(elf, sh + (elf->is64 ? 40 : 24));
+        uint64_t entsize = elf->is64 ? read_uint(elf, sh + 56, 8) : R32(elf, sh + 36);
+        // Entries smaller than an ElfN_Sym would put fields past the table
+        if (entsize < (elf->is64 ? 24u : 16u) || link >= elf->shnum || offset > elf->size ||
+            size > elf->size - offset) {
+            return 0;
+        }
+
+        size_t strsh = elf->shoff + (size_t)link * elf->shentsize;
+        size_t strtab = elf->is64 ? read_uint(elf, strsh + 24, 8) : R32(elf, strsh + 16);
+        size_t strsz = elf->is64 ? read_uint(elf, strsh + 32, 8) : R32(elf, strsh + 20);
+
+        // st_info and st_shndx sit after st_value/st_size in Elf32_Sym only
+        size_t info_at = elf->is64 ? 4 : 12;
+        size_t shndx_at = elf->is64 ? 6 : 14;
+        for (size_t pos = offset + entsize; pos + entsize <= offset + size; pos += entsize) {
+            unsigned info = (unsigned)read_uint(elf, pos + info_at, 1);
+            if ((info & 0xf) != STT_FUNC || R16(elf, pos + shndx_at) == SHN_UNDEF) {
+                continue;
+            }
+            const char *name = string_at(elf, strtab, strsz, R32(elf, pos));
+            if (name && *name) {
+                int ret = visit(name, ctx);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int elf_section(const struct elf_info *elf, const char *name, const unsigned char **data, size_t *size) {
+    if (elf->shnum == 0 || elf->shstrndx >= elf->shnum) {
+        return -1;
+    }
+
+    size_t strsh = elf->shoff + (size_t)elf->shstrndx * elf->shentsize;
+    size_t names = elf->is64 ? read_uint(elf, strsh + 24, 8) : R32(elf, strsh + 16);
+    size_t names_size = elf->is64 ? read_uint(elf, strsh + 32, 8) : R32(elf, strsh + 20);
+
+    for (unsigned i = 0; i < elf->shnum; i++) {
+        size_t sh = elf->shoff + (size_t)i * elf->shentsize;
+        const char *sh_name = string_at(elf, names, names_size, R32(elf, sh));
+        if (!sh_name || strcmp(sh_name, name) != 0) {
+            continue;
+        }
+        uint32_t type = R32(elf, sh + 4);
+        uint64_t offset = elf->is64 ? read_uint(elf, sh + 24, 8) : R32(elf, sh + 16);
+        uint64_t length = elf->is64 ? read_uint(elf, sh + 32, 8) : R32(elf, sh + 20);
+        // .bss and friends have no file contents
+        if (type == SHT_NOBITS || offset > elf->size || length > elf->size - offset) {
+            return -1;
+        }
+        *data = elf->map + offset;
+        *size = length;
+        return 0;
+    }
+    return -1;
+}
+
+// The GNU build-id note, found through the PT_NOTE segments
+int elf_build_id(const struct elf_info *elf, const unsigned char **id, size_t *size) {
+    for (unsigned i = 0; i < elf->phnum; i++) {
+        size_t ph = elf->phoff + (size_t)i * elf->phentsize;
+        if (R32(elf, ph) != PT_NOTE) {
+            continue;
+        }
+        uint64_t offset = elf->is64 ? read_uint(elf, ph + 8, 8) : R32(elf, ph + 4);
+        uint64_t length = elf->is64 ? read_uint(elf, ph + 32, 8) : R32(elf, ph + 16);
+        if (offset > elf->size || length > elf->size - offset) {
+            continue;
+        }
+
+        // Notes are namesz, descsz, type, then name and desc padded to 4 bytes
+        size_t note = offset, end = offset + length;
+        while (end - note >= 12) {
+            uint32_t namesz = R32(elf, note);
+            uint32_t descsz = R32(elf, note + 4);
+            uint32_t type = R32(elf, note + 8);
+            size_t name = note + 12;
+            size_t desc = name + ((namesz + 3) & ~3UL);
+            size_t next = desc + ((descsz + 3) & ~3UL);
+            if (next > end || next <= note) {
+                break;
+            }
+            if (type == NT_GNU_BUILD_ID && namesz == 4 &&
+                memcmp(elf->map + name, "GNU", 4) == 0 && descsz > 0) {
+                *id = elf->map + desc;
+                *size = descsz;
+                return 0;
+            }
+            note = next;
+        }
+    }
+    return -1;
+}
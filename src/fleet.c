@@ -0,0 +1,1046 @@
+/*
+ * Manifest-driven fleet launch
+ *
+ * "isolate -m fleet.manifest [-j N]" starts one isolated instance per
+ * manifest line:
+ *
+ *     # binary          options                               args
+ *     /srv/t1/app  caps=/srv/t1/app.caps workspace=/srv/t1 -- --port 8001
+ *     /srv/t2/app  name=t2 log=/var/log/t2.log               --port 8002
+ *
+ * Options (caps=, workspace=, log=, name=) follow the binary; "--" ends
+ * them, and words may be double-quoted. Each distinct capability file
+ * is parsed once and every rootfs template is built once, in this
+ * process, before any instance is forked. Instances are then set up by
+ * keeper processes, at most N at a time; like the warm pool's keepers,
+ * each behaves exactly like the single-instance launcher parent. An
+ * instance counts as ready when its keeper's pipe reaches EOF, which
+ * the keeper closes once the setup channel reports a successful execv.
+ *
+ * With -S this process instead supervises the fleet itself: it forks
+ * every instance directly, detaches the backend state each one needs
+ * for cleanup into its entry, and waits for exits on pidfds (kqueue
+ * process events on FreeBSD) in the same event loop that follows every
+ * setup channel. No keeper stays resident per instance.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
+#include "common.h"
+
+#define FLEET_MAX_JOBS 256
+#define FLEET_MAX_WORDS 256
+#define FLEET_STOP_GRACE 10   /* seconds between SIGTERM and SIGKILL */
+#define FLEET_MAX_EVENTS 64
+
+enum fleet_state { FLEET_PENDING, FLEET_STARTING, FLEET_READY, FLEET_FAILED };
+
+struct fleet_caps {
+    char *path;
+    struct capabilities storage;
+    struct capabilities *caps;
+    int error;                  /* load_capabilities() result */
+    int templates;              /* bit 0: plain, bit 1: with workspace */
+};
+
+struct fleet_entry {
+    int line;
+    char *name;
+    char *binary;
+    char *caps_file;
+    char *workspace;
+    char *log;
+    char **argv;                /* argv[0] is the binary */
+    struct fleet_caps *shared;
+    enum fleet_state state;
+    pid_t pid;                  /* keeper, or the instance itself with -S */
+    int ready_fd;               /* keeper pipe, or setup channel with -S */
+    int exit_fd;                /* pidfd watched by the supervisor, or -1 */
+    struct setup_report *setup; /* -S only, while the instance starts */
+    struct isolation_state isolation;
+    int error;
+    int exited;
+    int status;
+    uint64_t started;
+    double latency;
+};
+
+struct fleet {
+    struct fleet_entry *entries;
+    int count, capacity;
+    struct fleet_caps **caps;
+    int caps_count, caps_capacity;
+};
+
+static volatile sig_atomic_t fleet_stop;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    fleet_stop = 1;
+}
+
+// Split a manifest line into words; "..." keeps spaces inside one word
+static int split_words(char *line, char **words, int max) {
+    int count = 0;
+    char *p = line;
+
+    for (;;) {
+        p += strspn(p, " \t\r\n");
+        if (*p == '\0' || *p == '#') {
+            return count;
+        }
+        if (count == max) {
+            return -1;
+        }
+        if (*p == '"') {
+            words[count++] = ++p;
+            p = strchr(p, '"');
+            if (!p) {
+                return -1;
+            }
+        } else {
+            words[count++] = p;
+            p += strcspn(p, " \t\r\n");
+            if (*p == '\0') {
+                return count;
+            }
+        }
+        *p++ = '\0';
+    }
+}
+
+static struct fleet_caps *shared_caps(struct fleet *fleet, const char *path) {
+    for (int i = 0; i < fleet->caps_count; i++) {
+        if (strcmp(fleet->caps[i]->path, path) == 0) {
+            return fleet->caps[i];
+        }
+    }
+    if (fleet->caps_count == fleet->caps_capacity) {
+        int capacity = fleet->caps_capacity ? fleet->caps_capacity * 2 : 16;
+        struct fleet_caps **caps = realloc(fleet->caps, capacity * sizeof(*caps));
+        if (!caps) {
+            return NULL;
+        }
+        fleet->caps = caps;
+        fleet->caps_capacity = capacity;
+    }
+
+    struct fleet_caps *shared = calloc(1, sizeof(*shared));
+    if (!shared || !(shared->path = strdup(path))) {
+        free(shared);
+        return NULL;
+    }
+
+    // Same preference as a single launch: a current .capsb, else the text
+    shared->caps = &shared->storage;
+    if (map_compiled_capabilities(path, &shared->caps) != 0) {
+        char source[PATH_MAX];
+        size_t len = strlen(path);
+        snprintf(source, sizeof(source), "%s", path);
+        if (len > 6 && strcmp(path + len - 6, ".capsb") == 0) {
+            source[len - 1] = '\0';
+        }
+        shared->error = load_capabilities(source, shared->caps);
+    }
+    fleet->caps[fleet->caps_count++] = shared;
+    return shared;
+}
+
+static int add_entry(struct fleet *fleet, int line, char **words, int count) {
+    struct fleet_entry entry;
+    char default_caps[PATH_MAX];
+    char default_name[NAME_MAX];
+    int i = 1;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.line = line;
+    entry.ready_fd = -1;
+    entry.exit_fd = -1;
+    entry.isolation.uid = (uid_t)-1;
+    entry.isolation.jid = -1;
+    entry.binary = words[0];
+    for (; i < count; i++) {
+        if (strcmp(words[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strncmp(words[i], "caps=", 5) == 0) {
+            entry.caps_file = words[i] + 5;
+        } else if (strncmp(words[i], "workspace=", 10) == 0) {
+            entry.workspace = words[i] + 10;
+        } else if (strncmp(words[i], "log=", 4) == 0) {
+            entry.log = words[i] + 4;
+        } else if (strncmp(words[i], "name=", 5) == 0) {
+            entry.name = words[i] + 5;
+        } else {
+            break;
+        }
+    }
+
+    if (!entry.caps_file) {
+        snprintf(default_caps, sizeof(default_caps), "%s.caps", entry.binary);
+        entry.caps_file = default_caps;
+    }
+    if (!entry.name) {
+        const char *base = strrchr(entry.binary, '/');
+        snprintf(default_name, sizeof(default_name), "%s:%d", base ? base + 1 : entry.binary, line);
+        entry.name = default_name;
+    }
+
+    // Words point into the line buffer, so keep copies
+    entry.argv = calloc(count - i + 2, sizeof(char *));
+    if (!entry.argv) {
+        return -1;
+    }
+    entry.argv[0] = strdup(entry.binary);
+    for (int j = i; j < count; j++) {
+        entry.argv[j - i + 1] = strdup(words[j]);
+    }
+    entry.binary = entry.argv[0];
+    entry.name = strdup(entry.name);
+    entry.caps_file = strdup(entry.caps_file);
+    entry.workspace = entry.workspace ? strdup(entry.workspace) : NULL;
+    entry.log = entry.log ? strdup(entry.log) : NULL;
+    entry.shared = shared_caps(fleet, entry.caps_file);
+    if (!entry.binary || !entry.name || !entry.caps_file || !entry.shared) {
+        return -1;
+    }
+
+    if (fleet->count == fleet->capacity) {
+        int capacity = fleet->capacity ? fleet->capacity * 2 : 64;
+        struct fleet_entry *entries = realloc(fleet->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return -1;
+        }
+        fleet->entries = entries;
+        fleet->capacity = capacity;
+    }
+    fleet->entries[fleet->count++] = entry;
+    return 0;
+}
+
+static int read_manifest(struct fleet *fleet, const char *manifest) {
+    char line[8192];
+    char *words[FLEET_MAX_WORDS];
+    int number = 0;
+
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", manifest, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        int count = split_words(line, words, FLEET_MAX_WORDS);
+        if (count == 0) {
+            continue;
+        }
+        if (count < 0) {
+            fprintf(stderr, "Error: %s:%d: Unterminated quote or too many words\n", manifest, number);
+            fclose(file);
+            return -1;
+        }
+        if (add_entry(fleet, number, words, count) != 0) {
+            fprintf(stderr, "Error: %s:%d: %s\n", manifest, number, strerror(errno));
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Everything a keeper would otherwise find out only after forking
+static int check_entry(struct fleet_entry *entry) {
+    struct stat st;
+
+    if (access(entry->binary, X_OK) != 0) {
+        return errno;
+    }
+    if (entry->shared->error != 0) {
+        return entry->shared->error;
+    }
+    if (entry->workspace) {
+        if (stat(entry->workspace, &st) != 0) {
+            return errno;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            return ENOTDIR;
+        }
+        if (access(entry->workspace, R_OK | W_OK) != 0) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+// Build each template once here instead of racing to build it in every keeper
+static int prepare_template(struct fleet_entry *entry) {
+    struct fleet_caps *shared = entry->shared;
+    int bit = entry->workspace ? 2 : 1;
+    char path[PATH_MAX];
+
+    if (shared->templates & bit) {
+        return 0;
+    }
+    shared->templates |= bit;
+
+    struct capabilities caps = *shared->caps;
+    caps.workspace_path = entry->workspace;
+    return template_prepare(&caps, path, sizeof(path)) == 0 ? 1 : 0;
+}
+
+// A keeper always answers with one int: 0 once the instance runs, else an errno
+static void report_error(int fd, int error) {
+    if (error <= 0) {
+        error = EIO;
+    }
+    write(fd, &error, sizeof(error));
+}
+
+static void report_ready(int fd) {
+    int error = 0;
+    write(fd, &error, sizeof(error));
+}
+
+static int redirect_stdio(const struct fleet_entry *entry) {
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    if (entry->log) {
+        int log_fd = open(entry->log, O_WRONLY | O_CREAT | O_APPEND, 0640);
+        if (log_fd < 0) {
+            return errno;
+        }
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+    }
+    return 0;
+}
+
+// Instance side of the fork, whether a keeper or the supervisor forked it;
+// the setup channel to that parent is already in place
+static void exec_instance(const struct fleet_entry *entry, const struct capabilities *caps) {
+    sigset_t none;
+
+    // Keepers block the signals they forward; the instance starts clean
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    int ret = create_isolation_context(caps);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to create isolation context: %s\n", strerror(ret));
+        setup_fail(ret);
+        exit(1);
+    }
+    if (send_isolation_state() != 0 || setup_ready() != 0) {
+        exit(1);
+    }
+
+    const char *binary_name = strrchr(entry->binary, '/');
+    binary_name = binary_name ? binary_name + 1 : entry->binary;
+    entry->argv[0] = (char *)binary_name;
+    fflush(stdout);
+    execv(binary_name, entry->argv);
+
+    int saved_errno = errno;
+    fprintf(stderr, "Failed to execute %s: %s\n", entry->binary, strerror(saved_errno));
+    setup_fail(saved_errno);
+    exit(127);
+}
+
+// Keeper: the launcher parent for one instance
+static void run_keeper(const struct fleet_entry *entry, int ready_fd) {
+    struct capabilities caps = *entry->shared->caps;
+    struct forward_config forward;
+    struct setup_report report;
+    int channel[2];
+    int status = 0;
+
+    caps.workspace_path = entry->workspace;
+    int error = redirect_stdio(entry);
+    if (error != 0) {
+        report_error(ready_fd, error);
+        exit(1);
+    }
+
+    // Interactive Ctrl-C reaches the instance directly; SIGTERM is forwarded
+    signal(SIGINT, SIG_IGN);
+    sigemptyset(&forward.signals);
+    sigaddset(&forward.signals, SIGTERM);
+    forward.grace_seconds = FLEET_STOP_GRACE;
+    forward.relay_fd = -1;
+    forward_block_signals(&forward, NULL);
+
+    setenv("ISOLATE_TARGET_BINARY", entry->binary, 1);
+    if (setup_channel(channel) != 0) {
+        report_error(ready_fd, errno);
+        exit(1);
+    }
+
+    pid_t pid = fork_isolation_context(&caps);
+    if (pid < 0) {
+        report_error(ready_fd, errno);
+        exit(1);
+    }
+    if (pid == 0) {
+        close(ready_fd);
+        close(channel[0]);
+        setup_child_channel(channel[1]);
+        exec_instance(entry, &caps);
+    }
+
+    close(channel[1]);
+    setup_report_init(&report);
+    int result = setup_receive(channel[0], &report);
+    if (result == SETUP_READY) {
+        // fleet stop during setup: do not start the application at all
+        result = setup_release(channel[0], &report, !forward_stop_pending());
+        if (result == SETUP_PENDING) {
+            result = setup_receive(channel[0], &report);
+        }
+    }
+    close(channel[0]);
+    receive_isolation_state(&report);
+    setup_close_namespaces(&report);
+
+    // The fleet launcher counts the instance as started only on this answer
+    if (result == SETUP_EXECUTED) {
+        report_ready(ready_fd);
+    } else {
+        report_error(ready_fd, report.error);
+    }
+    close(ready_fd);
+
+    if (forward_wait(pid, &forward, &status) != 0) {
+        status = 1 << 8;
+    }
+    cleanup_isolation_context();
+
+    if (WIFEXITED(status)) {
+        exit(WEXITSTATUS(status));
+    }
+    exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1);
+}
+
+static int start_entry(struct fleet_entry *entry) {
+    int ready[2];
+
+    if (pipe(ready) != 0) {
+        return errno;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+
+    entry->started = timing_now();
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        int saved_errno = errno;
+        close(ready[0]);
+        close(ready[1]);
+        return saved_errno;
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        run_keeper(entry, ready[1]);
+    }
+
+    close(ready[1]);
+    entry->pid = pid;
+    entry->ready_fd = ready[0];
+    entry->state = FLEET_STARTING;
+    return 0;
+}
+
+// An explicit 0 means execv succeeded; EOF means the keeper died first
+static int read_ready(struct fleet_entry *entry) {
+    int error = 0;
+    ssize_t n;
+
+    while ((n = read(entry->ready_fd, &error, sizeof(error))) < 0 && errno == EINTR) {
+    }
+    close(entry->ready_fd);
+    entry->ready_fd = -1;
+    if (n != sizeof(error)) {
+        return EIO;
+    }
+    return error >= 0 ? error : EIO;
+}
+
+static void finish_start(struct fleet_entry *entry, int error) {
+    entry->latency = (timing_now() - entry->started) / 1e9;
+
+    if (error == 0) {
+        entry->state = FLEET_READY;
+        printf("  %-7s %-24s %8.1f ms\n", "ready", entry->name, entry->latency * 1e3);
+        // A short-lived instance may already have been reaped
+        if (entry->exited) {
+            printf("  %-7s %-24s status %d\n", "exited", entry->name, entry->status);
+        }
+    } else {
+        entry->state = FLEET_FAILED;
+        entry->error = error;
+        printf("  %-7s %-24s %s\n", "failed", entry->name, strerror(entry->error));
+    }
+    fflush(stdout);
+}
+
+static void reap_keepers(struct fleet *fleet, int options) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, options)) > 0) {
+        for (int i = 0; i < fleet->count; i++) {
+            struct fleet_entry *entry = &fleet->entries[i];
+            if (entry->pid != pid) {
+                continue;
+            }
+            entry->exited = 1;
+            entry->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if (entry->state == FLEET_READY) {
+                printf("  %-7s %-24s status %d\n", "exited", entry->name, entry->status);
+                fflush(stdout);
+            }
+        }
+        if (options == 0) {
+            return;
+        }
+    }
+}
+
+static void signal_fleet(struct fleet *fleet, int sig) {
+    for (int i = 0; i < fleet->count; i++) {
+        struct fleet_entry *entry = &fleet->entries[i];
+        if (entry->pid > 0 && !entry->exited) {
+            kill(entry->pid, sig);
+        }
+    }
+}
+
+static int by_latency(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_summary(const struct fleet *fleet, double prepare, int templates, double boot) {
+    double *latencies = calloc((unsigned)fleet->count + 1u, sizeof(double));
+    int ready = 0;
+
+    for (int i = 0; i < fleet->count; i++) {
+        if (fleet->entries[i].state == FLEET_READY && latencies) {
+            latencies[ready++] = fleet->entries[i].latency;
+        }
+    }
+
+    printf("\nFleet Summary:\n");
+    printf("==============\n");
+    printf("Instances ready: %d of %d (%d failed)\n", ready, fleet->count, fleet->count - ready);
+    printf("Shared preparation: %.1f ms (%d capability files, %d templates)\n",
+           prepare * 1e3, fleet->caps_count, templates);
+    if (ready > 0) {
+        qsort(latencies, ready, sizeof(double), by_latency);
+        int p95 = (ready * 95 + 99) / 100 - 1;
+        printf("Launch latency: min %.1f ms, median %.1f ms, p95 %.1f ms, max %.1f ms\n",
+               latencies[0] * 1e3, latencies[ready / 2] * 1e3, latencies[p95] * 1e3,
+               latencies[ready - 1] * 1e3);
+        printf("Boot to ready: %.3fs (%.1f launches/s)\n", boot, boot > 0 ? ready / boot : 0);
+    }
+    printf("\n");
+    fflush(stdout);
+    free(latencies);
+}
+
+static void print_plan(const struct fleet *fleet) {
+    printf("Dry run - would launch:\n");
+    for (int i = 0; i < fleet->count; i++) {
+        const struct fleet_entry *entry = &fleet->entries[i];
+        int error = entry->state == FLEET_FAILED ? entry->error : 0;
+        printf("  %-24s %s", entry->name, entry->binary);
+        for (int j = 1; entry->argv[j]; j++) {
+            printf(" %s", entry->argv[j]);
+        }
+        printf("\n  %-24s caps %s%s%s%s%s\n", "", entry->caps_file,
+               entry->workspace ? ", workspace " : "", entry->workspace ? entry->workspace : "",
+               error ? ": " : "", error ? strerror(error) : "");
+    }
+}
+
+// One keeper per instance, each waiting on its instance like a single launch
+static void run_keepers(struct fleet *fleet, int jobs, uint64_t start, double prepare, int templates) {
+    int next = 0, starting = 0, stopping = 0;
+    double boot = 0;
+    while (next < fleet->count || starting > 0) {
+        struct pollfd pfds[FLEET_MAX_JOBS];
+        int map[FLEET_MAX_JOBS];
+        int n = 0;
+
+        if (fleet_stop && !stopping) {
+            stopping = 1;
+            next = fleet->count;
+            signal_fleet(fleet, SIGTERM);
+        }
+        // Bounded fan-out: at most jobs instances in setup at once
+        while (next < fleet->count && starting < jobs) {
+            struct fleet_entry *entry = &fleet->entries[next++];
+            if (entry->state != FLEET_PENDING) {
+                continue;
+            }
+            entry->error = start_entry(entry);
+            if (entry->error != 0) {
+                entry->state = FLEET_FAILED;
+                printf("  %-7s %-24s %s\n", "failed", entry->name, strerror(entry->error));
+                continue;
+            }
+            starting++;
+        }
+
+        for (int i = 0; i < fleet->count; i++) {
+            if (fleet->entries[i].state == FLEET_STARTING) {
+                pfds[n].fd = fleet->entries[i].ready_fd;
+                pfds[n].events = POLLIN;
+                map[n++] = i;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (poll(pfds, n, 1000) < 0 && errno != EINTR) {
+            break;
+        }
+        for (int k = 0; k < n; k++) {
+            if (pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                struct fleet_entry *entry = &fleet->entries[map[k]];
+                finish_start(entry, read_ready(entry));
+                starting--;
+                boot = (timing_now() - start) / 1e9;
+            }
+        }
+        reap_keepers(fleet, WNOHANG);
+    }
+
+    print_summary(fleet, prepare, templates, boot);
+
+    // Stay in the foreground until the whole fleet has exited
+    for (;;) {
+        int running = 0;
+        for (int i = 0; i < fleet->count; i++) {
+            running += fleet->entries[i].pid > 0 && !fleet->entries[i].exited;
+        }
+        if (running == 0) {
+            break;
+        }
+        if (fleet_stop && !stopping) {
+            stopping = 1;
+            printf("Stopping %d instances\n", running);
+            signal_fleet(fleet, SIGTERM);
+        }
+        reap_keepers(fleet, 0);
+    }
+}
+
+// Supervisor (-S): one event loop owns every instance. Setup frames and
+// instance exits are both events carrying the entry index; on Linux the
+// low bit of the epoll cookie tells the two apart
+
+struct fleet_event {
+    int index;
+    int exited;
+};
+
+static int watch_open(void) {
+#ifdef __linux__
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    return kqueue();
+#endif
+}
+
+static int watch_ready(int wfd, int index, int fd) {
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)index << 1;
+    return epoll_ctl(wfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)index);
+    return kevent(wfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+// Instances forked later hold copies of our descriptors until they exec,
+// so an epoll registration would outlive close(); drop it explicitly
+static void unwatch(int wfd, int fd) {
+#ifdef __linux__
+    epoll_ctl(wfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    (void)wfd;
+    (void)fd;
+#endif
+}
+
+// Instances whose exit cannot be watched are still found by the
+// waitpid() sweep after every wakeup, at worst a second late
+static int watch_exit(int wfd, int index, struct fleet_entry *entry) {
+#ifdef __linux__
+#ifdef SYS_pidfd_open
+    struct epoll_event ev;
+    int fd = (int)syscall(SYS_pidfd_open, entry->pid, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)index << 1) | 1;
+    if (epoll_ctl(wfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        return -1;
+    }
+    entry->exit_fd = fd;
+    return 0;
+#else
+    (void)wfd;
+    (void)index;
+    (void)entry;
+    errno = ENOSYS;
+    return -1;
+#endif
+#else
+    struct kevent ev;
+    EV_SET(&ev, entry->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, (void *)(intptr_t)index);
+    return kevent(wfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+static int watch_wait(int wfd, struct fleet_event *events, int timeout_ms) {
+#ifdef __linux__
+    struct epoll_event ev[FLEET_MAX_EVENTS];
+    int n = epoll_wait(wfd, ev, FLEET_MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        events[i].index = (int)(ev[i].data.u64 >> 1);
+        events[i].exited = (int)(ev[i].data.u64 & 1);
+    }
+#else
+    struct kevent ev[FLEET_MAX_EVENTS];
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    int n = kevent(wfd, NULL, 0, ev, FLEET_MAX_EVENTS, &ts);
+    for (int i = 0; i < n; i++) {
+        events[i].index = (int)(intptr_t)ev[i].udata;
+        events[i].exited = ev[i].filter == EVFILT_PROC;
+    }
+#endif
+    return n;
+}
+
+// Fork one instance from this process and keep only its detached state
+static int start_instance(int wfd, int index, struct fleet_entry *entry) {
+    struct capabilities caps = *entry->shared->caps;
+    int channel[2];
+
+    caps.workspace_path = entry->workspace;
+    entry->setup = malloc(sizeof(*entry->setup));
+    if (!entry->setup) {
+        return ENOMEM;
+    }
+    // Close-on-exec, so siblings forked before this instance execs do not keep it open
+    if (setup_channel(channel) != 0) {
+        int saved_errno = errno;
+        free(entry->setup);
+        entry->setup = NULL;
+        return saved_errno;
+    }
+
+    setenv("ISOLATE_TARGET_BINARY", entry->binary, 1);
+    entry->started = timing_now();
+    fflush(NULL);
+    pid_t pid = fork_isolation_context(&caps);
+    if (pid < 0) {
+        int saved_errno = errno;
+        close(channel[0]);
+        close(channel[1]);
+        free(entry->setup);
+        entry->setup = NULL;
+        return saved_errno;
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        setup_child_channel(channel[1]);
+        int error = redirect_stdio(entry);
+        if (error != 0) {
+            setup_fail(error);
+            exit(1);
+        }
+        exec_instance(entry, &caps);
+    }
+
+    close(channel[1]);
+    setup_report_init(entry->setup);
+    entry->pid = pid;
+    entry->ready_fd = channel[0];
+    entry->state = FLEET_STARTING;
+    detach_isolation_state(&entry->isolation);
+
+    if (watch_ready(wfd, index, entry->ready_fd) != 0) {
+        fprintf(stderr, "Warning: Cannot watch %s: %s\n", entry->name, strerror(errno));
+    }
+    watch_exit(wfd, index, entry);
+    return 0;
+}
+
+static void supervise_started(int wfd, struct fleet_entry *entry, int error) {
+    struct setup_report *report = entry->setup;
+
+    unwatch(wfd, entry->ready_fd);
+    close(entry->ready_fd);
+    entry->ready_fd = -1;
+    finish_start(entry, error);
+
+    receive_isolation_state(report);
+    detach_isolation_state(&entry->isolation);
+    setup_close_namespaces(report);
+    free(report);
+    entry->setup = NULL;
+}
+
+// Handle one setup frame; returns 1 once the instance has exec'd or failed
+static int supervise_setup(int wfd, struct fleet_entry *entry) {
+    int result = setup_step(entry->ready_fd, entry->setup);
+
+    if (result == SETUP_READY) {
+        // A fleet stop during setup cancels the instance before it execs
+        result = setup_release(entry->ready_fd, entry->setup, !fleet_stop);
+    }
+    if (result == SETUP_PENDING) {
+        return 0;
+    }
+    supervise_started(wfd, entry, result == SETUP_EXECUTED ? 0 : entry->setup->error);
+    return 1;
+}
+
+// Returns 1 if the instance was still counted as starting
+static int supervise_exited(int wfd, struct fleet_entry *entry, int status) {
+    int was_starting = entry->state == FLEET_STARTING;
+
+    entry->exited = 1;
+    entry->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (was_starting) {
+        // The rest of its setup frames are still queued; the channel ends in EOF
+        while (!supervise_setup(wfd, entry)) {
+        }
+    } else if (entry->state == FLEET_READY) {
+        printf("  %-7s %-24s status %d\n", "exited", entry->name, entry->status);
+    }
+    if (entry->exit_fd >= 0) {
+        unwatch(wfd, entry->exit_fd);
+        close(entry->exit_fd);
+        entry->exit_fd = -1;
+    }
+    cleanup_isolation_state(&entry->isolation);
+    fflush(stdout);
+    return was_starting;
+}
+
+static void supervise_fleet(struct fleet *fleet, int jobs, uint64_t start, double prepare, int templates) {
+    struct fleet_event events[FLEET_MAX_EVENTS];
+    int next = 0, starting = 0, running = 0, summarized = 0;
+    uint64_t deadline = 0;
+    double boot = 0;
+    int stopping = 0;
+    int status;
+    pid_t pid;
+
+    int wfd = watch_open();
+    if (wfd < 0) {
+        fprintf(stderr, "Error: Cannot create event queue: %s\n", strerror(errno));
+        return;
+    }
+
+    while (next < fleet->count || running > 0) {
+        if (fleet_stop && !stopping) {
+            stopping = 1;
+            next = fleet->count;
+            if (running > 0) {
+                printf("Stopping %d instances\n", running);
+            }
+            signal_fleet(fleet, SIGTERM);
+            deadline = timing_now() + FLEET_STOP_GRACE * 1000000000ull;
+        }
+        // PID 1 of a namespace ignores SIGTERM unless it installed a handler
+        if (deadline > 0 && timing_now() >= deadline) {
+            signal_fleet(fleet, SIGKILL);
+            deadline = 0;
+        }
+
+        // Bounded fan-out: at most jobs instances in setup at once
+        while (next < fleet->count && starting < jobs) {
+            int index = next++;
+            struct fleet_entry *entry = &fleet->entries[index];
+            if (entry->state != FLEET_PENDING) {
+                continue;
+            }
+            entry->error = start_instance(wfd, index, entry);
+            if (entry->error != 0) {
+                entry->state = FLEET_FAILED;
+                printf("  %-7s %-24s %s\n", "failed", entry->name, strerror(entry->error));
+                continue;
+            }
+            starting++;
+            running++;
+        }
+        if (!summarized && next == fleet->count && starting == 0) {
+            print_summary(fleet, prepare, templates, boot);
+            summarized = 1;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        int timeout = 1000;
+        if (deadline > 0) {
+            uint64_t now = timing_now();
+            if (deadline <= now) {
+                timeout = 0;
+            } else if ((deadline - now) / 1000000 < (uint64_t)timeout) {
+                timeout = (int)((deadline - now) / 1000000) + 1;
+            }
+        }
+        int n = watch_wait(wfd, events, timeout);
+        for (int k = 0; k < n; k++) {
+            struct fleet_entry *entry = &fleet->entries[events[k].index];
+            if (events[k].exited) {
+                // Stale events for reaped or recycled descriptors find nothing to wait for
+                if (entry->exited || waitpid(entry->pid, &status, WNOHANG) != entry->pid) {
+                    continue;
+                }
+                if (supervise_exited(wfd, entry, status)) {
+                    starting--;
+                    boot = (timing_now() - start) / 1e9;
+                }
+                running--;
+            } else if (entry->state == FLEET_STARTING && supervise_setup(wfd, entry)) {
+                starting--;
+                boot = (timing_now() - start) / 1e9;
+            }
+        }
+
+        // Exits that raced the watch, or could not be watched at all
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < fleet->count; i++) {
+                struct fleet_entry *entry = &fleet->entries[i];
+                if (entry->pid == pid && !entry->exited) {
+                    if (supervise_exited(wfd, entry, status)) {
+                        starting--;
+                        boot = (timing_now() - start) / 1e9;
+                    }
+                    running--;
+                    break;
+                }
+            }
+        }
+    }
+    close(wfd);
+}
+
+int fleet_launch(const char *manifest, int jobs, int supervise, int dry_run, int verbose) {
+    struct fleet fleet;
+    struct sigaction sa;
+    int templates = 0, failed = 0;
+
+    memset(&fleet, 0, sizeof(fleet));
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (jobs > FLEET_MAX_JOBS) {
+        jobs = FLEET_MAX_JOBS;
+    }
+    if (!dry_run && geteuid() != 0) {
+        fprintf(stderr, "Error: Isolation requires root privileges\n");
+        return 1;
+    }
+
+    uint64_t start = timing_now();
+    if (read_manifest(&fleet, manifest) != 0) {
+        return 1;
+    }
+    if (fleet.count == 0) {
+        printf("No instances in %s\n", manifest);
+        return 0;
+    }
+
+    // Entries that cannot start fail now, before any instance exists
+    for (int i = 0; i < fleet.count; i++) {
+        struct fleet_entry *entry = &fleet.entries[i];
+        entry->error = check_entry(entry);
+        if (entry->error != 0) {
+            entry->state = FLEET_FAILED;
+            failed++;
+            if (!dry_run) {
+                printf("  %-7s %-24s %s\n", "failed", entry->name, strerror(entry->error));
+            }
+        } else if (!dry_run) {
+            templates += prepare_template(entry);
+        }
+    }
+    double prepare = (timing_now() - start) / 1e9;
+
+    if (dry_run) {
+        print_plan(&fleet);
+        return failed ? 1 : 0;
+    }
+    if (verbose) {
+        printf("Loaded %d capability files and %d templates in %.1f ms\n",
+               fleet.caps_count, templates, prepare * 1e3);
+    }
+    printf("Launching %d instances from %s with %d parallel setups\n",
+           fleet.count - failed, manifest, jobs);
+    if (supervise) {
+        printf("Supervising them from pid %d (%zu bytes of bookkeeping per instance)\n",
+               (int)getpid(), sizeof(struct fleet_entry));
+    }
+    printf("\n");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (supervise) {
+        supervise_fleet(&fleet, jobs, start, prepare, templates);
+    } else {
+        run_keepers(&fleet, jobs, start, prepare, templates);
+    }
+
+    failed = 0;
+    for (int i = 0; i < fleet.count; i++) {
+        failed += fleet.entries[i].state != FLEET_READY;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+/*
+ * Signal forwarding from the launcher to its instance
+ *
+ * The launcher blocks the forwarded signals before forking, so none can
+ * be lost between fork and the wait loop, and receives them through a
+ * signalfd (kqueue on FreeBSD) while it waits. Each one is passed on to
+ * the instance through a pidfd. Stop signals start a grace period after
+ * which the instance is killed: on Linux it is PID 1 of its namespace
+ * and ignores SIGTERM unless it installed a handler.
+ *
+ * With -T the instance's standard output comes through a pipe that the
+ * same loop copies to ours, which is how its first byte gets timed. A
+ * warm pool keeper has no signals of its own to forward; it reads the
+ * ones its client received from the claim socket instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
+#include "common.h"
+
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "TERM", SIGTERM },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "WINCH", SIGWINCH }, { "CONT", SIGCONT },
+    { "ALRM", SIGALRM }, { "PIPE", SIGPIPE }, { NULL, 0 }
+};
+
+static const char *signal_name(int sig) {
+    for (int i = 0; signal_names[i].name; i++) {
+        if (signal_names[i].number == sig) {
+            return signal_names[i].name;
+        }
+    }
+    return "?";
+}
+
+#define ESCALATED UINT64_MAX        /* deadline once SIGKILL has been sent */
+
+static int is_stop_signal(int sig) {
+    return sig == SIGTERM || sig == SIGINT || sig == SIGQUIT;
+}
+
+void forward_default_config(struct forward_config *config) {
+    sigemptyset(&config->signals);
+    sigaddset(&config->signals, SIGHUP);
+    sigaddset(&config->signals, SIGINT);
+    sigaddset(&config->signals, SIGQUIT);
+    sigaddset(&config->signals, SIGTERM);
+    sigaddset(&config->signals, SIGUSR1);
+    sigaddset(&config->signals, SIGUSR2);
+    config->grace_seconds = FORWARD_DEFAULT_GRACE;
+    config->relay_fd = -1;
+    config->control_fd = -1;
+}
+
+// "TERM,HUP", "SIGTERM,SIGHUP", "15,1" or "none"
+int forward_parse_signals(const char *list, sigset_t *set) {
+    char buffer[256];
+    char *save = NULL;
+
+    sigemptyset(set);
+    if (strcmp(list, "none") == 0) {
+        return 0;
+    }
+    if (strlen(list) >= sizeof(buffer)) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(buffer, list);
+
+    for (char *word = strtok_r(buffer, ",", &save); word; word = strtok_r(NULL, ",", &save)) {
+        int sig = 0;
+        if (strncasecmp(word, "SIG", 3) == 0) {
+            word += 3;
+        }
+        for (int i = 0; signal_names[i].name; i++) {
+            if (strcasecmp(word, signal_names[i].name) == 0) {
+                sig = signal_names[i].number;
+            }
+        }
+        if (sig == 0) {
+            char *end;
+            long value = strtol(word, &end, 10);
+            if (*word != '\0' && *end == '\0' && value > 0 && value < NSIG) {
+                sig = (int)value;
+            }
+        }
+        // SIGCHLD tells the launcher its instance exited; it is never forwarded
+        if (sig == 0 || sig == SIGKILL || sig == SIGSTOP || sig == SIGCHLD) {
+            fprintf(stderr, "Error: Cannot forward signal %s\n", word);
+            errno = EINVAL;
+            return -1;
+        }
+        sigaddset(set, sig);
+    }
+    return 0;
+}
+
+// Call before forking; the child restores the saved mask before it execs
+int forward_block_signals(const struct forward_config *config, sigset_t *saved) {
+    sigset_t mask = config->signals;
+    sigaddset(&mask, SIGCHLD);
+    return sigprocmask(SIG_BLOCK, &mask, saved);
+}
+
+// A stop signal that arrived during setup cancels the launch before exec
+int forward_stop_pending(void) {
+    sigset_t pending;
+
+    if (sigpending(&pending) != 0) {
+        return 0;
+    }
+    return sigismember(&pending, SIGTERM) == 1 || sigismember(&pending, SIGINT) == 1 ||
+           sigismember(&pending, SIGQUIT) == 1;
+}
+
+static int wait_exited(pid_t pid, int *status) {
+    pid_t ret;
+
+    while ((ret = waitpid(pid, status, WNOHANG)) < 0 && errno == EINTR) {
+    }
+    return ret == pid;
+}
+
+// Decide what a received signal means: forward it, and maybe start the grace period
+static void handle_signal(pid_t pid, int pidfd, int sig, int from_terminal,
+                          const struct forward_config *config, uint64_t *deadline) {
+    // The terminal already signalled the instance, which shares our process group
+    if (!from_terminal) {
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+        if (pidfd < 0 || syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) != 0) {
+            kill(pid, sig);
+        }
+#else
+        (void)pidfd;
+        kill(pid, sig);
+#endif
+    }
+    if (is_stop_signal(sig) && config->grace_seconds > 0 && *deadline == 0) {
+        *deadline = timing_now() + (uint64_t)config->grace_seconds * 1000000000u;
+    }
+}
+
+static void escalate(pid_t pid, int pidfd, int sig, const struct forward_config *config) {
+    fprintf(stderr, "Warning: Instance did not stop within %d seconds of SIG%s, killing it\n",
+            config->grace_seconds, signal_name(sig));
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+    if (pidfd >= 0 && syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0) == 0) {
+        return;
+    }
+#else
+    (void)pidfd;
+#endif
+    kill(pid, SIGKILL);
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;   // our stdout went away; keep draining the instance
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Copy what the instance has written so far; returns -1 once its end is closed
+static int relay_output(int fd, int *relayed) {
+    char buffer[16384];
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (!*relayed) {
+            timing_mark(TIMING_FIRST_BYTE);
+            *relayed = 1;
+        }
+        write_all(STDOUT_FILENO, buffer, (size_t)n);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+// Forward what the pool client relayed; returns -1 once it hung up. The
+// socket still carries the exit status back, so it stays open.
+static int relay_signals(int fd, pid_t pid, int pidfd, const struct forward_config *config,
+                         uint64_t *deadline, int *last) {
+    int32_t wire;
+    ssize_t n;
+
+    while ((n = recv(fd, &wire, sizeof(wire), MSG_DONTWAIT)) == (ssize_t)sizeof(wire)) {
+        int sig = (int)wire;
+        if (sig <= 0 || sig >= NSIG || sig == SIGKILL || sig == SIGSTOP || sig == SIGCHLD) {
+            continue;
+        }
+        *last = is_stop_signal(sig) ? sig : *last;
+        handle_signal(pid, pidfd, sig, 0, config, deadline);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return fd;
+    }
+    return -1;
+}
+
+static int timeout_ms(uint64_t deadline) {
+    if (deadline == 0 || deadline == ESCALATED) {
+        return -1;
+    }
+    uint64_t now = timing_now();
+    return deadline > now ? (int)((deadline - now) / 1000000) + 1 : 0;
+}
+
+#ifdef __linux__
+
+int forward_wait(pid_t pid, const struct forward_config *config, int *status) {
+    sigset_t mask = config->signals;
+    struct signalfd_siginfo info;
+    struct pollfd pfds[4];
+    uint64_t deadline = 0;
+    int relay_fd = config->relay_fd;
+    int control_fd = config->control_fd;
+    int relayed = 0;
+    int last = 0;
+    int pidfd = -1;
+
+    sigaddset(&mask, SIGCHLD);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0) {
+        fprintf(stderr, "Warning: Cannot forward signals: %s\n", strerror(errno));
+        while (waitpid(pid, status, 0) < 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#ifdef SYS_pidfd_open
+    // Without pidfds (before Linux 5.3) SIGCHLD and kill() do the same job
+    pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    if (relay_fd >= 0) {
+        fcntl(relay_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    for (;;) {
+        // The instance may have exited before the first poll
+        if (wait_exited(pid, status)) {
+            break;
+        }
+        if (deadline > 0 && timing_now() >= deadline) {
+            escalate(pid, pidfd, last, config);
+            deadline = ESCALATED;
+        }
+
+        int n = 0;
+        pfds[n].fd = sfd;
+        pfds[n++].events = POLLIN;
+        if (pidfd >= 0) {
+            pfds[n].fd = pidfd;
+            pfds[n++].events = POLLIN;
+        }
+        if (relay_fd >= 0) {
+            pfds[n].fd = relay_fd;
+            pfds[n++].events = POLLIN;
+        }
+        if (control_fd >= 0) {
+            pfds[n].fd = control_fd;
+            pfds[n++].events = POLLIN;
+        }
+        if (poll(pfds, n, timeout_ms(deadline)) < 0 && errno != EINTR) {
+            break;
+        }
+        if (relay_fd >= 0) {
+            relay_fd = relay_output(relay_fd, &relayed);
+        }
+        if (control_fd >= 0) {
+            control_fd = relay_signals(control_fd, pid, pidfd, config, &deadline, &last);
+        }
+
+        while (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+            int sig = (int)info.ssi_signo;
+            if (sig == SIGCHLD) {
+                continue;
+            }
+            last = is_stop_signal(sig) ? sig : last;
+            handle_signal(pid, pidfd, sig, info.ssi_code == SI_KERNEL, config, &deadline);
+        }
+    }
+
+    // Whatever the instance wrote just before exiting
+    if (relay_fd >= 0) {
+        relay_output(relay_fd, &relayed);
+    }
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    close(sfd);
+    return 0;
+}
+
+#else
+
+int forward_wait(pid_t pid, const struct forward_config *config, int *status) {
+    struct kevent changes[NSIG + 3];
+    struct kevent events[16];
+    struct timespec ts, *tsp;
+    uint64_t deadline = 0;
+    int relay_fd = config->relay_fd;
+    int control_fd = config->control_fd;
+    int relayed = 0;
+    int last = 0;
+    int count = 0;
+
+    int kq = kqueue();
+    for (int sig = 1; kq >= 0 && sig < NSIG; sig++) {
+        if (sigismember(&config->signals, sig) == 1) {
+            EV_SET(&changes[count], sig, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+            count++;
+        }
+    }
+    EV_SET(&changes[count], pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+    count++;
+    if (relay_fd >= 0) {
+        fcntl(relay_fd, F_SETFL, O_NONBLOCK);
+        EV_SET(&changes[count], relay_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        count++;
+    }
+    if (control_fd >= 0) {
+        EV_SET(&changes[count], control_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        count++;
+    }
+    if (kq < 0 || kevent(kq, changes, count, NULL, 0, NULL) != 0) {
+        // Already gone, or no kqueue: nothing left to forward
+        if (kq >= 0) {
+            close(kq);
+        }
+        while (waitpid(pid, status, 0) < 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        if (relay_fd >= 0) {
+            relay_output(relay_fd, &relayed);
+        }
+        return 0;
+    }
+
+    for (;;) {
+        if (wait_exited(pid, status)) {
+            break;
+        }
+        if (deadline > 0 && timing_now() >= deadline) {
+            escalate(pid, -1, last, config);
+            deadline = ESCALATED;
+        }
+
+        int ms = timeout_ms(deadline);
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000;
+        tsp = ms < 0 ? NULL : &ts;
+        int n = kevent(kq, NULL, 0, events, 16, tsp);
+        for (int i = 0; i < n; i++) {
+            if (events[i].filter == EVFILT_READ && control_fd >= 0 &&
+                events[i].ident == (uintptr_t)control_fd) {
+                control_fd = relay_signals(control_fd, pid, -1, config, &deadline, &last);
+                if (control_fd < 0) {
+                    EV_SET(&changes[0], events[i].ident, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+                    kevent(kq, changes, 1, NULL, 0, NULL);
+                }
+                continue;
+            }
+            if (events[i].filter == EVFILT_READ && relay_fd >= 0) {
+                // Closing the descriptor also removes it from the kqueue
+                relay_fd = relay_output(relay_fd, &relayed);
+                continue;
+            }
+            if (events[i].filter != EVFILT_SIGNAL) {
+                continue;
+            }
+            // kqueue cannot tell terminal signals apart, so they are forwarded too
+            int sig = (int)events[i].ident;
+            last = is_stop_signal(sig) ? sig : last;
+            handle_signal(pid, -1, sig, 0, config, &deadline);
+        }
+    }
+
+    if (relay_fd >= 0) {
+        relay_output(relay_fd, &relayed);
+    }
+    close(kq);
+    return 0;
+}
+
+#endif
@@ -21,9 +21,13 @@
 #include <fcntl.h>
 #include "common.h"
 
+#define JAIL_ROOT_PREFIX "/tmp/isolate-"
+
 static char ephemeral_username[64];
 static int created_jail_id = -1;
 static char jail_root_path[PATH_MAX];
+static int template_mounted;
+static uid_t ephemeral_uid = (uid_t)-1;
 
 // Functions to set jail info from parent process
 void freebsd_set_jail_id(int jid) {
@@ -53,55 +57,37 @@ const char* freebsd_get_jail_path(void) {
     return jail_root_path;
 }
 
-static int create_ephemeral_user(const char *username, uid_t *out_uid, gid_t *out_gid) {
-    struct passwd *pw;
-    char cmd[256];
-    int ret;
-
-    // Check if user already exists
-    pw = getpwnam(username);
-    if (pw != NULL) {
-        printf("User %s already exists, using existing user\n", username);
-        if (out_uid) *out_uid = pw->pw_uid;
-        if (out_gid) *out_gid = pw->pw_gid;
-        return 0;
-    }
-
-    printf("Creating ephemeral user: %s\n", username);
+void freebsd_set_ephemeral_uid(uid_t uid) {
+    ephemeral_uid = uid;
+}
 
-    // Create user with pw command
-    // -n: name, -s: shell (nologin), -d: home dir, -c: comment
-    snprintf(cmd, sizeof(cmd),
-             "pw useradd -n %s -s /usr/sbin/nologin -d /tmp -c 'Isolate ephemeral user' >/dev/null 2>&1",
-             username);
+uid_t freebsd_get_ephemeral_uid(void) {
+    return ephemeral_uid;
+}
 
-    ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to create user %s: %s\n", username, strerror(errno));
-        return -1;
-    }
+// Ephemeral users exist only in the jail's synthesized passwd/group;
+// the host password database is never touched
+static int create_ephemeral_user(char *username, size_t username_size, uid_t *out_uid, gid_t *out_gid) {
+    uid_t uid;
 
-    // Verify user was created and get UID/GID
-    pw = getpwnam(username);
-    if (pw == NULL) {
-        fprintf(stderr, "User creation appeared to succeed but user not found\n");
+    // The parent process outlives us and releases the UID after cleanup
+    if (uid_range_acquire(getppid(), &uid) != 0) {
+        fprintf(stderr, "Failed to allocate ephemeral UID: %s\n", strerror(errno));
         return -1;
     }
+    ephemeral_uid = uid;
 
-    printf("Created user %s with UID %d, GID %d\n", username, pw->pw_uid, pw->pw_gid);
-    if (out_uid) *out_uid = pw->pw_uid;
-    if (out_gid) *out_gid = pw->pw_gid;
+    snprintf(username, username_size, "app-%d", uid);
+    printf("Allocated ephemeral user %s with UID %d, GID %d\n", username, uid, uid);
+    if (out_uid) *out_uid = uid;
+    if (out_gid) *out_gid = uid;
     return 0;
 }
 
-static int cleanup_ephemeral_user(const char *username) {
-    char cmd[256];
-    
-    printf("Cleaning up ephemeral user: %s\n", username);
-    snprintf(cmd, sizeof(cmd), "pw userdel -n %s >/dev/null 2>&1", username);
-    system(cmd);  // Best effort cleanup
-    
-    return 0;
+static void cleanup_ephemeral_user(void) {
+    printf("Releasing ephemeral user: %s (UID %d)\n", ephemeral_username, ephemeral_uid);
+    uid_range_release(ephemeral_uid);
+    ephemeral_uid = (uid_t)-1;
 }
 
 static int setup_resource_limits(const char *jail_name, const struct resource_limits *limits) {
@@ -140,6 +126,16 @@ static int setup_resource_limits(const char *jail_name, const struct resource_li
         }
     }
     
+    if (limits->max_cpu_percent > 0) {
+        printf("Setting CPU limit: %d%%\n", limits->max_cpu_percent);
+        snprintf(rule, sizeof(rule), "jail:%s:pcpu:deny=%d", jail_name, limits->max_cpu_percent);
+        
+        ret = rctl_add_rule(rule, strlen(rule) + 1, outbuf, sizeof(outbuf));
+        if (ret != 0) {
+            fprintf(stderr, "Warning: Failed to set CPU limit: %s\n", strerror(errno));
+        }
+    }
+    
     return 0;
 }
 
@@ -235,8 +231,6 @@ static int switch_to_user(uid_t uid, gid_t gid, const char *username_for_display
 }
 
 void freebsd_cleanup_isolation(void) {
-    char cmd[512];
-    
     if (created_jail_id >= 0) {
         printf("Cleaning up jail JID %d\n", created_jail_id);
         jail_remove(created_jail_id);
@@ -247,30 +241,56 @@ void freebsd_cleanup_isolation(void) {
     if (strlen(jail_root_path) > 0) {
         printf("Cleaning up jail filesystem: %s\n", jail_root_path);
         
-        // Unmount filesystems
-        snprintf(cmd, sizeof(cmd), "umount %s/dev 2>/dev/null", jail_root_path);
-        system(cmd);
-        snprintf(cmd, sizeof(cmd), "umount %s/bin 2>/dev/null", jail_root_path);
-        system(cmd);
-        snprintf(cmd, sizeof(cmd), "umount %s/lib 2>/dev/null", jail_root_path);
-        system(cmd);
-        snprintf(cmd, sizeof(cmd), "umount %s/libexec 2>/dev/null", jail_root_path);
-        system(cmd);
-        snprintf(cmd, sizeof(cmd), "umount %s/usr/lib 2>/dev/null", jail_root_path);
-        system(cmd);
-        snprintf(cmd, sizeof(cmd), "umount %s/usr/local/lib 2>/dev/null", jail_root_path);
-        system(cmd);
-        
-        // Remove jail directory
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", jail_root_path);
-        system(cmd);
+        // Unmount everything below the jail root (devfs, workspace, rules)
+        if (fsops_unmount_tree(jail_root_path) != 0) {
+            // nullfs mounts share st_dev with the host, so no walk can tell
+            // them apart from the root's own files; leave everything in place
+            fprintf(stderr, "Warning: Failed to unmount all filesystems under %s, leaving it in place\n",
+                    jail_root_path);
+        } else {
+            // Contents are deleted in the background, off the exit path
+            fsops_reclaim_tree(jail_root_path);
+        }
         
         jail_root_path[0] = '\0';
     }
     
-    if (strlen(ephemeral_username) > 0) {
-        cleanup_ephemeral_user(ephemeral_username);
-        ephemeral_username[0] = '\0';
+    if (ephemeral_uid != (uid_t)-1) {
+        cleanup_ephemeral_user();
+    }
+    ephemeral_username[0] = '\0';
+}
+
+void freebsd_detach_isolation(struct isolation_state *state) {
+    size_t prefix = strlen(JAIL_ROOT_PREFIX);
+
+    if (created_jail_id < 0 && jail_root_path[0] == '\0' && ephemeral_uid == (uid_t)-1) {
+        return;
+    }
+
+    // The jail root is always derived from the jail name
+    state->name[0] = '\0';
+    if (strncmp(jail_root_path, JAIL_ROOT_PREFIX, prefix) == 0) {
+        snprintf(state->name, sizeof(state->name), "%.*s", (int)sizeof(state->name) - 1,
+                 jail_root_path + prefix);
+    }
+    state->jid = created_jail_id;
+    state->uid = ephemeral_uid;
+
+    created_jail_id = -1;
+    jail_root_path[0] = '\0';
+    ephemeral_uid = (uid_t)-1;
+    ephemeral_username[0] = '\0';
+}
+
+void freebsd_restore_isolation(const struct isolation_state *state) {
+    created_jail_id = state->jid;
+    if (state->name[0] != '\0') {
+        snprintf(jail_root_path, sizeof(jail_root_path), JAIL_ROOT_PREFIX "%s", state->name);
+    }
+    ephemeral_uid = state->uid;
+    if (ephemeral_uid != (uid_t)-1) {
+        snprintf(ephemeral_username, sizeof(ephemeral_username), "app-%d", ephemeral_uid);
     }
 }
 
@@ -288,83 +308,63 @@ static int setup_network_isolation(const struct network_rule *rules, int count)
     return 0;
 }
 
+// Host path of an absolute path inside the jail
+static int jail_host_path(char *path, size_t size, const char *jail_path, const char *inner) {
+    int len = snprintf(path, size, "%s%s", jail_path, inner);
+    if (len < 0 || (size_t)len >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
 static int setup_filesystem_isolation(const struct capabilities *caps, const char *jail_path, const char *target_binary, uid_t target_uid, gid_t target_gid, const char *username) {
-    char cmd[512];
-    int ret;
+    char path[PATH_MAX];
 
     printf("Setting up filesystem isolation in %s\n", jail_path);
 
-    // Create basic directory structure
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/bin", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/lib", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/usr/lib", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/usr/local/lib", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/dev", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/tmp", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/libexec", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc", jail_path);
-    system(cmd);
-    
-    printf("Creating standard application directories...\n");
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/var/log", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/var/tmp", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/var/run", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "chmod 1777 %s/tmp", jail_path);
-    system(cmd);
-    snprintf(cmd, sizeof(cmd), "chmod 755 %s/var/log %s/var/tmp %s/var/run", 
-	     jail_path, jail_path, jail_path);
-    system(cmd);
+    int root_fd = fsops_open_dir(jail_path);
+    if (root_fd < 0) {
+        fprintf(stderr, "Failed to open jail directory %s: %s\n", jail_path, strerror(errno));
+        return -1;
+    }
+
+    // Create basic directory structure unless the rootfs template provides it
+    if (!template_mounted && template_populate(root_fd, caps) != 0) {
+        fprintf(stderr, "Failed to create jail skeleton in %s: %s\n", jail_path, strerror(errno));
+        close(root_fd);
+        return -1;
+    }
 
     // Mount workspace directory if specified
-    if (strlen(caps->workspace_path) > 0) {
-	printf("Setting up workspace: %s -> /workspace\n", caps->workspace_path);
-	snprintf(cmd, sizeof(cmd), "mkdir -p %s/workspace", jail_path);
-	system(cmd);
-
-	snprintf(cmd, sizeof(cmd), "mount -t nullfs -o rw %s %s/workspace", 
-		 caps->workspace_path, jail_path);
-	ret = system(cmd);
-	if (ret != 0) {
-	    fprintf(stderr, "Failed to mount workspace directory %s\n", caps->workspace_path);
-	    return -1;
-	}
-	printf("Workspace mounted successfully\n");
-    }
-    // Copy target binary into jail
-    char binary_name[256];
-    const char *slash = strrchr(target_binary, '/');
-    if (slash) {
-        strcpy(binary_name, slash + 1);
-    } else {
-        strcpy(binary_name, target_binary);
+    if (caps->workspace_path) {
+        printf("Setting up workspace: %s -> /workspace\n", caps->workspace_path);
+
+        if (jail_host_path(path, sizeof(path), jail_path, "/workspace") != 0 ||
+            fsops_bind_mount(caps->workspace_path, path, 1) != 0) {
+            fprintf(stderr, "Failed to mount workspace directory %s: %s\n",
+                    caps->workspace_path, strerror(errno));
+            close(root_fd);
+            return -1;
+        }
+        printf("Workspace mounted successfully\n");
     }
-    
-    snprintf(cmd, sizeof(cmd), "cp %s %s/%s", target_binary, jail_path, binary_name);
-    ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to copy binary to jail\n");
+
+    // Stage target binary into jail without copying it when possible
+    const char *binary_name = strrchr(target_binary, '/');
+    binary_name = binary_name ? binary_name + 1 : target_binary;
+    enum stage_method method;
+    if (fsops_stage_file(target_binary, root_fd, jail_path, binary_name, &method) != 0) {
+        fprintf(stderr, "Failed to stage binary: %s\n", strerror(errno));
+        close(root_fd);
         return -1;
     }
-    
-    // Make binary executable
-    snprintf(cmd, sizeof(cmd), "chmod +x %s/%s", jail_path, binary_name);
-    system(cmd);
+    printf("Staged %s via %s\n", binary_name, fsops_stage_method_name(method));
 
     // Create minimal passwd file for jail (only root and the isolated user)
     char passwd_path[PATH_MAX];
-    snprintf(passwd_path, sizeof(passwd_path), "%s/etc/passwd", jail_path);
-
-    FILE *passwd_file = fopen(passwd_path, "w");
+    FILE *passwd_file = jail_host_path(passwd_path, sizeof(passwd_path), jail_path, "/etc/passwd") == 0 ?
+                        fopen(passwd_path, "w") : NULL;
     if (passwd_file) {
         fprintf(passwd_file,
                 "root:*:0:0:System Administrator:/root:/usr/sbin/nologin\n"
@@ -378,9 +378,8 @@ static int setup_filesystem_isolation(const struct capabilities *caps, const cha
 
     // Create minimal group file
     char group_path[PATH_MAX];
-    snprintf(group_path, sizeof(group_path), "%s/etc/group", jail_path);
-
-    FILE *group_file = fopen(group_path, "w");
+    FILE *group_file = jail_host_path(group_path, sizeof(group_path), jail_path, "/etc/group") == 0 ?
+                       fopen(group_path, "w") : NULL;
     if (group_file) {
         fprintf(group_file,
                 "wheel:*:0:root\n"
@@ -396,62 +395,71 @@ static int setup_filesystem_isolation(const struct capabilities *caps, const cha
     printf("Mounting system directories...\n");
       
     // Mount devfs for stdout/stderr/null access
-    snprintf(cmd, sizeof(cmd), "mount -t devfs devfs %s/dev", jail_path);
-    ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Warning: Failed to mount devfs\n");
+    if (jail_host_path(path, sizeof(path), jail_path, "/dev") != 0 ||
+        fsops_mount_fs("devfs", path, 0, NULL) != 0) {
+        fprintf(stderr, "Warning: Failed to mount devfs: %s\n", strerror(errno));
     }
 
     printf("Processing capability filesystem rules...\n");
     for (int i = 0; i < caps->file_count; i++) {
-	const struct file_rule *rule = &caps->files[i];
-
-	// Only mount directories that exist and are readable
-	if (rule->permissions & R_OK) {
-	    struct stat st;
-	    if (stat(rule->path, &st) == 0 && S_ISDIR(st.st_mode)) {
-		char mount_point[PATH_MAX];
-		snprintf(mount_point, sizeof(mount_point), "%s%s", jail_path, rule->path);
-
-		// Create mount point
-		snprintf(cmd, sizeof(cmd), "mkdir -p %s", mount_point);
-		system(cmd);
-
-		// Mount the directory
-		const char *mount_opts = (rule->permissions & W_OK) ? "rw" : "ro";
-		snprintf(cmd, sizeof(cmd), "mount -t nullfs -o %s %s %s", 
-			 mount_opts, rule->path, mount_point);
-
-		printf("Mounting %s -> %s (%s)\n", rule->path, mount_point, mount_opts);
-		ret = system(cmd);
-		if (ret != 0) {
-		    fprintf(stderr, "Warning: Failed to mount %s\n", rule->path);
-		}
-	    }
-	}
-    }
-    
-    // Set permissions on tmp
-    snprintf(cmd, sizeof(cmd), "chmod 1777 %s/tmp", jail_path);
-    system(cmd);
-    
-    printf("Jail filesystem setup complete\n");
+        const struct file_rule *rule = &caps->files[i];
+
+        // Mount directories and stage files at the same path; w makes either writable
+        if (rule->permissions & (R_OK | W_OK | X_OK)) {
+            struct stat st;
+            if (stat(rule->path, &st) != 0) {
+                continue;
+            }
+            int writable = (rule->permissions & W_OK) != 0;
+            if (S_ISREG(st.st_mode)) {
+                enum stage_method file_method;
+                if (fsops_stage_path(rule->path, root_fd, jail_path, writable, &file_method) != 0) {
+                    fprintf(stderr, "Warning: Failed to stage %s: %s\n", rule->path, strerror(errno));
+                } else if (file_method != STAGE_NONE) {
+                    printf("Staged %s via %s\n", rule->path, fsops_stage_method_name(file_method));
+                }
+            } else if (S_ISDIR(st.st_mode)) {
+                char mount_point[PATH_MAX];
+                if (jail_host_path(mount_point, sizeof(mount_point), jail_path, rule->path) != 0) {
+                    fprintf(stderr, "Warning: Failed to mount %s: %s\n", rule->path, strerror(errno));
+                    continue;
+                }
+
+                // Create mount point
+                fsops_mkdirs(root_fd, rule->path + 1, 0755);
+
+                // Mount the directory
+                printf("Mounting %s -> %s (%s)\n", rule->path, mount_point, writable ? "rw" : "ro");
+                if (fsops_bind_mount(rule->path, mount_point, writable) != 0) {
+                    fprintf(stderr, "Warning: Failed to mount %s: %s\n", rule->path, strerror(errno));
+                }
+            }
+        }
+    }
+    
+    close(root_fd);
+
+    printf("Jail filesystem setup complete (%lu syscalls, no helper processes)\n",
+           fsops_syscall_count());
     return 0;
 }
 
 static int create_jail_filesystem(char *jail_path, size_t jail_path_size, const char *jail_name) {
     // Create temporary jail root directory
-    snprintf(jail_path, jail_path_size, "/tmp/isolate-%s", jail_name);
+    snprintf(jail_path, jail_path_size, JAIL_ROOT_PREFIX "%s", jail_name);
     
     printf("Creating jail filesystem: %s\n", jail_path);
     
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", jail_path);
-    system(cmd);  // Clean up any previous jail
+    // Clean up any previous jail, including mounts it left behind; one
+    // whose mounts cannot be detached is never deleted or reused
+    if (fsops_unmount_tree(jail_path) != 0) {
+        fprintf(stderr, "Error: %s still has filesystems mounted\n", jail_path);
+        return -1;
+    }
+    fsops_reclaim_tree(jail_path);
     
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s", jail_path);
-    if (system(cmd) != 0) {
-        fprintf(stderr, "Failed to create jail directory: %s\n", jail_path);
+    if (fsops_mkdirs(AT_FDCWD, jail_path, 0755) != 0) {
+        fprintf(stderr, "Failed to create jail directory %s: %s\n", jail_path, strerror(errno));
         return -1;
     }
     
@@ -477,16 +485,15 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     snprintf(jail_name, sizeof(jail_name), "isolate-%d", getpid());
 
     // Determine username and create user FIRST, capture UID/GID
+    setup_phase(SETUP_PHASE_USER);
     if (caps->create_user && strcmp(caps->username, "auto") == 0) {
-        snprintf(username, sizeof(username), "app-%d", getpid());
-        strncpy(ephemeral_username, username, sizeof(ephemeral_username) - 1);
-
-        ret = create_ephemeral_user(username, &target_uid, &target_gid);
+        ret = create_ephemeral_user(username, sizeof(username), &target_uid, &target_gid);
         if (ret != 0) {
             return ret;
         }
+        snprintf(ephemeral_username, sizeof(ephemeral_username), "%s", username);
     } else {
-        strncpy(username, caps->username, sizeof(username) - 1);
+        snprintf(username, sizeof(username), "%s", caps->username);
 
         // For non-auto users, look up UID/GID on host before entering jail
         struct passwd *pw = getpwnam(caps->username);
@@ -500,13 +507,25 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
     
     // Create isolated jail filesystem
+    setup_phase(SETUP_PHASE_ROOTFS);
     ret = create_jail_filesystem(jail_root_path, sizeof(jail_root_path), jail_name);
     if (ret != 0) {
         freebsd_cleanup_isolation();
         return ret;
     }
 
+    // Layer the shared skeleton for these capabilities beneath the jail root
+    char template_path[PATH_MAX];
+    if (template_prepare(caps, template_path, sizeof(template_path)) == 0) {
+        if (template_mount(template_path, jail_root_path) == 0) {
+            template_mounted = 1;
+        } else {
+            fprintf(stderr, "Warning: Failed to layer template %s: %s\n", template_path, strerror(errno));
+        }
+    }
+
     // Set up filesystem isolation (now that user exists and UID/GID are known)
+    setup_phase(SETUP_PHASE_FILESYSTEM);
     ret = setup_filesystem_isolation(caps, jail_root_path, target_binary, target_uid, target_gid, username);
     if (ret != 0) {
         freebsd_cleanup_isolation();
@@ -514,6 +533,7 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
 
     // Create jail with isolated filesystem
+    setup_phase(SETUP_PHASE_JAIL);
     int jid = create_jail(jail_name, jail_root_path);
     if (jid < 0) {
         freebsd_cleanup_isolation();
@@ -521,6 +541,7 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
 
     // Set resource limits
+    setup_phase(SETUP_PHASE_LIMITS);
     ret = setup_resource_limits(jail_name, &caps->limits);
     if (ret != 0) {
         freebsd_cleanup_isolation();
@@ -528,6 +549,7 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
 
     // Set up network isolation
+    setup_phase(SETUP_PHASE_NETWORK);
     ret = setup_network_isolation(caps->network, caps->network_count);
     if (ret != 0) {
         freebsd_cleanup_isolation();
@@ -535,6 +557,7 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
 
     // Attach to jail
+    setup_phase(SETUP_PHASE_ATTACH);
     ret = attach_to_jail(jid);
     if (ret != 0) {
         freebsd_cleanup_isolation();
@@ -542,6 +565,7 @@ int freebsd_create_isolation(const struct capabilities *caps) {
     }
 
     // Switch to target user using pre-resolved UID/GID
+    setup_phase(SETUP_PHASE_CREDENTIALS);
     ret = switch_to_user(target_uid, target_gid, username);
     if (ret != 0) {
         freebsd_cleanup_isolation();
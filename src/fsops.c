@@ -0,0 +1,687 @@
+/*
+ * Native filesystem operations shared by the isolation backends
+ *
+ * Replaces shelling out to mkdir/chmod/cp/mount/umount/rm. Every
+ * syscall issued here is counted so launches can report their cost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <mntent.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)  // <linux/fs.h> clashes with <sys/mount.h>
+#endif
+#endif
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/uio.h>
+#endif
+#include "common.h"
+
+/* Sibling directory that doomed trees are renamed into */
+#define GRAVEYARD_NAME ".isolate-graveyard"
+#define REAPER_MAX_WORKERS 4
+
+static unsigned long syscall_count;
+
+// Relaxed atomic, since batch detection calls in from several threads
+#define COUNTED(call) (__atomic_fetch_add(&syscall_count, 1, __ATOMIC_RELAXED), (call))
+
+unsigned long fsops_syscall_count(void) {
+    return __atomic_load_n(&syscall_count, __ATOMIC_RELAXED);
+}
+
+int fsops_open_dir(const char *path) {
+    return COUNTED(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+int fsops_mkdirs(int dirfd, const char *path, mode_t mode) {
+    char tmp[PATH_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // Try the leaf first; only walk the parents when they are missing
+    if (COUNTED(mkdirat(dirfd, tmp, mode)) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (COUNTED(mkdirat(dirfd, tmp, mode)) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (COUNTED(mkdirat(dirfd, tmp, mode)) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int fsops_chmod(int dirfd, const char *path, mode_t mode) {
+    return COUNTED(fchmodat(dirfd, path, mode, 0));
+}
+
+int fsops_create_file(int dirfd, const char *path, mode_t mode) {
+    int fd = COUNTED(openat(dirfd, path, O_WRONLY | O_CREAT | O_CLOEXEC, mode));
+    if (fd < 0) {
+        return -1;
+    }
+    COUNTED(close(fd));
+    return 0;
+}
+
+static int copy_contents(int in, int out) {
+    ssize_t n;
+
+    // Let the kernel move the data; fall back when the filesystems disagree
+    for (;;) {
+        n = COUNTED(copy_file_range(in, NULL, out, NULL, 1 << 30, 0));
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+            break;
+        }
+        return -1;
+    }
+
+    char buf[65536];
+    while ((n = COUNTED(read(in, buf, sizeof(buf)))) > 0) {
+        if (COUNTED(write(out, buf, n)) != n) {
+            return -1;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int fsops_copy_file(const char *source, int dirfd, const char *target, mode_t mode) {
+    int in = COUNTED(open(source, O_RDONLY | O_CLOEXEC));
+    if (in < 0) {
+        return -1;
+    }
+    int out = COUNTED(openat(dirfd, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode));
+    if (out < 0) {
+        int saved_errno = errno;
+        COUNTED(close(in));
+        errno = saved_errno;
+        return -1;
+    }
+
+    int ret = copy_contents(in, out);
+    int saved_errno = errno;
+
+    // O_CREAT honours the umask; make sure the requested mode sticks
+    if (ret == 0) {
+        ret = COUNTED(fchmod(out, mode));
+        saved_errno = errno;
+    }
+    COUNTED(close(in));
+    COUNTED(close(out));
+    errno = saved_errno;
+    return ret;
+}
+
+#ifdef __linux__
+static unsigned long locked_mount_flags(const char *path) {
+    struct statvfs sv;
+    unsigned long flags = 0;
+
+    // A remount inside a user namespace must keep the flags it inherited
+    if (COUNTED(statvfs(path, &sv)) != 0) {
+        return 0;
+    }
+    if (sv.f_flag & ST_NOSUID) flags |= MS_NOSUID;
+    if (sv.f_flag & ST_NODEV) flags |= MS_NODEV;
+    if (sv.f_flag & ST_NOEXEC) flags |= MS_NOEXEC;
+    if (sv.f_flag & ST_NOATIME) flags |= MS_NOATIME;
+    if (sv.f_flag & ST_NODIRATIME) flags |= MS_NODIRATIME;
+    if (sv.f_flag & ST_RELATIME) flags |= MS_RELATIME;
+    return flags;
+}
+
+int fsops_bind_mount(const char *source, const char *target, int writable) {
+    if (COUNTED(mount(source, target, NULL, MS_BIND | MS_REC, NULL)) != 0) {
+        return -1;
+    }
+    if (!writable) {
+        unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY | locked_mount_flags(source);
+        if (COUNTED(mount(NULL, target, NULL, flags, NULL)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int fsops_mount_fs(const char *fstype, const char *target, unsigned long flags, const char *data) {
+    return COUNTED(mount(fstype, target, fstype, flags, data));
+}
+
+int fsops_unmount_tree(const char *root) {
+    char *targets[256];
+    int count = 0;
+    size_t len = strlen(root);
+
+    FILE *mounts = setmntent("/proc/self/mounts", "r");
+    if (!mounts) {
+        return -1;
+    }
+    struct mntent *ent;
+    while ((ent = getmntent(mounts)) && count < (int)(sizeof(targets) / sizeof(targets[0]))) {
+        if (strncmp(ent->mnt_dir, root, len) == 0 &&
+            (ent->mnt_dir[len] == '/' || ent->mnt_dir[len] == '\0')) {
+            targets[count++] = strdup(ent->mnt_dir);
+        }
+    }
+    endmntent(mounts);
+
+    // A lazy detach takes every mount below its target with it, so only
+    // the topmost mounts (listed parent first) need an unmount call
+    int ret = 0;
+    const char *top = NULL;
+    for (int i = 0; i < count; i++) {
+        size_t top_len = top ? strlen(top) : 0;
+        if (!targets[i] ||
+            (top && strncmp(targets[i], top, top_len) == 0 && targets[i][top_len] == '/')) {
+            continue;
+        }
+        if (COUNTED(umount2(targets[i], MNT_DETACH)) != 0 && errno != EINVAL) {
+            ret = -1;
+        }
+        top = targets[i];
+    }
+    for (int i = 0; i < count; i++) {
+        free(targets[i]);
+    }
+    return ret;
+}
+#endif /* __linux__ */
+
+#ifdef __FreeBSD__
+static void build_iovec(struct iovec *iov, int *n, const char *name, const char *value) {
+    iov[*n].iov_base = (void *)name;
+    iov[*n].iov_len = strlen(name) + 1;
+    (*n)++;
+    iov[*n].iov_base = (void *)value;
+    iov[*n].iov_len = value ? strlen(value) + 1 : 0;
+    (*n)++;
+}
+
+int fsops_bind_mount(const char *source, const char *target, int writable) {
+    struct iovec iov[6];
+    int n = 0;
+
+    build_iovec(iov, &n, "fstype", "nullfs");
+    build_iovec(iov, &n, "fspath", target);
+    build_iovec(iov, &n, "target", source);
+    return COUNTED(nmount(iov, n, writable ? 0 : MNT_RDONLY));
+}
+
+int fsops_mount_fs(const char *fstype, const char *target, unsigned long flags, const char *data) {
+    struct iovec iov[4];
+    int n = 0;
+
+    (void)data;
+    build_iovec(iov, &n, "fstype", fstype);
+    build_iovec(iov, &n, "fspath", target);
+    return COUNTED(nmount(iov, n, (int)flags));
+}
+
+int fsops_unmount_tree(const char *root) {
+    struct statfs *mnts;
+    size_t len = strlen(root);
+
+    int count = COUNTED(getmntinfo(&mnts, MNT_NOWAIT));
+    if (count <= 0) {
+        return -1;
+    }
+
+    // Mounts are listed parent first, so unmount in reverse order
+    int ret = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        const char *dir = mnts[i].f_mntonname;
+        if (strncmp(dir, root, len) == 0 && (dir[len] == '/' || dir[len] == '\0')) {
+            if (COUNTED(unmount(dir, 0)) != 0 && COUNTED(unmount(dir, MNT_FORCE)) != 0) {
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+#endif /* __FreeBSD__ */
+
+const char *fsops_stage_method_name(enum stage_method method) {
+    switch (method) {
+        case STAGE_BIND: return "read-only bind mount";
+        case STAGE_WRITABLE_BIND: return "writable bind mount";
+        case STAGE_REFLINK: return "reflink";
+        case STAGE_HARDLINK: return "hardlink";
+        case STAGE_COPY: return "copy";
+        default: return "none";
+    }
+}
+
+static int try_bind_file(const char *source, int dirfd, const char *dir_path, const char *name,
+                         int executable, int writable) {
+    char target[PATH_MAX];
+
+#ifdef __linux__
+    // A noexec source mount would be inherited by the bind
+    struct statvfs sv;
+    if (executable && (COUNTED(statvfs(source, &sv)) != 0 || (sv.f_flag & ST_NOEXEC))) {
+        return -1;
+    }
+#else
+    (void)executable;
+#endif
+    if (snprintf(target, sizeof(target), "%s/%s", dir_path, name) >= (int)sizeof(target)) {
+        return -1;
+    }
+    if (fsops_create_file(dirfd, name, 0755) != 0) {
+        return -1;
+    }
+    if (fsops_bind_mount(source, target, writable) != 0) {
+        COUNTED(unlinkat(dirfd, name, 0));
+        return -1;
+    }
+    return 0;
+}
+
+static int try_reflink(const char *source, int dirfd, const char *name, mode_t mode) {
+#ifdef FICLONE
+    int in = COUNTED(open(source, O_RDONLY | O_CLOEXEC));
+    if (in < 0) {
+        return -1;
+    }
+    int out = COUNTED(openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode));
+    if (out < 0) {
+        COUNTED(close(in));
+        return -1;
+    }
+
+    int ret = COUNTED(ioctl(out, FICLONE, in));
+    if (ret == 0) {
+        ret = COUNTED(fchmod(out, mode));
+    }
+    COUNTED(close(in));
+    COUNTED(close(out));
+    if (ret != 0) {
+        COUNTED(unlinkat(dirfd, name, 0));
+    }
+    return ret;
+#else
+    (void)source; (void)dirfd; (void)name; (void)mode;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int fsops_stage_file(const char *source, int dirfd, const char *dir_path, const char *name,
+                     enum stage_method *method) {
+    struct stat src_st, dir_st;
+
+    *method = STAGE_NONE;
+    if (COUNTED(stat(source, &src_st)) != 0 || COUNTED(fstat(dirfd, &dir_st)) != 0) {
+        return -1;
+    }
+
+    // Sharing the inode only works if everyone may already execute it
+    int shareable = S_ISREG(src_st.st_mode) && (src_st.st_mode & 0555) == 0555;
+
+    if (shareable && try_bind_file(source, dirfd, dir_path, name, 1, 0) == 0) {
+        *method = STAGE_BIND;
+        return 0;
+    }
+    if (try_reflink(source, dirfd, name, 0755) == 0) {
+        *method = STAGE_REFLINK;
+        return 0;
+    }
+    if (shareable && src_st.st_dev == dir_st.st_dev &&
+        COUNTED(linkat(AT_FDCWD, source, dirfd, name, 0)) == 0) {
+        *method = STAGE_HARDLINK;
+        return 0;
+    }
+    if (fsops_copy_file(source, dirfd, name, 0755) == 0) {
+        *method = STAGE_COPY;
+        return 0;
+    }
+    return -1;
+}
+
+// Private copy of a rule file that cannot be bound: it keeps the source's
+// owner and permission bits, so the instance may read no more than before
+static int stage_private_copy(const char *source, int dirfd, const char *name,
+                              enum stage_method *method) {
+    struct stat st;
+
+    if (COUNTED(stat(source, &st)) != 0) {
+        return -1;
+    }
+    mode_t mode = st.st_mode & 0777;
+    if (try_reflink(source, dirfd, name, mode) == 0) {
+        *method = STAGE_REFLINK;
+    } else if (fsops_copy_file(source, dirfd, name, mode) == 0) {
+        *method = STAGE_COPY;
+    } else {
+        return -1;
+    }
+    if (COUNTED(fchownat(dirfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW)) != 0) {
+        int saved_errno = errno;
+        COUNTED(unlinkat(dirfd, name, 0));
+        *method = STAGE_NONE;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Stages an absolute source path at the same path under root_fd, so
+// per-file capability rules need no mount of the surrounding tree.
+// Writable files are only ever bound: a copy would lose the writes
+int fsops_stage_path(const char *source, int root_fd, const char *root_path, int writable,
+                     enum stage_method *method) {
+    char parent[PATH_MAX];
+    char dir_path[PATH_MAX];
+    struct stat st;
+
+    *method = STAGE_NONE;
+    if (source[0] != '/' || snprintf(parent, sizeof(parent), "%s", source + 1) >= (int)sizeof(parent)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Already present, through an earlier rule or a directory mount
+    if (COUNTED(fstatat(root_fd, parent, &st, AT_SYMLINK_NOFOLLOW)) == 0) {
+        return 0;
+    }
+
+    char *slash = strrchr(parent, '/');
+    const char *name = slash ? slash + 1 : parent;
+    int dirfd = root_fd;
+    if (slash) {
+        *slash = '\0';
+        if (fsops_mkdirs(root_fd, parent, 0755) != 0) {
+            return -1;
+        }
+        dirfd = COUNTED(openat(root_fd, parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dirfd < 0) {
+            return -1;
+        }
+    }
+    int len = snprintf(dir_path, sizeof(dir_path), "%s%s%s", root_path, slash ? "/" : "", slash ? parent : "");
+    if (len < 0 || (size_t)len >= sizeof(dir_path)) {
+        if (dirfd != root_fd) {
+            COUNTED(close(dirfd));
+        }
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // The bind keeps the source's own mode, so any regular file may share it
+    int ret = 0;
+    if (try_bind_file(source, dirfd, dir_path, name, 0, writable) == 0) {
+        *method = writable ? STAGE_WRITABLE_BIND : STAGE_BIND;
+    } else if (writable) {
+        ret = -1;
+    } else {
+        ret = stage_private_copy(source, dirfd, name, method);
+    }
+    if (dirfd != root_fd) {
+        int saved = errno;
+        COUNTED(close(dirfd));
+        errno = saved;
+    }
+    return ret;
+}
+
+static unsigned int name_hash(const char *name) {
+    unsigned int h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h;
+}
+
+// Removes the entries of dirfd whose name hashes into this worker's share;
+// the share is stable while other workers delete siblings concurrently
+static int remove_entries_share(int dirfd, dev_t dev, unsigned int worker, unsigned int workers) {
+    int ret = 0;
+
+    DIR *dir = fdopendir(dirfd);
+    if (!dir) {
+        COUNTED(close(dirfd));
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (workers > 1 && name_hash(name) % workers != worker) {
+            continue;
+        }
+
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+            if (COUNTED(unlinkat(dirfd, name, 0)) != 0) {
+                ret = -1;
+            }
+            continue;
+        }
+
+        struct stat st;
+        if (COUNTED(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) != 0) {
+            ret = -1;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            if (COUNTED(unlinkat(dirfd, name, 0)) != 0) {
+                ret = -1;
+            }
+            continue;
+        }
+
+        // Never descend into something that is still mounted from the host
+        if (st.st_dev != dev) {
+            ret = -1;
+            continue;
+        }
+
+        int sub = COUNTED(openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (sub < 0 || remove_entries_share(sub, dev, 0, 1) != 0) {
+            ret = -1;
+        }
+        if (COUNTED(unlinkat(dirfd, name, AT_REMOVEDIR)) != 0) {
+            ret = -1;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+// Removes dirfd/name without following a symlink at name
+static int remove_tree_at(int dirfd, const char *name) {
+    struct stat st;
+
+    if (COUNTED(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return COUNTED(unlinkat(dirfd, name, 0));
+    }
+
+    int fd = COUNTED(openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = remove_entries_share(fd, st.st_dev, 0, 1);
+    if (COUNTED(unlinkat(dirfd, name, AT_REMOVEDIR)) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int fsops_remove_tree(const char *path) {
+    return remove_tree_at(AT_FDCWD, path);
+}
+
+static void detach_reaper(int keep_fd) {
+    // Hold nothing the launcher's caller might wait on (pipes, sockets)
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    }
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (long fd = STDERR_FILENO + 1; fd < (max_fd > 0 && max_fd < 4096 ? max_fd : 4096); fd++) {
+        if (fd != keep_fd) {
+            close((int)fd);
+        }
+    }
+    setsid();
+    nice(10);
+}
+
+static void reap_tree(int graveyard_fd, const char *name, int workers) {
+    struct stat st;
+
+    if (fstatat(graveyard_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        unlinkat(graveyard_fd, name, 0);
+        return;
+    }
+
+    // Split the top level between workers, then sweep whatever is left
+    for (int i = 0; i < workers; i++) {
+        if (fork() == 0) {
+            int fd = openat(graveyard_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                remove_entries_share(fd, st.st_dev, i, workers);
+            }
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    remove_tree_at(graveyard_fd, name);
+}
+
+static void reap_graveyard(int graveyard_fd) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : (cpus > REAPER_MAX_WORKERS ? REAPER_MAX_WORKERS : (int)cpus);
+
+    // Also finishes trees left behind by a reaper that was interrupted
+    int fd = dup(graveyard_fd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        reap_tree(graveyard_fd, ent->d_name, workers);
+    }
+    closedir(dir);
+}
+
+// The graveyard lives in a shared directory such as /tmp, so only a real
+// directory that root owns and nobody else can enter is trusted with
+// deletions; everything after this works relative to the returned fd
+static int open_graveyard(const char *graveyard) {
+    struct stat st;
+
+    if (COUNTED(mkdir(graveyard, 0700)) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    int fd = COUNTED(open(graveyard, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        fprintf(stderr, "Warning: Cannot use %s: %s\n", graveyard, strerror(errno));
+        return -1;
+    }
+    if (COUNTED(fstat(fd, &st)) != 0 || st.st_uid != 0 || (st.st_mode & 07777) != 0700) {
+        fprintf(stderr, "Warning: Ignoring %s, which is not a private root-owned directory\n",
+                graveyard);
+        COUNTED(close(fd));
+        return -1;
+    }
+    return fd;
+}
+
+int fsops_reclaim_tree(const char *path) {
+    static unsigned int sequence;
+    char graveyard[PATH_MAX];
+    char doomed[NAME_MAX + 1];
+
+    // The graveyard is a sibling of path so the rename never crosses filesystems
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return fsops_remove_tree(path);
+    }
+    int parent_len = slash == path ? 1 : (int)(slash - path);
+    if (snprintf(graveyard, sizeof(graveyard), "%.*s/%s", parent_len, path,
+                 GRAVEYARD_NAME) >= (int)sizeof(graveyard) ||
+        snprintf(doomed, sizeof(doomed), "%.200s.%d.%u", slash + 1, (int)getpid(),
+                 sequence++) >= (int)sizeof(doomed)) {
+        return fsops_remove_tree(path);
+    }
+
+    int graveyard_fd = open_graveyard(graveyard);
+    if (graveyard_fd < 0) {
+        return fsops_remove_tree(path);
+    }
+    if (COUNTED(renameat(AT_FDCWD, path, graveyard_fd, doomed)) != 0) {
+        int ret = errno == ENOENT ? 0 : fsops_remove_tree(path);
+        COUNTED(close(graveyard_fd));
+        return ret;
+    }
+
+    // Double fork so the reaper is never our child to wait for
+    fflush(NULL);
+    pid_t pid = COUNTED(fork());
+    if (pid < 0) {
+        int ret = remove_tree_at(graveyard_fd, doomed);
+        COUNTED(close(graveyard_fd));
+        return ret;
+    }
+    if (pid == 0) {
+        if (fork() == 0) {
+            detach_reaper(graveyard_fd);
+            reap_graveyard(graveyard_fd);
+        }
+        _exit(0);
+    }
+    COUNTED(close(graveyard_fd));
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    return 0;
+}
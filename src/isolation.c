@@ -3,9 +3,23 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
+#include <limits.h>
 #include "common.h"
 
+pid_t fork_isolation_context(const struct capabilities *caps) {
+#ifdef __linux__
+    // Namespaces are created by the clone itself on Linux
+    return linux_fork_isolation(caps);
+#else
+    (void)caps;
+    return fork();
+#endif
+}
+
 int create_isolation_context(const struct capabilities *caps) {
 #ifdef __FreeBSD__
     return freebsd_create_isolation(caps);
@@ -24,3 +38,66 @@ void cleanup_isolation_context(void) {
     linux_cleanup_isolation();
 #endif
 }
+
+// Child side: hand the platform state cleanup needs to the parent
+int send_isolation_state(void) {
+#ifdef __FreeBSD__
+    const char *username = freebsd_get_username();
+    const char *jailpath = freebsd_get_jail_path();
+    int32_t jid = freebsd_get_jail_id();
+    unsigned char user[sizeof(uint32_t) + 64];
+    uint32_t uid = (uint32_t)freebsd_get_ephemeral_uid();
+    size_t name_len = strnlen(username, 64);
+
+    memcpy(user, &uid, sizeof(uid));
+    memcpy(user + sizeof(uid), username, name_len);
+    if (setup_send(SETUP_MSG_JAIL, &jid, sizeof(jid), NULL, 0) != 0 ||
+        setup_send(SETUP_MSG_USER, user, sizeof(uid) + name_len, NULL, 0) != 0 ||
+        setup_send(SETUP_MSG_ROOT, jailpath, strlen(jailpath), NULL, 0) != 0) {
+        return -1;
+    }
+    return 0;
+#elif defined(__linux__)
+    // Cleanup state stays with the parent; it gets the namespaces to hold
+    return linux_send_namespaces();
+#else
+    return 0;
+#endif
+}
+
+// Parent side: adopt the child's platform state for cleanup
+void receive_isolation_state(const struct setup_report *report) {
+#ifdef __FreeBSD__
+    freebsd_set_jail_id(report->jid);
+    freebsd_set_username(report->username);
+    freebsd_set_jail_path(report->root_path);
+    freebsd_set_ephemeral_uid(report->uid);
+#else
+    (void)report;
+#endif
+}
+
+// Parent side: take over whatever instance state the backend holds, so
+// one process can fork the next instance before this one has exited.
+// A backend holding no state leaves the record untouched
+void detach_isolation_state(struct isolation_state *state) {
+#ifdef __FreeBSD__
+    freebsd_detach_isolation(state);
+#elif defined(__linux__)
+    linux_detach_isolation(state);
+#else
+    (void)state;
+#endif
+}
+
+// Parent side: clean up an instance from its detached record
+void cleanup_isolation_state(const struct isolation_state *state) {
+#ifdef __FreeBSD__
+    freebsd_restore_isolation(state);
+#elif defined(__linux__)
+    linux_restore_isolation(state);
+#else
+    (void)state;
+#endif
+    cleanup_isolation_context();
+}
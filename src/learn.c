@@ -0,0 +1,966 @@
+/*
+ * Learn mode
+ *
+ * "isolate -L <binary> [args...]" runs the application unconfined for a
+ * bounded time under a seccomp filter that hands the system calls that
+ * name resources (opens, execs, directory changes, bind and connect) to
+ * isolate through a user notification listener. Each call is recorded
+ * and then let through unchanged; every other system call runs at full
+ * speed. The observed paths and ports become a capability file with
+ * exact rules instead of the heuristic guesses of -d.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "common.h"
+
+#ifdef __linux__
+#include <linux/audit.h>
+#if defined(__x86_64__)
+#define LEARN_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define LEARN_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+#endif
+
+#ifdef LEARN_AUDIT_ARCH
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#define LEARN_READ   0x01
+#define LEARN_WRITE  0x02
+#define LEARN_EXEC   0x04
+#define LEARN_CREATE 0x08       /* creates or removes entries in the parent */
+
+#define LEARN_BUCKETS 4096
+#define LEARN_COLLAPSE 16       /* files read in one directory before it is mounted whole */
+#define LEARN_GRACE 5           /* seconds between SIGTERM and SIGKILL */
+
+struct learn_path {
+    char *path;
+    unsigned access;
+    unsigned long count;
+    unsigned children;          /* read-only files observed directly below */
+    struct learn_path *next;
+};
+
+struct learn_socket {
+    char rule[PATH_MAX + 16];
+    int inbound;
+    struct learn_socket *next;
+};
+
+// What one notification names, gathered before the call is let through
+struct learn_event {
+    char path[2][PATH_MAX];
+    unsigned access[2];
+    int paths;
+    char socket[PATH_MAX + 16];
+    int inbound;
+};
+
+static struct learn_path *learn_paths[LEARN_BUCKETS];
+static struct learn_socket *learn_sockets;
+static int path_count, socket_count;
+static int task_count = 1;      /* the application, then one per clone */
+static unsigned long notifications;
+static volatile sig_atomic_t learn_interrupted;
+
+// System calls handed to the listener; everything else is allowed in-kernel
+static const int traced_syscalls[] = {
+#ifdef SYS_open
+    SYS_open,
+#endif
+#ifdef SYS_creat
+    SYS_creat,
+#endif
+    SYS_openat,
+#ifdef SYS_openat2
+    SYS_openat2,
+#endif
+    SYS_execve,
+#ifdef SYS_execveat
+    SYS_execveat,
+#endif
+#ifdef SYS_mkdir
+    SYS_mkdir,
+#endif
+#ifdef SYS_rmdir
+    SYS_rmdir,
+#endif
+#ifdef SYS_unlink
+    SYS_unlink,
+#endif
+#ifdef SYS_rename
+    SYS_rename,
+#endif
+    SYS_mkdirat,
+    SYS_unlinkat,
+#ifdef SYS_renameat
+    SYS_renameat,
+#endif
+#ifdef SYS_renameat2
+    SYS_renameat2,
+#endif
+    SYS_bind,
+    SYS_connect,
+    SYS_clone,
+#ifdef SYS_clone3
+    SYS_clone3,
+#endif
+#ifdef SYS_fork
+    SYS_fork,
+#endif
+#ifdef SYS_vfork
+    SYS_vfork,
+#endif
+};
+
+#define TRACED_COUNT ((int)(sizeof(traced_syscalls) / sizeof(traced_syscalls[0])))
+
+static unsigned hash_path(const char *path) {
+    unsigned h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct learn_path *find_path(const char *path, int create) {
+    unsigned bucket = hash_path(path) % LEARN_BUCKETS;
+
+    for (struct learn_path *entry = learn_paths[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    struct learn_path *entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return NULL;
+    }
+    entry->next = learn_paths[bucket];
+    learn_paths[bucket] = entry;
+    path_count++;
+    return entry;
+}
+
+static void record_path(const char *path, unsigned access) {
+    struct learn_path *entry = find_path(path, 1);
+    if (entry) {
+        entry->access |= access;
+        entry->count++;
+    }
+}
+
+static void record_socket(const char *rule, int inbound) {
+    for (struct learn_socket *sock = learn_sockets; sock; sock = sock->next) {
+        if (sock->inbound == inbound && strcmp(sock->rule, rule) == 0) {
+            return;
+        }
+    }
+    struct learn_socket *sock = calloc(1, sizeof(*sock));
+    if (sock) {
+        snprintf(sock->rule, sizeof(sock->rule), "%s", rule);
+        sock->inbound = inbound;
+        sock->next = learn_sockets;
+        learn_sockets = sock;
+        socket_count++;
+    }
+}
+
+// Every task but the application itself comes from one of these,
+// threads included, and pids.max counts them all
+static int is_spawn(int nr) {
+    switch (nr) {
+    case SYS_clone:
+#ifdef SYS_clone3
+    case SYS_clone3:
+#endif
+#ifdef SYS_fork
+    case SYS_fork:
+#endif
+#ifdef SYS_vfork
+    case SYS_vfork:
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+// Lexically joins and normalizes; symlinks are kept as the application named them
+static int join_path(const char *base, const char *path, char *out, size_t size) {
+    char joined[PATH_MAX * 2];
+    char *save = NULL;
+    size_t len = 0;
+
+    if (path[0] == '/' || !base) {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", base, path);
+    }
+
+    out[0] = '\0';
+    for (char *part = strtok_r(joined, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            while (len > 0 && out[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+            out[len] = '\0';
+            continue;
+        }
+        size_t part_len = strlen(part);
+        if (len + part_len + 2 > size) {
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, part, part_len + 1);
+        len += part_len;
+    }
+    if (len == 0) {
+        snprintf(out, size, "/");
+    }
+    return 0;
+}
+
+// Split at page boundaries so a read running into an unmapped page
+// still returns the mapped part
+static ssize_t read_remote(pid_t pid, uint64_t addr, void *buf, size_t size) {
+    struct iovec local = { buf, size };
+    struct iovec remote[3];
+    int n = 0;
+
+    while (size > 0 && n < 3) {
+        size_t chunk = 4096 - (addr & 4095);
+        if (chunk > size) {
+            chunk = size;
+        }
+        remote[n].iov_base = (void *)(uintptr_t)addr;
+        remote[n].iov_len = chunk;
+        addr += chunk;
+        size -= chunk;
+        n++;
+    }
+    return process_vm_readv(pid, &local, 1, remote, n, 0);
+}
+
+static int read_remote_string(pid_t pid, uint64_t addr, char *buf, size_t size) {
+    ssize_t n = read_remote(pid, addr, buf, size - 1);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return strlen(buf) < (size_t)n || (size_t)n < size - 1 ? 0 : -1;
+}
+
+// The directory a relative path is resolved against: the cwd or a dirfd
+static int task_dir(pid_t pid, int dirfd, char *out, size_t size) {
+    char link[64];
+
+    if (dirfd == AT_FDCWD) {
+        snprintf(link, sizeof(link), "/proc/%d/cwd", (int)pid);
+    } else {
+        snprintf(link, sizeof(link), "/proc/%d/fd/%d", (int)pid, dirfd);
+    }
+    ssize_t n = readlink(link, out, size - 1);
+    if (n < 0) {
+        return -1;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int gather_path(struct learn_event *ev, pid_t pid, int dirfd, uint64_t addr,
+                       unsigned access, int empty_path) {
+    char raw[PATH_MAX];
+    char base[PATH_MAX];
+
+    if (ev->paths == 2 || read_remote_string(pid, addr, raw, sizeof(raw)) != 0) {
+        return -1;
+    }
+    if (raw[0] == '\0') {
+        // AT_EMPTY_PATH names the descriptor itself
+        if (!empty_path || task_dir(pid, dirfd, raw, sizeof(raw)) != 0) {
+            return -1;
+        }
+    } else if (raw[0] != '/' && task_dir(pid, dirfd, base, sizeof(base)) != 0) {
+        return -1;
+    }
+    if (join_path(raw[0] == '/' ? NULL : base, raw, ev->path[ev->paths], PATH_MAX) != 0) {
+        return -1;
+    }
+    ev->access[ev->paths++] = access;
+    return 0;
+}
+
+static void gather_open(struct learn_event *ev, pid_t pid, int dirfd, uint64_t addr, int flags) {
+    struct stat st;
+
+    // O_PATH descriptors grant no access to the file itself
+    if ((flags & O_PATH) || gather_path(ev, pid, dirfd, addr, LEARN_READ, 0) != 0) {
+        return;
+    }
+    unsigned *access = &ev->access[ev->paths - 1];
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC) || (flags & O_TMPFILE) == O_TMPFILE) {
+        *access |= LEARN_WRITE;
+    }
+    // Checked now, while the call that may create it is still held
+    if ((flags & O_CREAT) && lstat(ev->path[ev->paths - 1], &st) != 0) {
+        *access |= LEARN_WRITE | LEARN_CREATE;
+    }
+}
+
+// Directory changes that are bound to fail (mkdir of an existing path,
+// unlink of a missing one) are probes and grant nothing
+static void gather_change(struct learn_event *ev, pid_t pid, int dirfd, uint64_t addr, int creates) {
+    struct stat st;
+
+    if (gather_path(ev, pid, dirfd, addr, LEARN_CREATE, 0) != 0 || creates < 0) {
+        return;
+    }
+    if ((lstat(ev->path[ev->paths - 1], &st) == 0) == creates) {
+        ev->paths--;
+    }
+}
+
+static int socket_type(pid_t pid, int fd) {
+    int type = SOCK_STREAM;
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+    socklen_t len = sizeof(type);
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        return type;
+    }
+    int local = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+    close(pidfd);
+    if (local >= 0) {
+        if (getsockopt(local, SOL_SOCKET, SO_TYPE, &type, &len) != 0) {
+            type = SOCK_STREAM;
+        }
+        close(local);
+    }
+#else
+    (void)pid;
+    (void)fd;
+#endif
+    return type;
+}
+
+static void gather_socket(struct learn_event *ev, pid_t pid, int fd, uint64_t addr,
+                          uint64_t addr_len, int inbound) {
+    struct sockaddr_storage ss;
+    char base[PATH_MAX];
+    char path[PATH_MAX];
+    int port = 0;
+
+    memset(&ss, 0, sizeof(ss));
+    if (addr_len > sizeof(ss)) {
+        addr_len = sizeof(ss);
+    }
+    if (addr_len < sizeof(sa_family_t) || read_remote(pid, addr, &ss, addr_len) != (ssize_t)addr_len) {
+        return;
+    }
+
+    if (ss.ss_family == AF_INET) {
+        port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+    } else if (ss.ss_family == AF_INET6) {
+        port = ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+    } else if (ss.ss_family == AF_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&ss;
+        // Unnamed and abstract sockets have no path to grant
+        if (addr_len <= offsetof(struct sockaddr_un, sun_path) || un->sun_path[0] == '\0') {
+            return;
+        }
+        un->sun_path[sizeof(un->sun_path) - 1] = '\0';
+        if (un->sun_path[0] != '/' && task_dir(pid, AT_FDCWD, base, sizeof(base)) != 0) {
+            return;
+        }
+        if (join_path(un->sun_path[0] == '/' ? NULL : base, un->sun_path, path, sizeof(path)) != 0) {
+            return;
+        }
+        snprintf(ev->socket, sizeof(ev->socket), "unix:%s", path);
+        ev->inbound = inbound;
+        // A bound socket is a new entry in its directory
+        if (inbound && ev->paths < 2) {
+            snprintf(ev->path[ev->paths], PATH_MAX, "%s", path);
+            ev->access[ev->paths++] = LEARN_CREATE;
+        }
+        return;
+    }
+
+    // Ephemeral binds pick no fixed port
+    if (port == 0) {
+        return;
+    }
+    snprintf(ev->socket, sizeof(ev->socket), "%s:%d:%s",
+             socket_type(pid, fd) == SOCK_DGRAM ? "udp" : "tcp", port,
+             inbound ? "inbound" : "outbound");
+    ev->inbound = inbound;
+}
+
+static void gather_event(struct learn_event *ev, const struct seccomp_data *data, pid_t pid) {
+    const __u64 *args = data->args;
+
+    switch (data->nr) {
+#ifdef SYS_open
+    case SYS_open:
+        gather_open(ev, pid, AT_FDCWD, args[0], (int)args[1]);
+        break;
+#endif
+#ifdef SYS_creat
+    case SYS_creat:
+        gather_open(ev, pid, AT_FDCWD, args[0], O_CREAT | O_WRONLY | O_TRUNC);
+        break;
+#endif
+    case SYS_openat:
+        gather_open(ev, pid, (int)args[0], args[1], (int)args[2]);
+        break;
+#ifdef SYS_openat2
+    case SYS_openat2: {
+        uint64_t how_flags;     /* first member of struct open_how */
+        if (read_remote(pid, args[2], &how_flags, sizeof(how_flags)) == sizeof(how_flags)) {
+            gather_open(ev, pid, (int)args[0], args[1], (int)how_flags);
+        }
+        break;
+    }
+#endif
+    case SYS_execve:
+        gather_path(ev, pid, AT_FDCWD, args[0], LEARN_READ | LEARN_EXEC, 0);
+        break;
+#ifdef SYS_execveat
+    case SYS_execveat:
+        gather_path(ev, pid, (int)args[0], args[1], LEARN_READ | LEARN_EXEC,
+                    ((int)args[4] & AT_EMPTY_PATH) != 0);
+        break;
+#endif
+#ifdef SYS_mkdir
+    case SYS_mkdir:
+        gather_change(ev, pid, AT_FDCWD, args[0], 1);
+        break;
+#endif
+#ifdef SYS_rmdir
+    case SYS_rmdir:
+#endif
+#ifdef SYS_unlink
+    case SYS_unlink:
+#endif
+#if defined(SYS_rmdir) || defined(SYS_unlink)
+        gather_change(ev, pid, AT_FDCWD, args[0], 0);
+        break;
+#endif
+#ifdef SYS_rename
+    case SYS_rename:
+        gather_change(ev, pid, AT_FDCWD, args[0], 0);
+        gather_change(ev, pid, AT_FDCWD, args[1], -1);
+        break;
+#endif
+    case SYS_mkdirat:
+        gather_change(ev, pid, (int)args[0], args[1], 1);
+        break;
+    case SYS_unlinkat:
+        gather_change(ev, pid, (int)args[0], args[1], 0);
+        break;
+#ifdef SYS_renameat
+    case SYS_renameat:
+#endif
+#ifdef SYS_renameat2
+    case SYS_renameat2:
+#endif
+#if defined(SYS_renameat) || defined(SYS_renameat2)
+        gather_change(ev, pid, (int)args[0], args[1], 0);
+        gather_change(ev, pid, (int)args[2], args[3], -1);
+        break;
+#endif
+    case SYS_bind:
+        gather_socket(ev, pid, (int)args[0], args[1], args[2], 1);
+        break;
+    case SYS_connect:
+        gather_socket(ev, pid, (int)args[0], args[1], args[2], 0);
+        break;
+    }
+}
+
+// Gathers what the call names, lets it continue, then records it
+static int handle_notification(int listener, struct seccomp_notif *req, struct seccomp_notif_resp *resp,
+                               size_t req_size, size_t resp_size) {
+    struct learn_event ev;
+
+    memset(req, 0, req_size);
+    if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, req) != 0) {
+        // The task died or was interrupted before we read the call
+        return errno == EINTR || errno == ENOENT ? 0 : -1;
+    }
+
+    ev.paths = 0;
+    ev.socket[0] = '\0';
+    gather_event(&ev, &req->data, req->pid);
+
+    // Anything read from a task that has since gone may be stale
+    int valid = ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == 0;
+
+    memset(resp, 0, resp_size);
+    resp->id = req->id;
+    resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    if (ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, resp) != 0 && errno != ENOENT) {
+        return -1;
+    }
+
+    notifications++;
+    if (valid) {
+        if (is_spawn(req->data.nr)) {
+            task_count++;
+        }
+        for (int i = 0; i < ev.paths; i++) {
+            record_path(ev.path[i], ev.access[i]);
+        }
+        if (ev.socket[0]) {
+            record_socket(ev.socket, ev.inbound);
+        }
+    }
+    return 0;
+}
+
+static void learn_child(int sock, const char *binary, char *const argv[]) {
+    struct sock_filter filter[TRACED_COUNT + 6];
+    int len = 0;
+
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+    filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LEARN_AUDIT_ARCH, 1, 0);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+    for (int i = 0; i < TRACED_COUNT; i++) {
+        filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, traced_syscalls[i],
+                                                     TRACED_COUNT - i, 0);
+    }
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF);
+
+    struct sock_fprog prog = { (unsigned short)len, filter };
+    int listener = -1;
+    int err = 0;
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+        (listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+                            SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog)) < 0) {
+        err = errno;
+    }
+    send_fds(sock, &listener, listener >= 0, &err, sizeof(err));
+    close(sock);
+    if (listener < 0) {
+        _exit(127);
+    }
+    close(listener);
+
+    execv(binary, argv);
+    fprintf(stderr, "Failed to execute %s: %s\n", binary, strerror(errno));
+    _exit(127);
+}
+
+static void learn_interrupt(int sig) {
+    (void)sig;
+    learn_interrupted = 1;
+}
+
+// Signals every descendant of pid; isolate is their subreaper, so
+// daemons that detached from the application are still found here
+static void signal_descendants(pid_t pid, int sig) {
+    char path[64];
+    struct dirent *de;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *tasks = opendir(path);
+    if (!tasks) {
+        return;
+    }
+    while ((de = readdir(tasks)) != NULL) {
+        char children[PATH_MAX];
+        int child;
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(children, sizeof(children), "/proc/%d/task/%s/children", (int)pid, de->d_name);
+        FILE *file = fopen(children, "r");
+        if (!file) {
+            continue;
+        }
+        while (fscanf(file, "%d", &child) == 1) {
+            kill(child, sig);
+            signal_descendants(child, sig);
+        }
+        fclose(file);
+    }
+    closedir(tasks);
+}
+
+// Services the listener until the application and everything it
+// started have exited, stopping them when the learning period ends
+static int trace_application(int listener, pid_t pid, int seconds, int *status) {
+    struct seccomp_notif_sizes sizes;
+    struct sigaction sa, old_int, old_term;
+    int stopping = 0;
+    int ret = 0;
+    pid_t reaped;
+    int reaped_status;
+
+    if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) != 0) {
+        return -1;
+    }
+    size_t req_size = sizes.seccomp_notif > sizeof(struct seccomp_notif) ?
+                      sizes.seccomp_notif : sizeof(struct seccomp_notif);
+    size_t resp_size = sizes.seccomp_notif_resp > sizeof(struct seccomp_notif_resp) ?
+                       sizes.seccomp_notif_resp : sizeof(struct seccomp_notif_resp);
+    struct seccomp_notif *req = calloc(1, req_size);
+    struct seccomp_notif_resp *resp = calloc(1, resp_size);
+
+    // Ctrl-C ends the session early and still writes the capability file
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = learn_interrupt;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    uint64_t deadline = seconds > 0 ? timing_now() + (uint64_t)seconds * 1000000000u : 0;
+    while (req && resp) {
+        struct pollfd pfd = { listener, POLLIN, 0 };
+
+        if ((deadline > 0 && timing_now() >= deadline) || (learn_interrupted && !stopping)) {
+            if (stopping) {
+                signal_descendants(getpid(), SIGKILL);
+                deadline = 0;
+            } else {
+                printf("\nStopping application after %s\n",
+                       learn_interrupted ? "interrupt" : "learning period");
+                fflush(stdout);
+                signal_descendants(getpid(), SIGTERM);
+                stopping = 1;
+                deadline = timing_now() + LEARN_GRACE * 1000000000ull;
+            }
+        }
+
+        // Exits are picked up at least every 100ms
+        int n = poll(&pfd, 1, 100);
+        if (n < 0 && errno != EINTR) {
+            ret = -1;
+            break;
+        }
+        if (n > 0 && (pfd.revents & POLLIN) &&
+            handle_notification(listener, req, resp, req_size, resp_size) != 0) {
+            fprintf(stderr, "Error: Cannot let traced calls continue: %s\n", strerror(errno));
+            signal_descendants(getpid(), SIGKILL);
+            ret = -1;
+            break;
+        }
+
+        // Done once the application and all its descendants are reaped
+        while ((reaped = waitpid(-1, &reaped_status, WNOHANG)) > 0) {
+            if (reaped == pid) {
+                *status = reaped_status;
+            }
+        }
+        if (reaped < 0 && errno == ECHILD) {
+            break;
+        }
+    }
+
+    // After an error, reap what was killed
+    while ((reaped = waitpid(-1, &reaped_status, 0)) > 0 || (reaped < 0 && errno == EINTR)) {
+        if (reaped == pid) {
+            *status = reaped_status;
+        }
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    free(req);
+    free(resp);
+    return ret;
+}
+
+static struct learn_path **snapshot_paths(int *count) {
+    struct learn_path **list = malloc((path_count ? path_count : 1) * sizeof(*list));
+    int n = 0;
+
+    for (int i = 0; list && i < LEARN_BUCKETS; i++) {
+        for (struct learn_path *entry = learn_paths[i]; entry; entry = entry->next) {
+            list[n++] = entry;
+        }
+    }
+    *count = n;
+    return list;
+}
+
+static int by_path(const void *a, const void *b) {
+    return strcmp((*(struct learn_path *const *)a)->path, (*(struct learn_path *const *)b)->path);
+}
+
+static int parent_of(const char *path, char *parent, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path) {
+        return -1;
+    }
+    snprintf(parent, size, "%.*s", (int)(slash - path), path);
+    return 0;
+}
+
+// The kernel maps interpreters itself, so they never show up as opens
+static void record_interpreter(const char *path) {
+    struct elf_info elf;
+    char line[PATH_MAX];
+
+    if (elf_open(path, &elf) == 0) {
+        if (elf.interp) {
+            record_path(elf.interp, LEARN_READ);
+        }
+        elf_close(&elf);
+        return;
+    }
+    FILE *file = fopen(path, "r");
+    if (file) {
+        if (fgets(line, sizeof(line), file) && strncmp(line, "#!", 2) == 0) {
+            char *interp = line + 2 + strspn(line + 2, " \t");
+            interp[strcspn(interp, " \t\n")] = '\0';
+            if (interp[0] == '/') {
+                record_path(interp, LEARN_READ | LEARN_EXEC);
+            }
+        }
+        fclose(file);
+    }
+}
+
+static int rule_access(unsigned access) {
+    return access & (LEARN_READ | LEARN_WRITE | LEARN_EXEC);
+}
+
+// A directory rule with at least the same access already grants the path
+static int covered(const char *path, unsigned access) {
+    char parent[PATH_MAX];
+
+    snprintf(parent, sizeof(parent), "%s", path);
+    for (char *slash = strrchr(parent, '/'); slash && slash != parent; slash = strrchr(parent, '/')) {
+        *slash = '\0';
+        struct learn_path *entry = find_path(parent, 0);
+        if (entry && rule_access(entry->access) &&
+            (rule_access(entry->access) & rule_access(access)) == rule_access(access)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int skipped_path(const char *path, const char *binary) {
+    // The launcher stages the binary and provides /dev and /proc itself
+    return strcmp(path, "/") == 0 || strcmp(path, binary) == 0 ||
+           strncmp(path, "/proc/", 6) == 0 || strcmp(path, "/proc") == 0 ||
+           strncmp(path, "/dev/", 5) == 0 || strcmp(path, "/dev") == 0;
+}
+
+static void learned_capabilities(const char *binary, struct detection_result *result) {
+    char parent[PATH_MAX];
+    char capability[PATH_MAX + 32];
+    char description[256];
+    struct stat st;
+    int count;
+
+    // Interpreters of everything executed, and the directories entries
+    // were created or removed in, become paths of their own
+    struct learn_path **list = snapshot_paths(&count);
+    for (int i = 0; list && i < count; i++) {
+        if (list[i]->access & LEARN_EXEC) {
+            record_interpreter(list[i]->path);
+        }
+        if ((list[i]->access & LEARN_CREATE) && parent_of(list[i]->path, parent, sizeof(parent)) == 0) {
+            record_path(parent, LEARN_READ | LEARN_WRITE);
+        }
+    }
+    free(list);
+
+    // Directories with many files read from them are mounted whole
+    list = snapshot_paths(&count);
+    for (int i = 0; list && i < count; i++) {
+        if (rule_access(list[i]->access) == LEARN_READ && lstat(list[i]->path, &st) == 0 &&
+            S_ISREG(st.st_mode) && parent_of(list[i]->path, parent, sizeof(parent)) == 0) {
+            struct learn_path *dir = find_path(parent, 1);
+            if (dir && ++dir->children == LEARN_COLLAPSE) {
+                dir->access |= LEARN_READ;
+            }
+        }
+    }
+    free(list);
+
+    list = snapshot_paths(&count);
+    if (list) {
+        qsort(list, count, sizeof(*list), by_path);
+    }
+    for (int i = 0; list && i < count; i++) {
+        struct learn_path *entry = list[i];
+        int access = rule_access(entry->access);
+
+        // Probes for files that do not exist, and files since removed, need no rule
+        if (!access || skipped_path(entry->path, binary) || covered(entry->path, access) ||
+            stat(entry->path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            continue;
+        }
+
+        snprintf(capability, sizeof(capability), "filesystem: %s:%s%s%s", entry->path,
+                 access & LEARN_READ ? "r" : "", access & LEARN_WRITE ? "w" : "",
+                 access & LEARN_EXEC ? "x" : "");
+        if (entry->children >= LEARN_COLLAPSE) {
+            snprintf(description, sizeof(description), "Directory with %u files read by the application",
+                     entry->children);
+        } else if (access & LEARN_EXEC) {
+            snprintf(description, sizeof(description), "Executed by the application");
+        } else if (access & LEARN_WRITE) {
+            snprintf(description, sizeof(description), "%s by the application",
+                     S_ISDIR(st.st_mode) ? "Directory modified" : "Written");
+        } else {
+            snprintf(description, sizeof(description), "%s by the application (%lu opens)",
+                     S_ISDIR(st.st_mode) ? "Listed" : "Read", entry->count);
+        }
+        add_capability_hint(result, 95, description, capability);
+    }
+    free(list);
+
+    for (struct learn_socket *sock = learn_sockets; sock; sock = sock->next) {
+        // Like missing files, sockets nobody listens on need no rule
+        if (!sock->inbound && strncmp(sock->rule, "unix:", 5) == 0 && stat(sock->rule + 5, &st) != 0) {
+            continue;
+        }
+        snprintf(capability, sizeof(capability), "network: %s", sock->rule);
+        add_capability_hint(result, 95, sock->inbound ? "Bound by the application" :
+                            "Connected to by the application", capability);
+    }
+
+    // Tasks ever started, so never below the most that ran at once
+    if (task_count > 5) {
+        snprintf(capability, sizeof(capability), "processes: %d", task_count);
+        add_capability_hint(result, 90, "Processes and threads started", capability);
+    }
+}
+
+int learn_capabilities(const char *binary, char *const argv[], const char *output_file, int seconds) {
+    char default_output[PATH_MAX];
+    char cwd[PATH_MAX];
+    char target[PATH_MAX];
+    int sv[2];
+    int listener = -1;
+    int err = 0;
+    int status = 0;
+
+    if (!output_file) {
+        snprintf(default_output, sizeof(default_output), "%s.caps", binary);
+        output_file = default_output;
+    }
+    if (!getcwd(cwd, sizeof(cwd)) || join_path(cwd, binary, target, sizeof(target)) != 0) {
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        fprintf(stderr, "Error: Cannot create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+    // Descendants that detach from the application are reparented to us
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: Cannot fork: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        learn_child(sv[1], binary, argv);
+    }
+    close(sv[1]);
+
+    if (recv_fds(sv[0], &listener, 1, &err, sizeof(err)) != 1) {
+        close(sv[0]);
+        waitpid(pid, &status, 0);
+        fprintf(stderr, "Error: seccomp user notification unavailable: %s\n",
+                strerror(err ? err : EIO));
+        fprintf(stderr, "Learn mode needs Linux 5.5 or later\n");
+        return -1;
+    }
+    close(sv[0]);
+
+    if (seconds > 0) {
+        printf("Learning %s for up to %d seconds (Ctrl-C to stop early)...\n\n", binary, seconds);
+    } else {
+        printf("Learning %s until it exits (Ctrl-C to stop early)...\n\n", binary);
+    }
+    fflush(stdout);
+    uint64_t start = timing_now();
+    int ret = trace_application(listener, pid, seconds, &status);
+    close(listener);
+    double elapsed = (timing_now() - start) / 1e9;
+
+    printf("\nLearning Summary:\n");
+    printf("=================\n");
+    printf("Traced calls: %lu in %.1fs (%d tasks started)\n", notifications, elapsed, task_count);
+    printf("Paths observed: %d\n", path_count);
+    printf("Sockets observed: %d\n", socket_count);
+    if (WIFEXITED(status)) {
+        printf("Application exited with status %d\n", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        printf("Application terminated by signal %d\n", WTERMSIG(status));
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    struct detection_result result;
+    memset(&result, 0, sizeof(result));
+    learned_capabilities(target, &result);
+    ret = generate_capability_file(binary, output_file, &result);
+    printf("%d capabilities learned\n", result.hint_count);
+    free_detection_result(&result);
+    if (ret == 0) {
+        printf("\nGenerated capability file: %s\n", output_file);
+        printf("Run a representative workload in learn mode so every path is covered.\n");
+    }
+    return ret;
+}
+
+#else
+
+int learn_capabilities(const char *binary, char *const argv[], const char *output_file, int seconds) {
+    (void)binary;
+    (void)argv;
+    (void)output_file;
+    (void)seconds;
+    fprintf(stderr, "Error: Learn mode needs seccomp user notification (Linux on x86_64 or arm64)\n");
+    return -1;
+}
+
+#endif /* LEARN_AUDIT_ARCH */
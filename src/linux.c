@@ -0,0 +1,594 @@
+/*
+ * Linux-specific isolation implementation
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>  // For struct clone_args and CLONE_NEW* flags
+#include <errno.h>
+#include <fcntl.h>
+#include "common.h"
+
+#define NAMESPACE_FLAGS (CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWIPC | \
+                         CLONE_NEWUTS | CLONE_NEWUSER)
+
+static char instance_name[64];
+static char ephemeral_username[64];
+static char root_path[PATH_MAX];
+static char template_path[PATH_MAX];
+static uid_t target_uid;
+static gid_t target_gid;
+static int sync_pipe[2] = { -1, -1 };
+static int template_mounted;
+static int uid_allocated;
+
+// Host path of an absolute path inside the instance root
+static int root_host_path(char *path, size_t size, const char *inner) {
+    int len = snprintf(path, size, "%s%s", root_path, inner);
+    if (len < 0 || (size_t)len >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int resolve_target_user(const struct capabilities *caps) {
+    if (caps->create_user && strcmp(caps->username, "auto") == 0) {
+        // No host account is needed: the namespace only sees a synthesized passwd,
+        // and the host UID is mapped 1:1 into it
+        if (uid_range_acquire(getpid(), &target_uid) != 0) {
+            fprintf(stderr, "Failed to allocate ephemeral UID: %s\n", strerror(errno));
+            return -1;
+        }
+        uid_allocated = 1;
+        target_gid = target_uid;
+        snprintf(ephemeral_username, sizeof(ephemeral_username), "app-%d", target_uid);
+        printf("Using ephemeral user %s (UID %d, GID %d)\n",
+               ephemeral_username, target_uid, target_gid);
+        return 0;
+    }
+
+    struct passwd *pw = getpwnam(caps->username);
+    if (pw == NULL) {
+        fprintf(stderr, "User %s not found\n", caps->username);
+        return -1;
+    }
+    snprintf(ephemeral_username, sizeof(ephemeral_username), "%s", caps->username);
+    target_uid = pw->pw_uid;
+    target_gid = pw->pw_gid;
+    printf("Using existing user %s (UID %d, GID %d)\n",
+           ephemeral_username, target_uid, target_gid);
+    return 0;
+}
+
+static int write_proc_file(pid_t pid, const char *name, const char *content) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = (ssize_t)strlen(content);
+    ssize_t written = write(fd, content, len);
+    close(fd);
+    return written == len ? 0 : -1;
+}
+
+static int write_id_maps(pid_t pid) {
+    char map[128];
+
+    // Root stays root for filesystem setup; the app runs as the target ID
+    if (target_uid == 0) {
+        snprintf(map, sizeof(map), "0 0 1\n");
+    } else {
+        snprintf(map, sizeof(map), "0 0 1\n%u %u 1\n", target_uid, target_uid);
+    }
+    if (write_proc_file(pid, "uid_map", map) != 0) {
+        fprintf(stderr, "Failed to write uid_map: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (target_gid == 0) {
+        snprintf(map, sizeof(map), "0 0 1\n");
+    } else {
+        snprintf(map, sizeof(map), "0 0 1\n%u %u 1\n", target_gid, target_gid);
+    }
+    if (write_proc_file(pid, "gid_map", map) != 0) {
+        fprintf(stderr, "Failed to write gid_map: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static pid_t clone_namespaces(int cgroup_fd, int *in_cgroup) {
+    struct clone_args args;
+    pid_t pid;
+
+    memset(&args, 0, sizeof(args));
+    args.flags = NAMESPACE_FLAGS;
+    args.exit_signal = SIGCHLD;
+
+    // Start the child inside its cgroup so no fork can escape the limits
+    if (cgroup_fd >= 0) {
+        args.flags |= CLONE_INTO_CGROUP;
+        args.cgroup = (__u64)cgroup_fd;
+        pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            *in_cgroup = 1;
+            return pid;
+        }
+        args.flags &= ~(__u64)CLONE_INTO_CGROUP;
+        args.cgroup = 0;
+    }
+
+    *in_cgroup = 0;
+    pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (pid < 0 && errno == ENOSYS) {
+        // Pre-5.3 kernels: plain clone with the same flags behaves like fork
+        pid = (pid_t)syscall(SYS_clone, NAMESPACE_FLAGS | SIGCHLD, NULL, NULL, NULL, NULL);
+    }
+    return pid;
+}
+
+pid_t linux_fork_isolation(const struct capabilities *caps) {
+    static unsigned int forks;
+
+    // Child is PID 1 in its namespace, so all naming happens here in the parent.
+    // A supervisor forks many instances, so later ones get a sequence number
+    if (forks++ == 0) {
+        snprintf(instance_name, sizeof(instance_name), "isolate-%d", getpid());
+    } else {
+        snprintf(instance_name, sizeof(instance_name), "isolate-%d-%u", getpid(), forks);
+    }
+    snprintf(root_path, sizeof(root_path), "/tmp/%s", instance_name);
+
+    if (resolve_target_user(caps) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Mount point for the instance tmpfs; its contents never touch the host disk.
+    // /tmp is world-writable and cleanup reclaims this path as root, so only
+    // a root-owned directory left by an earlier instance may be reused
+    if (mkdir(root_path, 0755) != 0) {
+        struct stat st;
+        if (errno != EEXIST || lstat(root_path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+            fprintf(stderr, "Failed to create root directory %s: %s\n", root_path,
+                    errno == EEXIST ? "exists and is not ours" : strerror(errno));
+            root_path[0] = '\0';
+            return -1;
+        }
+    }
+
+    // Shared skeleton for every instance with the same capabilities
+    template_prepare(caps, template_path, sizeof(template_path));
+
+    // Limits are best effort, like rctl on FreeBSD
+    cgroup_create_instance(instance_name, &caps->limits);
+
+    if (pipe2(sync_pipe, O_CLOEXEC) != 0) {
+        linux_cleanup_isolation();
+        return -1;
+    }
+
+    fflush(NULL);
+    int in_cgroup = 0;
+    pid_t pid = clone_namespaces(cgroup_instance_fd(), &in_cgroup);
+    if (pid < 0) {
+        int saved_errno = errno;
+        fprintf(stderr, "Failed to create namespaces: %s\n", strerror(saved_errno));
+        close(sync_pipe[0]);
+        close(sync_pipe[1]);
+        linux_cleanup_isolation();
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(sync_pipe[1]);
+        sync_pipe[1] = -1;
+        return 0;
+    }
+
+    // Release the child only once its user namespace has ID mappings
+    close(sync_pipe[0]);
+    sync_pipe[0] = -1;
+    if (!in_cgroup && cgroup_instance_fd() >= 0 && cgroup_attach_instance(pid) != 0) {
+        fprintf(stderr, "Warning: Failed to attach to cgroup: %s\n", strerror(errno));
+    }
+    if (write_id_maps(pid) == 0) {
+        char go = 1;
+        write(sync_pipe[1], &go, 1);
+    }
+    close(sync_pipe[1]);
+    sync_pipe[1] = -1;
+
+    return pid;
+}
+
+static int setup_devices(int root_fd) {
+    static const char *devices[] = {
+        "null", "zero", "full", "random", "urandom", "tty", NULL
+    };
+    char path[PATH_MAX];
+    char source[64];
+
+    // Device nodes cannot be created in a user namespace, so bind the host's
+    for (int i = 0; devices[i]; i++) {
+        snprintf(path, sizeof(path), "dev/%s", devices[i]);
+        if (fsops_create_file(root_fd, path, 0666) != 0) {
+            return -1;
+        }
+
+        snprintf(source, sizeof(source), "/dev/%s", devices[i]);
+        if (root_host_path(path, sizeof(path), source) != 0 || fsops_bind_mount(source, path, 1) != 0) {
+            fprintf(stderr, "Warning: Failed to bind %s: %s\n", source, strerror(errno));
+        }
+    }
+
+    symlinkat("/proc/self/fd", root_fd, "dev/fd");
+    symlinkat("/proc/self/fd/0", root_fd, "dev/stdin");
+    symlinkat("/proc/self/fd/1", root_fd, "dev/stdout");
+    symlinkat("/proc/self/fd/2", root_fd, "dev/stderr");
+
+    return 0;
+}
+
+static int write_identity_files(const char *username) {
+    char path[PATH_MAX];
+
+    // Create minimal passwd file (only root and the isolated user)
+    FILE *passwd_file = root_host_path(path, sizeof(path), "/etc/passwd") == 0 ? fopen(path, "w") : NULL;
+    if (passwd_file) {
+        fprintf(passwd_file,
+                "root:x:0:0:root:/root:/usr/sbin/nologin\n"
+                "%s:x:%u:%u:Isolated Application:/tmp:/usr/sbin/nologin\n",
+                username, target_uid, target_gid);
+        fclose(passwd_file);
+        printf("Created minimal passwd file (uid=%u, gid=%u)\n", target_uid, target_gid);
+    } else {
+        fprintf(stderr, "Warning: Failed to create passwd file\n");
+    }
+
+    FILE *group_file = root_host_path(path, sizeof(path), "/etc/group") == 0 ? fopen(path, "w") : NULL;
+    if (group_file) {
+        fprintf(group_file,
+                "root:x:0:\n"
+                "%s:x:%u:\n",
+                username, target_gid);
+        fclose(group_file);
+        printf("Created minimal group file\n");
+    } else {
+        fprintf(stderr, "Warning: Failed to create group file\n");
+    }
+
+    return 0;
+}
+
+static int populate_root(int root_fd, const struct capabilities *caps, const char *target_binary) {
+    char path[PATH_MAX];
+
+    // Without a template layer, lay down the skeleton directly
+    if (!template_mounted && template_populate(root_fd, caps) != 0) {
+        fprintf(stderr, "Failed to create root skeleton: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Mount workspace directory if specified
+    if (caps->workspace_path) {
+        printf("Setting up workspace: %s -> /workspace\n", caps->workspace_path);
+        if (root_host_path(path, sizeof(path), "/workspace") != 0 ||
+            fsops_bind_mount(caps->workspace_path, path, 1) != 0) {
+            fprintf(stderr, "Failed to mount workspace directory %s: %s\n",
+                    caps->workspace_path, strerror(errno));
+            return -1;
+        }
+        printf("Workspace mounted successfully\n");
+    }
+
+    // Stage target binary without copying it when the filesystem allows
+    const char *binary_name = strrchr(target_binary, '/');
+    binary_name = binary_name ? binary_name + 1 : target_binary;
+    enum stage_method method;
+    if (fsops_stage_file(target_binary, root_fd, root_path, binary_name, &method) != 0) {
+        fprintf(stderr, "Failed to stage binary: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("Staged %s via %s\n", binary_name, fsops_stage_method_name(method));
+
+    write_identity_files(ephemeral_username);
+
+    if (setup_devices(root_fd) != 0) {
+        fprintf(stderr, "Warning: Failed to populate /dev\n");
+    }
+
+    printf("Processing capability filesystem rules...\n");
+    for (int i = 0; i < caps->file_count; i++) {
+        const struct file_rule *rule = &caps->files[i];
+
+        // Mount directories and stage files at the same path; w makes either writable
+        if (rule->permissions & (R_OK | W_OK | X_OK)) {
+            struct stat st;
+            if (stat(rule->path, &st) != 0) {
+                continue;
+            }
+            int writable = (rule->permissions & W_OK) != 0;
+            if (S_ISREG(st.st_mode)) {
+                enum stage_method file_method;
+                if (fsops_stage_path(rule->path, root_fd, root_path, writable, &file_method) != 0) {
+                    fprintf(stderr, "Warning: Failed to stage %s: %s\n", rule->path, strerror(errno));
+                } else if (file_method != STAGE_NONE) {
+                    printf("Staged %s via %s\n", rule->path, fsops_stage_method_name(file_method));
+                }
+            } else if (S_ISDIR(st.st_mode)) {
+                char mount_point[PATH_MAX];
+                if (root_host_path(mount_point, sizeof(mount_point), rule->path) != 0) {
+                    fprintf(stderr, "Warning: Failed to mount %s: %s\n", rule->path, strerror(errno));
+                    continue;
+                }
+                fsops_mkdirs(root_fd, rule->path + 1, 0755);
+
+                printf("Mounting %s -> %s (%s)\n", rule->path, mount_point, writable ? "rw" : "ro");
+                if (fsops_bind_mount(rule->path, mount_point, writable) != 0) {
+                    fprintf(stderr, "Warning: Failed to mount %s: %s\n", rule->path, strerror(errno));
+                }
+            }
+        }
+    }
+
+    // Fresh procfs for the new PID namespace
+    if (root_host_path(path, sizeof(path), "/proc") != 0 ||
+        fsops_mount_fs("proc", path, MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0) {
+        fprintf(stderr, "Warning: Failed to mount /proc: %s\n", strerror(errno));
+    }
+
+    return 0;
+}
+
+static int setup_filesystem_isolation(const struct capabilities *caps, const char *target_binary) {
+    setup_phase(SETUP_PHASE_ROOTFS);
+    printf("Setting up filesystem isolation in %s\n", root_path);
+
+    // Keep every mount below private to this namespace
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        fprintf(stderr, "Failed to make mounts private: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (fsops_mount_fs("tmpfs", root_path, MS_NOSUID, "mode=0755") != 0) {
+        fprintf(stderr, "Failed to mount root tmpfs: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (template_path[0] != '\0') {
+        if (template_mount(template_path, root_path) == 0) {
+            template_mounted = 1;
+        } else {
+            fprintf(stderr, "Warning: Failed to layer template %s: %s\n", template_path, strerror(errno));
+        }
+    }
+
+    int root_fd = fsops_open_dir(root_path);
+    if (root_fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", root_path, strerror(errno));
+        return -1;
+    }
+    setup_phase(SETUP_PHASE_FILESYSTEM);
+    int ret = populate_root(root_fd, caps, target_binary);
+    close(root_fd);
+    if (ret != 0) {
+        return ret;
+    }
+
+    printf("Instance filesystem setup complete (%lu syscalls, no helper processes)\n",
+           fsops_syscall_count());
+    return 0;
+}
+
+static int enter_root(void) {
+    char old_root[PATH_MAX];
+
+    if (root_host_path(old_root, sizeof(old_root), "/.oldroot") != 0 || mkdir(old_root, 0700) != 0) {
+        return -1;
+    }
+    if (syscall(SYS_pivot_root, root_path, old_root) != 0) {
+        fprintf(stderr, "Failed to pivot root: %s\n", strerror(errno));
+        return -1;
+    }
+    if (chdir("/") != 0) {
+        return -1;
+    }
+    if (umount2("/.oldroot", MNT_DETACH) != 0) {
+        fprintf(stderr, "Failed to detach old root: %s\n", strerror(errno));
+        return -1;
+    }
+    rmdir("/.oldroot");
+    return 0;
+}
+
+static int setup_resource_limits(const struct resource_limits *limits) {
+    // Memory, process and CPU limits are enforced by the instance cgroup
+    if (limits->max_files > 0) {
+        struct rlimit rl;
+        printf("Setting file descriptor limit: %d\n", limits->max_files);
+        rl.rlim_cur = rl.rlim_max = (rlim_t)limits->max_files;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            fprintf(stderr, "Warning: Failed to set file limit: %s\n", strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+static int switch_to_user(const struct capabilities *caps) {
+    printf("Switching to user %s (UID %d, GID %d)\n",
+           ephemeral_username, target_uid, target_gid);
+
+    if (setgroups(0, NULL) != 0) {
+        fprintf(stderr, "Failed to clear supplementary groups: %s\n", strerror(errno));
+        return -1;
+    }
+    if (setresgid(target_gid, target_gid, target_gid) != 0) {
+        fprintf(stderr, "Failed to set GID %d: %s\n", target_gid, strerror(errno));
+        return -1;
+    }
+    if (setresuid(target_uid, target_uid, target_uid) != 0) {
+        fprintf(stderr, "Failed to set UID %d: %s\n", target_uid, strerror(errno));
+        return -1;
+    }
+
+    if (caps->env_clear) {
+        clearenv();
+    }
+    setenv("USER", ephemeral_username, 1);
+    setenv("HOME", "/tmp", 1);
+    for (int i = 0; i < caps->env_count; i++) {
+        setenv(caps->env_vars[i].name, caps->env_vars[i].value, 1);
+    }
+
+    return 0;
+}
+
+void linux_cleanup_isolation(void) {
+    cgroup_cleanup_instance();
+
+    // Mounts live in the instance's namespace and vanish with it
+    if (strlen(root_path) > 0) {
+        printf("Cleaning up instance root: %s\n", root_path);
+        if (rmdir(root_path) != 0 && errno == ENOTEMPTY) {
+            fsops_reclaim_tree(root_path);
+        }
+        root_path[0] = '\0';
+    }
+
+    if (uid_allocated) {
+        uid_range_release(target_uid);
+        uid_allocated = 0;
+    }
+}
+
+// Let the parent hold the instance's namespaces, e.g. to attach to them later
+int linux_send_namespaces(void) {
+    static const struct {
+        const char *name;
+        uint32_t type;
+    } namespaces[] = {
+        { "user", CLONE_NEWUSER }, { "mnt", CLONE_NEWNS }, { "pid", CLONE_NEWPID },
+        { "ipc", CLONE_NEWIPC }, { "uts", CLONE_NEWUTS }
+    };
+    int fds[SETUP_MAX_NAMESPACES];
+    uint32_t types[SETUP_MAX_NAMESPACES];
+    char path[32];
+    int count = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < sizeof(namespaces) / sizeof(namespaces[0]); i++) {
+        snprintf(path, sizeof(path), "/proc/self/ns/%s", namespaces[i].name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            fds[count] = fd;
+            types[count++] = namespaces[i].type;
+        }
+    }
+    if (count > 0) {
+        ret = setup_send(SETUP_MSG_NAMESPACES, types, count * sizeof(types[0]), fds, count);
+    }
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+    return ret;
+}
+
+void linux_detach_isolation(struct isolation_state *state) {
+    if (root_path[0] == '\0') {
+        return;
+    }
+
+    memcpy(state->name, instance_name, sizeof(state->name));
+    state->uid = uid_allocated ? target_uid : (uid_t)-1;
+    state->jid = -1;
+
+    cgroup_detach_instance();
+    root_path[0] = '\0';
+    uid_allocated = 0;
+}
+
+void linux_restore_isolation(const struct isolation_state *state) {
+    if (state->name[0] == '\0') {
+        return;
+    }
+
+    memcpy(instance_name, state->name, sizeof(instance_name));
+    snprintf(root_path, sizeof(root_path), "/tmp/%s", instance_name);
+    if (state->uid != (uid_t)-1) {
+        target_uid = state->uid;
+        uid_allocated = 1;
+    }
+    cgroup_open_instance(instance_name);
+}
+
+int linux_create_isolation(const struct capabilities *caps) {
+    const char *target_binary = getenv("ISOLATE_TARGET_BINARY");
+    char go = 0;
+
+    if (!target_binary) {
+        fprintf(stderr, "Target binary not specified\n");
+        return -1;
+    }
+
+    // Wait for the parent to install our UID/GID mappings
+    if (read(sync_pipe[0], &go, 1) != 1 || go != 1) {
+        fprintf(stderr, "Parent failed to configure user namespace\n");
+        return EPERM;
+    }
+    close(sync_pipe[0]);
+    sync_pipe[0] = -1;
+
+    printf("Creating Linux isolation context...\n");
+
+    if (setup_filesystem_isolation(caps, target_binary) != 0) {
+        return EIO;
+    }
+
+    setup_phase(SETUP_PHASE_ATTACH);
+    if (sethostname(instance_name, strlen(instance_name)) != 0) {
+        fprintf(stderr, "Warning: Failed to set hostname: %s\n", strerror(errno));
+    }
+
+    if (enter_root() != 0) {
+        return EIO;
+    }
+
+    setup_phase(SETUP_PHASE_LIMITS);
+    if (setup_resource_limits(&caps->limits) != 0) {
+        return EIO;
+    }
+
+    setup_phase(SETUP_PHASE_CREDENTIALS);
+    if (switch_to_user(caps) != 0) {
+        return EPERM;
+    }
+
+    printf("Linux isolation context created successfully\n");
+    printf("Running in %s as user %s\n", instance_name, ephemeral_username);
+
+    return 0;
+}
+
+#endif /* __linux__ */
@@ -8,23 +8,51 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include "common.h"
 
+#define LEARN_DEFAULT_SECONDS 60
+
+static const struct option long_options[] = {
+    {"learn", no_argument, NULL, 'L'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
 static void usage(const char *prog) {
     fprintf(stderr, "Usage: %s [options] <binary> [args...]\n", prog);
     fprintf(stderr, "       %s -d <binary> [output.caps]  # Detect capabilities\n", prog);
+    fprintf(stderr, "       %s -d [-j N] <dir|@list>       # Detect for many binaries\n", prog);
+    fprintf(stderr, "       %s -L [-t secs] <binary> [args...] # Learn capabilities\n", prog);
+    fprintf(stderr, "       %s -m <manifest> [-j N] [-S]   # Launch a fleet of instances\n", prog);
+    fprintf(stderr, "       %s -C <file.caps>              # Compile to file.capsb\n", prog);
     fprintf(stderr, "\n");
     fprintf(stderr, "Execution Options:\n");
     fprintf(stderr, "  -c <file>    Capability file (default: <binary>.caps)\n");
     fprintf(stderr, "  -w <dir>     Workspace directory (mounted as /workspace in jail)\n");
     fprintf(stderr, "  -v           Verbose output\n");
     fprintf(stderr, "  -n           No isolation (dry run)\n");
+    fprintf(stderr, "  -P <count>   Serve a warm pool of <count> prepared contexts\n");
+    fprintf(stderr, "  -W           Claim a context from the binary's warm pool\n");
+    fprintf(stderr, "  -F <list>    Signals forwarded to the instance, or \"none\"\n");
+    fprintf(stderr, "               (default: HUP,INT,QUIT,TERM,USR1,USR2)\n");
+    fprintf(stderr, "  -g <secs>    Kill the instance this long after a stop signal (default: %d, 0: never)\n",
+            FORWARD_DEFAULT_GRACE);
+    fprintf(stderr, "  -T <format>  Report launch phase timings on stderr: table or json\n");
+    fprintf(stderr, "  -m <file>    Launch every instance listed in a manifest\n");
+    fprintf(stderr, "  -S           With -m, supervise all instances from one process\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Detection Options:\n");
     fprintf(stderr, "  -d           Detect and generate capability file\n");
-    fprintf(stderr, "  -o <file>    Output capability file (with -d)\n");
+    fprintf(stderr, "  -o <file>    Output capability file (with -d; a directory in batch mode)\n");
+    fprintf(stderr, "  -j <count>   Batch detection threads, or parallel setups with -m (default: CPUs)\n");
+    fprintf(stderr, "  -L, --learn  Run the binary unconfined and record what it uses\n");
+    fprintf(stderr, "  -t <secs>    Learning period before the binary is stopped (default: %d)\n",
+            LEARN_DEFAULT_SECONDS);
+    fprintf(stderr, "  -C <file>    Compile a capability file for faster launches\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "General Options:\n");
     fprintf(stderr, "  -h           Show this help\n");
@@ -33,6 +61,12 @@ static void usage(const char *prog) {
     fprintf(stderr, "  # Generate capability file for an application\n");
     fprintf(stderr, "  %s -d ./myapp\n", prog);
     fprintf(stderr, "\n");
+    fprintf(stderr, "  # Generate capability files for every executable under a tree\n");
+    fprintf(stderr, "  %s -d -j 8 /usr/local/bin\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  # Learn exact capabilities while a load test runs against the server\n");
+    fprintf(stderr, "  %s --learn -t 300 ./myserver --port 8080\n", prog);
+    fprintf(stderr, "\n");
     fprintf(stderr, "  # Run with workspace directory\n");
     fprintf(stderr, "  doas %s -w /path/to/workspace ./myapp\n", prog);
     fprintf(stderr, "\n");
@@ -42,22 +76,64 @@ static void usage(const char *prog) {
     fprintf(stderr, "  # Run with custom capability file\n");
     fprintf(stderr, "  doas %s -c custom.caps ./myapp arg1 arg2\n", prog);
     fprintf(stderr, "\n");
+    fprintf(stderr, "  # Forward reload and stop signals, allowing 30 seconds to drain\n");
+    fprintf(stderr, "  doas %s -F HUP,TERM -g 30 ./myserver\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  # See where launch time goes\n");
+    fprintf(stderr, "  doas %s -T table ./myapp\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  # Keep 8 contexts warm, then launch instantly from the pool\n");
+    fprintf(stderr, "  doas %s -P 8 ./myapp &\n", prog);
+    fprintf(stderr, "  doas %s -W ./myapp arg1\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  # Start every tenant listed in a manifest, 16 setups at a time\n");
+    fprintf(stderr, "  doas %s -m fleet.manifest -j 16\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  # Same, without a resident parent process per tenant\n");
+    fprintf(stderr, "  doas %s -m fleet.manifest -j 16 -S\n", prog);
+    fprintf(stderr, "\n");
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
     const char *caps_file = NULL;
+    const char *compile_file = NULL;
     const char *target_binary = NULL;
     const char *output_file = NULL;
     const char *workspace_dir = NULL;
+    const char *manifest = NULL;
     int verbose = 0;
     int dry_run = 0;
     int detect_mode = 0;
+    int pool_size = 0;
+    int warm = 0;
+    int jobs = 0;
+    int learn = 0;
+    int supervise = 0;
+    int timing = TIMING_OFF;
+    struct forward_config forward;
+    int learn_seconds = LEARN_DEFAULT_SECONDS;
+    const char *detect_args[2];
+    int detect_count = 0;
+    int stop = 0;
     int opt;
     
+    timing_mark(TIMING_START);
+    forward_default_config(&forward);
+
     // Parse options
-    while ((opt = getopt(argc, argv, "c:o:w:dvnh")) != -1) {
+    // '-' returns operands in order: the binary ends parsing, so its own
+    // options are left alone, except with -d, where options may follow it
+    while (!stop && (opt = getopt_long(argc, argv, "-c:o:w:P:C:j:t:m:F:g:T:dvnWLSh", long_options, NULL)) != -1) {
         switch (opt) {
+            case 1:
+                if (detect_mode && detect_count < 2) {
+                    detect_args[detect_count++] = optarg;
+                } else {
+                    optind--;
+                    stop = 1;
+                }
+                break;
             case 'c':
                 caps_file = optarg;
                 break;
@@ -76,20 +152,100 @@ int main(int argc, char *argv[]) {
             case 'n':
                 dry_run = 1;
                 break;
+            case 'P':
+                pool_size = atoi(optarg);
+                break;
+            case 'W':
+                warm = 1;
+                break;
+            case 'C':
+                compile_file = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'L':
+                learn = 1;
+                break;
+            case 't':
+                learn_seconds = atoi(optarg);
+                break;
+            case 'm':
+                manifest = optarg;
+                break;
+            case 'S':
+                supervise = 1;
+                break;
+            case 'F':
+                if (forward_parse_signals(optarg, &forward.signals) != 0) {
+                    return 1;
+                }
+                break;
+            case 'g':
+                forward.grace_seconds = atoi(optarg);
+                break;
+            case 'T':
+                if ((timing = timing_parse_format(optarg)) < 0) {
+                    return 1;
+                }
+                break;
             case 'h':
             default:
                 usage(argv[0]);
         }
     }
     
+    // Compile mode needs no target binary
+    if (compile_file) {
+        return compile_capabilities(compile_file);
+    }
+    
+    // A manifest names its own binaries
+    if (manifest) {
+        if (detect_mode || learn || warm || pool_size > 0 || optind < argc) {
+            fprintf(stderr, "Error: -m cannot be combined with -d, -L, -P, -W or a target binary\n");
+            return 1;
+        }
+        return fleet_launch(manifest, jobs, supervise, dry_run, verbose);
+    }
+    if (supervise) {
+        fprintf(stderr, "Error: -S requires -m\n");
+        return 1;
+    }
+    
+    // Detection takes the binary and an optional output file, nothing more
+    if (detect_mode) {
+        while (optind < argc && detect_count < 2) {
+            detect_args[detect_count++] = argv[optind++];
+        }
+        if (optind < argc) {
+            fprintf(stderr, "Error: Unexpected argument %s\n", argv[optind]);
+            return 1;
+        }
+        if (detect_count == 2 && !output_file) {
+            output_file = detect_args[1];
+        }
+    }
+    
     // Need at least the target binary
-    if (optind >= argc) {
+    if (detect_mode ? detect_count == 0 : optind >= argc) {
         fprintf(stderr, "Error: No target binary specified\n");
         usage(argv[0]);
     }
     
-    target_binary = argv[optind];
+    target_binary = detect_mode ? detect_args[0] : argv[optind];
     
+    // Learn mode runs the binary itself and writes what it used
+    if (learn) {
+        if (detect_mode || dry_run || warm || pool_size > 0) {
+            fprintf(stderr, "Error: -L cannot be combined with -d, -n, -P or -W\n");
+            return 1;
+        }
+        printf("Isolate Capability Learning\n");
+        printf("===========================\n\n");
+        return learn_capabilities(target_binary, &argv[optind], output_file, learn_seconds) == 0 ? 0 : 1;
+    }
+
     // Handle detection mode
     if (detect_mode) {
         if (dry_run) {
@@ -100,6 +256,13 @@ int main(int argc, char *argv[]) {
         printf("Isolate Capability Detection\n");
         printf("============================\n\n");
         
+        // A directory or @list file runs detection for every executable in it
+        struct stat st;
+        if (target_binary[0] == '@' ||
+            (stat(target_binary, &st) == 0 && S_ISDIR(st.st_mode))) {
+            return detect_batch(target_binary, output_file, jobs);
+        }
+        
         int ret = detect_capabilities(target_binary, output_file);
         if (ret == 0) {
             printf("\nNext steps:\n");
@@ -110,9 +273,25 @@ int main(int argc, char *argv[]) {
         return ret;
     }
     
+    // Claim a prepared context if a warm pool serves this binary
+    if (warm) {
+        int status;
+        if (pool_claim(target_binary, &argv[optind], &forward, &status) == 0) {
+            if (WIFEXITED(status)) {
+                return WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                return 128 + WTERMSIG(status);
+            }
+            return 1;
+        }
+        if (verbose) {
+            fprintf(stderr, "No warm pool for %s, launching normally\n", target_binary);
+        }
+    }
+    
     // Check for conflicting options
     if (output_file && !detect_mode) {
-        fprintf(stderr, "Error: -o option can only be used with -d (detect mode)\n");
+        fprintf(stderr, "Error: -o option can only be used with -d or -L\n");
         return 1;
     }
     
@@ -155,9 +334,24 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    // Load capabilities
-    struct capabilities caps;
-    int ret = load_capabilities(caps_file, &caps);
+    // Load capabilities, preferring a compiled image that is still current
+    static struct capabilities caps_storage;
+    struct capabilities *caps = &caps_storage;
+    int ret = 0;
+    if (map_compiled_capabilities(caps_file, &caps) == 0) {
+        if (verbose) {
+            printf("Using compiled capabilities for %s\n", caps_file);
+        }
+    } else {
+        // A stale or unusable .capsb falls back to its text source
+        size_t len = strlen(caps_file);
+        if (len > 6 && strcmp(caps_file + len - 6, ".capsb") == 0) {
+            static char source_caps[PATH_MAX];
+            snprintf(source_caps, sizeof(source_caps), "%.*s", (int)len - 1, caps_file);
+            caps_file = source_caps;
+        }
+        ret = load_capabilities(caps_file, caps);
+    }
     if (ret != 0) {
         if (verbose || ret != ENOENT) {
             fprintf(stderr, "Warning: Could not load capabilities from %s: %s\n", 
@@ -172,17 +366,16 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Running without isolation.\n\n");
         }
         // Initialize with default (no isolation) capabilities
-        init_default_capabilities(&caps);
+        init_default_capabilities(caps);
     }
     
     // Set workspace path if specified
     if (workspace_dir) {
-        strncpy(caps.workspace_path, workspace_dir, sizeof(caps.workspace_path) - 1);
-        caps.workspace_path[sizeof(caps.workspace_path) - 1] = '\0';
+        caps->workspace_path = workspace_dir;
     }
     
     if (verbose) {
-        print_capabilities(&caps);
+        print_capabilities(caps);
         printf("\n");
     }
     
@@ -210,46 +403,62 @@ int main(int argc, char *argv[]) {
     // Set environment variable so freebsd.c can access the binary path
     setenv("ISOLATE_TARGET_BINARY", target_binary, 1);
     
+    if (pool_size > 0) {
+        return pool_serve(target_binary, caps, pool_size, &forward);
+    }
+    
     if (verbose) {
         printf("Creating isolation context...\n");
     }
 
-    // Create pipes to communicate jail info from child to parent
-    int pipefd[2];
-    if (pipe(pipefd) < 0) {
-        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+    // The child reports its setup over this channel and waits for a go-ahead
+    int channel[2];
+    if (setup_channel(channel) < 0) {
+        fprintf(stderr, "Failed to create setup channel: %s\n", strerror(errno));
         return 1;
     }
 
+    // Timing the first byte means seeing it: the instance writes into a pipe.
+    // A terminal is left alone, as a pipe would switch the application's
+    // stdio from line to full buffering; first-byte is not reported then
+    int output[2] = { -1, -1 };
+    if (timing != TIMING_OFF && !isatty(STDOUT_FILENO) && pipe(output) == 0) {
+        fcntl(output[0], F_SETFD, FD_CLOEXEC);
+        fcntl(output[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    // Signals arriving from here on wait for the parent to forward them
+    sigset_t saved_mask;
+    forward_block_signals(&forward, &saved_mask);
+
     // Fork before entering jail, so parent can clean up
-    pid_t pid = fork();
+    timing_mark(TIMING_FORK);
+    pid_t pid = fork_isolation_context(caps);
     if (pid < 0) {
         fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
-        close(pipefd[0]);
-        close(pipefd[1]);
+        close(channel[0]);
+        close(channel[1]);
         return 1;
     }
 
     if (pid == 0) {
         // Child process: create isolation context and execute
-        close(pipefd[0]); // Close read end
+        close(channel[0]);
+        if (output[0] >= 0) {
+            close(output[0]);
+        }
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        setup_child_channel(channel[1]);
 
-        if ((ret = create_isolation_context(&caps)) != 0) {
-            fprintf(stderr, "Failed to create isolation context: %s\n", strerror(ret));
-            close(pipefd[1]);
+        if ((ret = create_isolation_context(caps)) != 0) {
+            setup_fail(ret);
             return 1;
         }
 
-        // Send jail ID, username, and path to parent
-#ifdef __FreeBSD__
-        int jid = freebsd_get_jail_id();
-        const char* username = freebsd_get_username();
-        const char* jailpath = freebsd_get_jail_path();
-        write(pipefd[1], &jid, sizeof(jid));
-        write(pipefd[1], username, 64);
-        write(pipefd[1], jailpath, PATH_MAX);
-#endif
-        close(pipefd[1]);
+        // Hand over cleanup state, then wait for the parent's go-ahead
+        if (send_isolation_state() != 0 || setup_ready() != 0) {
+            return 1;
+        }
 
         if (verbose) {
             printf("Isolation context created successfully.\n");
@@ -266,37 +475,57 @@ int main(int argc, char *argv[]) {
 
         // Execute target binary with remaining args (using just the filename now)
         argv[optind] = (char*)binary_name;  // Replace full path with just filename
+        fflush(stdout);
+        if (output[1] >= 0) {
+            dup2(output[1], STDOUT_FILENO);
+        }
         execv(binary_name, &argv[optind]);
 
         // If we get here, execv failed
-        fprintf(stderr, "Failed to execute %s: %s\n", target_binary, strerror(errno));
+        int saved_errno = errno;
+        fprintf(stderr, "Failed to execute %s: %s\n", target_binary, strerror(saved_errno));
+        setup_fail(saved_errno);
         return 1;
     } else {
-        // Parent process: read jail info from child, wait, then cleanup
-        close(pipefd[1]); // Close write end
-
-        // Read jail ID, username, and path from child
-#ifdef __FreeBSD__
-        int jid;
-        char username[64];
-        char jailpath[PATH_MAX];
+        // Parent process: follow the setup, then wait and clean up
+        struct setup_report report;
+        close(channel[1]);
+        if (output[1] >= 0) {
+            close(output[1]);
+            // Relaying must not end with the launcher killed before cleanup
+            signal(SIGPIPE, SIG_IGN);
+            forward.relay_fd = output[0];
+        }
 
-        read(pipefd[0], &jid, sizeof(jid));
-        read(pipefd[0], username, 64);
-        read(pipefd[0], jailpath, PATH_MAX);
-        close(pipefd[0]);
+        setup_report_init(&report);
+        int result = setup_receive(channel[0], &report);
+        if (result == SETUP_READY) {
+            // Ctrl-C during setup cancels the launch instead of starting the app
+            result = setup_release(channel[0], &report, !forward_stop_pending());
+            if (result == SETUP_PENDING) {
+                result = setup_receive(channel[0], &report);
+            }
+        }
+        close(channel[0]);
 
-        // Set these values so cleanup can use them
-        freebsd_set_jail_id(jid);
-        freebsd_set_username(username);
-        freebsd_set_jail_path(jailpath);
-#else
-        close(pipefd[0]);
-#endif
+        // Adopt the child's cleanup state, whatever happened
+        receive_isolation_state(&report);
+        if (result != SETUP_EXECUTED) {
+            fprintf(stderr, "Error: Setup failed in %s phase: %s\n",
+                    setup_phase_name(report.phase), strerror(report.error));
+        } else if (verbose && report.ns_count > 0) {
+            printf("Holding %d namespace descriptors of the instance\n", report.ns_count);
+        }
 
-        // Wait for child to complete
-        int status;
-        waitpid(pid, &status, 0);
+        // Wait for child to complete, passing signals on; they stay
+        // blocked during cleanup so a second Ctrl-C cannot interrupt it
+        int status = 0;
+        if (forward_wait(pid, &forward, &status) != 0) {
+            fprintf(stderr, "Failed to wait for instance: %s\n", strerror(errno));
+            status = 1 << 8;
+        }
+        timing_mark(TIMING_EXITED);
+        setup_close_namespaces(&report);
 
         if (verbose) {
             printf("\nChild process exited, performing cleanup...\n");
@@ -304,6 +533,8 @@ int main(int argc, char *argv[]) {
 
         // Cleanup jail and user
         cleanup_isolation_context();
+        timing_mark(TIMING_CLEANED);
+        timing_report(timing, &report);
 
         if (verbose) {
             printf("Cleanup complete.\n");
@@ -0,0 +1,573 @@
+/*
+ * Warm pool of pre-created isolation contexts
+ *
+ * `isolate -P <n> <binary>` keeps n contexts parked just before execv:
+ * isolation created, filesystem mounted, user switched, limits applied.
+ * `isolate -W <binary> [args...]` claims one over a unix socket, hands
+ * it argv, environment and stdio, and gets the exit status back. While
+ * it waits, the client relays the signals it receives over the same
+ * socket and the keeper forwards them to the instance.
+ *
+ * Every slot is owned by a keeper process that behaves exactly like the
+ * regular launcher parent (fork, receive state, wait, clean up), so the
+ * single-instance backends need no changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "common.h"
+
+#define POOL_MAGIC 0x69736f50  /* "isoP" */
+#define POOL_MAX_SLOTS 256
+#define POOL_MAX_PENDING 64
+#define POOL_MAX_REQUEST (1024 * 1024)
+
+extern char **environ;
+
+struct pool_request {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t length;    /* bytes of NUL-separated argv then env strings */
+};
+
+enum slot_state { SLOT_FREE, SLOT_PREPARING, SLOT_READY };
+
+struct pool_slot {
+    enum slot_state state;
+    pid_t keeper;
+    int fd;             /* server end of the keeper socket */
+};
+
+static volatile sig_atomic_t pool_stop;
+static int claim_fd = -1;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    pool_stop = 1;
+}
+
+// Client side of a claim: pass the signal on to the keeper
+static void relay_claim_signal(int sig) {
+    int saved = errno;
+    int32_t wire = sig;
+    send(claim_fd, &wire, sizeof(wire), MSG_NOSIGNAL);
+    errno = saved;
+}
+
+int send_fds(int sock, const int *fds, int count, const void *data, size_t len) {
+    char control[CMSG_SPACE(sizeof(int) * SEND_FDS_MAX)];
+    struct iovec iov = { (void *)data, len };
+    struct msghdr msg;
+
+    if (count > SEND_FDS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    // A peer that went away is an error to report, not a reason to die
+    if (count == 0) {
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+    }
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+int recv_fds(int sock, int *fds, int max, void *data, size_t len) {
+    char control[CMSG_SPACE(sizeof(int) * SEND_FDS_MAX)];
+    struct iovec iov = { data, len };
+    struct msghdr msg;
+    int count = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_WAITALL);
+    if (n != (ssize_t)len) {
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n_fds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < n_fds; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (count < max) {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    fds[count++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int pool_socket_path(const char *target_binary, char *path, size_t path_size) {
+    char resolved[PATH_MAX];
+    unsigned long h = 5381;
+
+    // One pool per binary; hash the real path so equal names do not collide
+    if (!realpath(target_binary, resolved)) {
+        return -1;
+    }
+    for (const char *p = resolved; *p; p++) {
+        h = h * 33 + (unsigned char)*p;
+    }
+    const char *name = strrchr(resolved, '/');
+    name = name ? name + 1 : resolved;
+    snprintf(path, path_size, "%s/pool/%.64s-%08lx.sock", template_state_dir(), name, h & 0xffffffffUL);
+    return 0;
+}
+
+// Parked child: wait for a claim, adopt the client's argv/env/stdio and exec
+static void park_and_exec(int park_fd, const char *target_binary, const struct capabilities *caps) {
+    struct pool_request req;
+    int stdio[3];
+    int conn = -1;
+    char ready = 1;
+
+    if (write(park_fd, &ready, 1) != 1 || recv_fds(park_fd, &conn, 1, &ready, 1) != 1) {
+        exit(1);
+    }
+    // Closed by exec, which tells the keeper the request has been consumed
+    fcntl(park_fd, F_SETFD, FD_CLOEXEC);
+
+    if (recv_fds(conn, stdio, 3, &req, sizeof(req)) != 3 || req.magic != POOL_MAGIC ||
+        req.length > POOL_MAX_REQUEST || req.argc == 0) {
+        exit(1);
+    }
+
+    char *blob = malloc(req.length + 1);
+    char **args = calloc(req.argc + 1, sizeof(char *));
+    if (!blob || !args || read_full(conn, blob, req.length) != 0) {
+        exit(1);
+    }
+    blob[req.length] = '\0';
+
+    char *p = blob;
+    for (uint32_t i = 0; i < req.argc && p < blob + req.length; i++) {
+        args[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    // Client environment, except what the isolation itself pinned
+    char **envp = environ;
+    if (!caps->env_clear) {
+        static const char *pinned[] = { "USER", "HOME", "LD_LIBRARY_PATH" };
+        int count = 0;
+
+        envp = calloc(req.envc + 3 + caps->env_count + 1, sizeof(char *));
+        if (!envp) {
+            exit(1);
+        }
+        for (uint32_t i = 0; i < req.envc && p < blob + req.length; i++) {
+            char *entry = p;
+            p += strlen(p) + 1;
+            size_t name_len = strcspn(entry, "=");
+            int skip = 0;
+            for (int j = 0; j < 3; j++) {
+                skip |= strlen(pinned[j]) == name_len && strncmp(entry, pinned[j], name_len) == 0;
+            }
+            for (int j = 0; j < caps->env_count; j++) {
+                const char *name = caps->env_vars[j].name;
+                skip |= strlen(name) == name_len && strncmp(entry, name, name_len) == 0;
+            }
+            if (!skip) {
+                envp[count++] = entry;
+            }
+        }
+        for (int j = 0; j < 3; j++) {
+            const char *value = getenv(pinned[j]);
+            if (value && asprintf(&envp[count], "%s=%s", pinned[j], value) > 0) {
+                count++;
+            }
+        }
+        for (int j = 0; j < caps->env_count; j++) {
+            if (asprintf(&envp[count], "%s=%s", caps->env_vars[j].name, caps->env_vars[j].value) > 0) {
+                count++;
+            }
+        }
+        envp[count] = NULL;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        dup2(stdio[i], i);
+        close(stdio[i]);
+    }
+
+    const char *binary_name = strrchr(target_binary, '/');
+    binary_name = binary_name ? binary_name + 1 : target_binary;
+    args[0] = (char *)binary_name;
+    execve(binary_name, args, envp);
+
+    fprintf(stderr, "Failed to execute %s: %s\n", target_binary, strerror(errno));
+    exit(127);
+}
+
+// Keeper: the launcher parent for one slot
+static void run_keeper(int server_fd, const char *target_binary, const struct capabilities *caps,
+                       const struct forward_config *forward) {
+    struct forward_config config = *forward;
+    struct setup_report report;
+    int channel[2];
+    int park[2];
+    char byte = 0;
+    int conn = -1;
+    int status = 0;
+
+    if (setup_channel(channel) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, park) != 0) {
+        exit(1);
+    }
+
+    pid_t pid = fork_isolation_context(caps);
+    if (pid < 0) {
+        exit(1);
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        close(park[0]);
+        close(server_fd);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        setup_child_channel(channel[1]);
+        int ret = create_isolation_context(caps);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to create isolation context: %s\n", strerror(ret));
+            setup_fail(ret);
+            exit(1);
+        }
+        if (send_isolation_state() != 0 || setup_ready() != 0) {
+            exit(1);
+        }
+        fflush(stdout);
+        park_and_exec(park[1], target_binary, caps);
+    }
+
+    close(channel[1]);
+    close(park[1]);
+    // The parked child execs only once claimed, so stop following it at the barrier
+    setup_report_init(&report);
+    if (setup_receive(channel[0], &report) == SETUP_READY) {
+        setup_release(channel[0], &report, 1);
+    }
+    close(channel[0]);
+    receive_isolation_state(&report);
+    setup_close_namespaces(&report);
+
+    // Parked and ready: tell the server, then wait for a claim
+    if (read(park[0], &byte, 1) == 1 && write(server_fd, &byte, 1) == 1 &&
+        recv_fds(server_fd, &conn, 1, &byte, 1) == 1) {
+        send_fds(park[0], &conn, 1, &byte, 1);
+        // Until the instance execs, the claim socket still carries its request
+        ssize_t n;
+        while ((n = read(park[0], &byte, 1)) > 0 || (n < 0 && errno == EINTR)) {
+        }
+    } else {
+        // Server went away before a claim: retire the parked context
+        kill(pid, SIGKILL);
+    }
+    close(park[0]);
+    close(server_fd);
+
+    // Only the client's signals are forwarded; the keeper's own are not
+    sigemptyset(&config.signals);
+    config.relay_fd = -1;
+    config.control_fd = conn;
+    forward_block_signals(&config, NULL);
+    if (forward_wait(pid, &config, &status) != 0) {
+        status = 1 << 8;
+    }
+    cleanup_isolation_context();
+
+    if (conn >= 0) {
+        int32_t wire = status;
+        write(conn, &wire, sizeof(wire));
+        close(conn);
+    }
+    exit(0);
+}
+
+static int spawn_slot(struct pool_slot *slot, int listen_fd, const char *target_binary,
+                      const struct capabilities *caps, const struct forward_config *forward) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(listen_fd);
+        close(sv[0]);
+        // Keepers retire on server EOF so their instance is always cleaned up
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        run_keeper(sv[1], target_binary, caps, forward);
+    }
+
+    close(sv[1]);
+    slot->state = SLOT_PREPARING;
+    slot->keeper = pid;
+    slot->fd = sv[0];
+    return 0;
+}
+
+int pool_serve(const char *target_binary, const struct capabilities *caps, int size,
+               const struct forward_config *forward) {
+    struct pool_slot slots[POOL_MAX_SLOTS];
+    int pending[POOL_MAX_PENDING];
+    int pending_count = 0;
+    struct sockaddr_un addr;
+    char path[PATH_MAX];
+
+    if (size < 1 || size > POOL_MAX_SLOTS) {
+        fprintf(stderr, "Pool size must be between 1 and %d\n", POOL_MAX_SLOTS);
+        return 1;
+    }
+    if (pool_socket_path(target_binary, path, sizeof(path)) != 0 ||
+        strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Cannot derive pool socket for %s\n", target_binary);
+        return 1;
+    }
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/pool", template_state_dir());
+    fsops_mkdirs(AT_FDCWD, dir, 0700);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(path, 0600) != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+
+    int failures = 0;
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < size; i++) {
+        slots[i].fd = -1;
+        if (spawn_slot(&slots[i], listen_fd, target_binary, caps, forward) != 0) {
+            fprintf(stderr, "Warning: Failed to start pool slot: %s\n", strerror(errno));
+        }
+    }
+    printf("Warm pool of %d contexts for %s listening on %s\n", size, target_binary, path);
+
+    while (!pool_stop) {
+        struct pollfd pfds[POOL_MAX_SLOTS + 1];
+        int map[POOL_MAX_SLOTS + 1];
+        int n = 0;
+
+        pfds[n].fd = listen_fd;
+        pfds[n].events = POLLIN;
+        map[n++] = -1;
+        for (int i = 0; i < size; i++) {
+            if (slots[i].state != SLOT_FREE) {
+                pfds[n].fd = slots[i].fd;
+                pfds[n].events = POLLIN;
+                map[n++] = i;
+            }
+        }
+
+        if (poll(pfds, n, 1000) < 0 && errno != EINTR) {
+            break;
+        }
+
+        // Reap keepers whose claimed instances have finished
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+
+        for (int k = 1; k < n; k++) {
+            struct pool_slot *slot = &slots[map[k]];
+            if (!(pfds[k].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            char byte;
+            if (read(slot->fd, &byte, 1) == 1) {
+                slot->state = SLOT_READY;
+                failures = 0;
+            } else {
+                // Keeper failed to prepare a context; retry in the next round
+                close(slot->fd);
+                slot->fd = -1;
+                slot->state = SLOT_FREE;
+                failures++;
+            }
+        }
+
+        if (failures >= 3 * size) {
+            fprintf(stderr, "Error: Pool contexts keep failing to start, giving up\n");
+            break;
+        }
+
+        if ((pfds[0].revents & POLLIN) && pending_count < POOL_MAX_PENDING) {
+            int conn = accept(listen_fd, NULL, NULL);
+            if (conn >= 0) {
+                pending[pending_count++] = conn;
+            }
+        }
+
+        // Hand queued clients to ready slots, replenishing each claimed slot
+        for (int i = 0; i < size && pending_count > 0; i++) {
+            if (slots[i].state != SLOT_READY) {
+                continue;
+            }
+            char byte = 1;
+            int conn = pending[0];
+            memmove(pending, pending + 1, sizeof(int) * --pending_count);
+            if (send_fds(slots[i].fd, &conn, 1, &byte, 1) != 0) {
+                fprintf(stderr, "Warning: Failed to dispatch claim: %s\n", strerror(errno));
+            }
+            close(conn);
+            close(slots[i].fd);
+            slots[i].fd = -1;
+            slots[i].state = SLOT_FREE;
+        }
+
+        for (int i = 0; i < size; i++) {
+            if (slots[i].state == SLOT_FREE) {
+                spawn_slot(&slots[i], listen_fd, target_binary, caps, forward);
+            }
+        }
+    }
+
+    // Closing the keeper sockets retires every parked context
+    printf("Shutting down warm pool\n");
+    for (int i = 0; i < size; i++) {
+        if (slots[i].fd >= 0) {
+            close(slots[i].fd);
+        }
+    }
+    for (int i = 0; i < pending_count; i++) {
+        close(pending[i]);
+    }
+    close(listen_fd);
+    unlink(path);
+    while (wait(NULL) > 0) {
+    }
+    return 0;
+}
+
+int pool_claim(const char *target_binary, char *const args[], const struct forward_config *forward,
+               int *status) {
+    struct sockaddr_un addr;
+    struct sigaction action;
+    sigset_t saved;
+    char path[PATH_MAX];
+
+    if (pool_socket_path(target_binary, path, sizeof(path)) != 0 ||
+        strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct pool_request req;
+    size_t length = 0;
+    memset(&req, 0, sizeof(req));
+    req.magic = POOL_MAGIC;
+    for (int i = 0; args[i]; i++, req.argc++) length += strlen(args[i]) + 1;
+    for (int i = 0; environ[i]; i++, req.envc++) length += strlen(environ[i]) + 1;
+    if (length > POOL_MAX_REQUEST) {
+        close(fd);
+        return -1;
+    }
+    req.length = (uint32_t)length;
+
+    char *blob = malloc(length ? length : 1);
+    char *p = blob;
+    for (int i = 0; args[i]; i++) p = stpcpy(p, args[i]) + 1;
+    for (int i = 0; environ[i]; i++) p = stpcpy(p, environ[i]) + 1;
+
+    // Signals wait until the request is out, so they never land inside it
+    sigprocmask(SIG_BLOCK, &forward->signals, &saved);
+    int stdio[3] = { 0, 1, 2 };
+    int ret = send_fds(fd, stdio, 3, &req, sizeof(req));
+    if (ret == 0 && length > 0 && write(fd, blob, length) != (ssize_t)length) {
+        ret = -1;
+    }
+    free(blob);
+
+    claim_fd = fd;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = relay_claim_signal;
+    sigemptyset(&action.sa_mask);
+    for (int sig = 1; ret == 0 && sig < NSIG; sig++) {
+        if (sigismember(&forward->signals, sig) == 1) {
+            sigaction(sig, &action, NULL);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    int32_t wire;
+    if (ret != 0 || read_full(fd, &wire, sizeof(wire)) != 0) {
+        fprintf(stderr, "Warm pool instance did not report an exit status\n");
+        close(fd);
+        *status = 1 << 8;
+        return 0;
+    }
+    close(fd);
+    *status = wire;
+    return 0;
+}
@@ -0,0 +1,575 @@
+/*
+ * Shared library dependency resolver
+ *
+ * Builds the transitive DT_NEEDED closure of a binary the way the
+ * runtime loader would find it: DT_RPATH of the requesting object and
+ * its loaders (unless the requester has DT_RUNPATH), LD_LIBRARY_PATH,
+ * DT_RUNPATH, the loader's cache (ld.so.cache on Linux, ld-elf.so.hints
+ * on FreeBSD) and finally the default directories. Candidates built for
+ * another class or machine are skipped, as the loader does.
+ *
+ * Parsed libraries and resolved names are memoized for the life of the
+ * process, so batch detection resolves libc and friends only once. The
+ * tables are shared between threads behind a mutex; parsing happens
+ * outside the lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "common.h"
+
+#define MEMO_BUCKETS 4096
+#define MAX_CLOSURE 512
+
+#ifdef __FreeBSD__
+#define LOADER_CACHE "/var/run/ld-elf.so.hints"
+#define DEFAULT_DIRS "/lib:/usr/lib"
+#else
+#define LOADER_CACHE "/etc/ld.so.cache"
+#define LD_SO_CONF "/etc/ld.so.conf"
+#define DEFAULT_DIRS_64 "/lib64:/usr/lib64:/lib:/usr/lib"
+#define DEFAULT_DIRS "/lib:/usr/lib"
+#endif
+
+// One parsed ELF object; immutable once published
+struct lib_node {
+    char *path;
+    char *origin;               /* directory $ORIGIN expands to */
+    int valid;                  /* parsed as ELF */
+    int is64;
+    unsigned machine;
+    char **needed;
+    int needed_count;
+    char *rpath;
+    char *runpath;
+};
+
+struct memo_entry {
+    char *key;
+    void *value;
+    struct memo_entry *next;
+};
+
+struct resolution {
+    const char *path;           /* NULL when the name cannot be found */
+    int from_cache;             /* found through the loader cache or its configuration */
+};
+
+struct cache_lib {
+    char *name;
+    char *path;
+};
+
+static pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memo_entry *nodes[MEMO_BUCKETS];
+static struct memo_entry *resolved[MEMO_BUCKETS];
+
+static pthread_once_t system_once = PTHREAD_ONCE_INIT;
+static struct cache_lib *cache_libs;
+static int cache_lib_count;
+static char *system_dirs;       /* searched after the loader cache */
+
+static unsigned int memo_hash(const char *key) {
+    return (unsigned int)(fnv1a64(FNV_OFFSET, key, strlen(key)) % MEMO_BUCKETS);
+}
+
+static void *memo_find(struct memo_entry **table, const char *key, int *found) {
+    for (struct memo_entry *e = table[memo_hash(key)]; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            *found = 1;
+            return e->value;
+        }
+    }
+    *found = 0;
+    return NULL;
+}
+
+static int memo_insert(struct memo_entry **table, const char *key, void *value) {
+    struct memo_entry *e = malloc(sizeof(*e));
+    if (!e || !(e->key = strdup(key))) {
+        free(e);
+        return -1;
+    }
+    unsigned int bucket = memo_hash(key);
+    e->value = value;
+    e->next = table[bucket];
+    table[bucket] = e;
+    return 0;
+}
+
+static void append_dirs(char **dirs, const char *list) {
+    size_t old = *dirs ? strlen(*dirs) : 0;
+    size_t add = strlen(list);
+    if (add == 0) {
+        return;
+    }
+    char *grown = realloc(*dirs, old + add + 2);
+    if (!grown) {
+        return;
+    }
+    if (old) {
+        grown[old++] = ':';
+    }
+    memcpy(grown + old, list, add + 1);
+    *dirs = grown;
+}
+
+#ifdef __FreeBSD__
+// ld-elf.so.hints: a header pointing at a colon-separated directory list
+static void load_loader_cache(void) {
+    struct {
+        uint32_t magic, version, strtab, strsize, dirlist, dirlistlen;
+    } header;
+    int fd = open(LOADER_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == 0x746e6845 && header.version == 1 && header.dirlistlen < 65536) {
+        char *list = malloc(header.dirlistlen + 1);
+        if (list && pread(fd, list, header.dirlistlen, header.strtab + header.dirlist) ==
+                    (ssize_t)header.dirlistlen) {
+            list[header.dirlistlen] = '\0';
+            append_dirs(&system_dirs, list);
+        }
+        free(list);
+    }
+    close(fd);
+}
+#else
+// Directories from ld.so.conf, following "include" globs
+static void load_ld_so_conf(const char *path, int depth) {
+    char line[PATH_MAX];
+    FILE *file = depth <= 4 ? fopen(path, "r") : NULL;
+
+    if (!file) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#\n")] = 0;
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0') continue;
+
+        if (strncmp(start, "include", 7) == 0 && (start[7] == ' ' || start[7] == '\t')) {
+            glob_t matches;
+            char *pattern = start + 8 + strspn(start + 8, " \t");
+            if (glob(pattern, 0, NULL, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; i++) {
+                    load_ld_so_conf(matches.gl_pathv[i], depth + 1);
+                }
+                globfree(&matches);
+            }
+        } else if (*start == '/') {
+            start[strcspn(start, " \t")] = 0;
+            append_dirs(&system_dirs, start);
+        }
+    }
+    fclose(file);
+}
+
+/*
+ * glibc ld.so.cache, new format ("glibc-ld.so.cache1.1"): a 48-byte
+ * header, nlibs 24-byte entries of flags, key, value, osversion and
+ * hwcap, then the string table; offsets count from the header. Files
+ * still carrying the old "ld.so-1.7.0" table have the new one after it.
+ */
+static void load_loader_cache(void) {
+    static const char magic[] = "glibc-ld.so.cache1.1";
+    struct stat st;
+
+    int fd = open(LOADER_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 48) {
+        close(fd);
+        return;
+    }
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    size_t size = st.st_size, base = 0;
+    if (memcmp(map, "ld.so-1.7.0", 11) == 0) {
+        uint32_t old_count;
+        memcpy(&old_count, map + 12, sizeof(old_count));
+        base = (16 + (size_t)old_count * 12 + 7) & ~(size_t)7;
+    }
+    uint32_t count = 0;
+    if (base + 48 <= size && memcmp(map + base, magic, sizeof(magic) - 1) == 0) {
+        memcpy(&count, map + base + 20, sizeof(count));
+        if (count < (size - base - 48) / 24) {
+            cache_libs = calloc(count, sizeof(*cache_libs));
+        }
+    }
+    for (uint32_t i = 0; cache_libs && i < count; i++) {
+        uint32_t key, value;
+        size_t entry = base + 48 + (size_t)i * 24;
+        memcpy(&key, map + entry + 4, sizeof(key));
+        memcpy(&value, map + entry + 8, sizeof(value));
+        if (base + key >= size || base + value >= size ||
+            !memchr(map + base + key, '\0', size - base - key) ||
+            !memchr(map + base + value, '\0', size - base - value)) {
+            continue;
+        }
+        cache_libs[cache_lib_count].name = strdup((const char *)map + base + key);
+        cache_libs[cache_lib_count].path = strdup((const char *)map + base + value);
+        cache_lib_count++;
+    }
+    munmap((void *)map, size);
+
+    // Without a cache, approximate it with the directories it is built from
+    if (cache_lib_count == 0) {
+        load_ld_so_conf(LD_SO_CONF, 0);
+    }
+}
+#endif
+
+static void load_system_search(void) {
+    load_loader_cache();
+}
+
+static struct lib_node *parse_node(const char *path, const char *origin) {
+    struct elf_info elf;
+    struct lib_node *node = calloc(1, sizeof(*node));
+
+    if (!node) {
+        return NULL;
+    }
+    node->path = strdup(path);
+    node->origin = strdup(origin);
+    if (elf_open(path, &elf) != 0) {
+        return node;
+    }
+    node->valid = 1;
+    node->is64 = elf.is64;
+    node->machine = elf.machine;
+    node->rpath = elf.rpath ? strdup(elf.rpath) : NULL;
+    node->runpath = elf.runpath ? strdup(elf.runpath) : NULL;
+    node->needed = calloc(elf.needed_count ? elf.needed_count : 1, sizeof(char *));
+    for (int i = 0; node->needed && i < elf.needed_count; i++) {
+        node->needed[node->needed_count++] = strdup(elf.needed[i]);
+    }
+    elf_close(&elf);
+    return node;
+}
+
+// The shared node for path, parsed on first use
+static struct lib_node *get_node(const char *path, const char *origin) {
+    int found;
+
+    pthread_mutex_lock(&memo_lock);
+    struct lib_node *node = memo_find(nodes, path, &found);
+    pthread_mutex_unlock(&memo_lock);
+    if (found) {
+        return node;
+    }
+
+    struct lib_node *parsed = parse_node(path, origin);
+    if (!parsed) {
+        return NULL;
+    }
+    pthread_mutex_lock(&memo_lock);
+    node = memo_find(nodes, path, &found);
+    if (!found) {
+        node = memo_insert(nodes, path, parsed) == 0 ? parsed : NULL;
+        parsed = NULL;
+    }
+    pthread_mutex_unlock(&memo_lock);
+
+    // Another thread published the same path first
+    if (parsed) {
+        for (int i = 0; i < parsed->needed_count; i++) {
+            free(parsed->needed[i]);
+        }
+        free(parsed->needed);
+        free(parsed->rpath);
+        free(parsed->runpath);
+        free(parsed->origin);
+        free(parsed->path);
+        free(parsed);
+    }
+    return node;
+}
+
+static char *dirname_of(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return strdup(".");
+    }
+    if (slash == path) {
+        return strdup("/");
+    }
+    return strndup(path, slash - path);
+}
+
+// Expand $ORIGIN and $LIB in a search list and append it to dirs
+static void append_expanded(char **dirs, const char *list, const struct lib_node *owner) {
+    char expanded[PATH_MAX * 4];
+    size_t len = 0;
+
+    for (const char *p = list; *p && len < sizeof(expanded) - 1; ) {
+        const char *value = NULL;
+        size_t skip = 0;
+        if (strncmp(p, "$ORIGIN", 7) == 0) {
+            value = owner->origin, skip = 7;
+        } else if (strncmp(p, "${ORIGIN}", 9) == 0) {
+            value = owner->origin, skip = 9;
+        } else if (strncmp(p, "$LIB", 4) == 0) {
+            value = owner->is64 ? "lib64" : "lib", skip = 4;
+        } else if (strncmp(p, "${LIB}", 6) == 0) {
+            value = owner->is64 ? "lib64" : "lib", skip = 6;
+        }
+        if (value) {
+            len += snprintf(expanded + len, sizeof(expanded) - len, "%s", value);
+            p += skip;
+        } else {
+            expanded[len++] = *p++;
+        }
+    }
+    expanded[len < sizeof(expanded) ? len : sizeof(expanded) - 1] = '\0';
+    append_dirs(dirs, expanded);
+}
+
+struct closure_item {
+    struct lib_node *node;
+    int parent;                 /* loader of this object, -1 for the binary */
+};
+
+// Search directories for a name requested by items[index]
+static char *search_dirs(const struct closure_item *items, int index) {
+    const struct lib_node *requester = items[index].node;
+    const char *env = getenv("LD_LIBRARY_PATH");
+    char *dirs = NULL;
+
+    // DT_RPATH of the requester and its loaders, unless it has DT_RUNPATH
+    if (!requester->runpath) {
+        for (int i = index; i >= 0; i = items[i].parent) {
+            if (items[i].node->rpath) {
+                append_expanded(&dirs, items[i].node->rpath, items[i].node);
+            }
+        }
+    }
+    if (env) {
+        append_dirs(&dirs, env);
+    }
+    if (requester->runpath) {
+        append_expanded(&dirs, requester->runpath, requester);
+    }
+    return dirs;
+}
+
+static int usable(const struct lib_node *node, const struct lib_node *requester) {
+    return node && node->valid && node->is64 == requester->is64 && node->machine == requester->machine;
+}
+
+static const char *try_dirs(const char *dirs, const char *name, const struct lib_node *requester) {
+    char path[PATH_MAX];
+    char *copy = strdup(dirs);
+    char *save = NULL;
+    const char *found = NULL;
+
+    for (char *dir = strtok_r(copy, ":\n", &save); dir && !found; dir = strtok_r(NULL, ":\n", &save)) {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (access(path, F_OK) != 0) {
+            continue;
+        }
+        struct lib_node *node = get_node(path, dir);
+        if (usable(node, requester)) {
+            found = node->path;
+        }
+    }
+    free(copy);
+    return found;
+}
+
+static const char *search_library(const char *name, const char *dirs, const struct lib_node *requester,
+                                  int *from_cache) {
+    const char *found = try_dirs(dirs, name, requester);
+
+    for (int i = 0; !found && i < cache_lib_count; i++) {
+        if (strcmp(cache_libs[i].name, name) == 0) {
+            char *origin = dirname_of(cache_libs[i].path);
+            struct lib_node *node = origin ? get_node(cache_libs[i].path, origin) : NULL;
+            free(origin);
+            if (usable(node, requester)) {
+                found = node->path;
+                *from_cache = 1;
+            }
+        }
+    }
+    if (!found && system_dirs) {
+        found = try_dirs(system_dirs, name, requester);
+        *from_cache = found != NULL;
+    }
+#ifdef DEFAULT_DIRS_64
+    if (!found && requester->is64) {
+        found = try_dirs(DEFAULT_DIRS_64, name, requester);
+    }
+#endif
+    if (!found) {
+        found = try_dirs(DEFAULT_DIRS, name, requester);
+    }
+    return found;
+}
+
+// Memoized: the same name and search list always resolve the same way
+static const char *resolve_name(const char *name, const struct closure_item *items, int index,
+                                int *from_cache) {
+    const struct lib_node *requester = items[index].node;
+    char key[PATH_MAX * 2];
+    int found;
+
+    *from_cache = 0;
+    if (strchr(name, '/')) {
+        struct lib_node *node = get_node(name, requester->origin);
+        return usable(node, requester) ? node->path : NULL;
+    }
+
+    char *dirs = search_dirs(items, index);
+    snprintf(key, sizeof(key), "%s\n%d:%u\n%s", name, requester->is64, requester->machine,
+             dirs ? dirs : "");
+
+    pthread_mutex_lock(&memo_lock);
+    struct resolution *memo = memo_find(resolved, key, &found);
+    pthread_mutex_unlock(&memo_lock);
+    if (found && memo) {
+        free(dirs);
+        *from_cache = memo->from_cache;
+        return memo->path;
+    }
+
+    struct resolution *result = malloc(sizeof(*result));
+    if (!result) {
+        free(dirs);
+        return NULL;
+    }
+    result->path = search_library(name, dirs ? dirs : "", requester, &result->from_cache);
+    free(dirs);
+    *from_cache = result->from_cache;
+    const char *path = result->path;
+
+    pthread_mutex_lock(&memo_lock);
+    memo_find(resolved, key, &found);
+    if (!found && memo_insert(resolved, key, result) == 0) {
+        result = NULL;
+    }
+    pthread_mutex_unlock(&memo_lock);
+    free(result);
+    return path;
+}
+
+static int add_dependency(struct lib_closure *closure, const char *name, const char *path) {
+    if (closure->count == closure->capacity) {
+        int capacity = closure->capacity ? closure->capacity * 2 : 32;
+        struct lib_dependency *deps = realloc(closure->deps, capacity * sizeof(*deps));
+        if (!deps) {
+            return -1;
+        }
+        closure->deps = deps;
+        closure->capacity = capacity;
+    }
+    closure->deps[closure->count].name = name;
+    closure->deps[closure->count].path = path;
+    closure->count++;
+    return 0;
+}
+
+int resolve_closure(const char *binary, struct lib_closure *closure) {
+    struct closure_item items[MAX_CLOSURE];
+    struct elf_info elf;
+    char real[PATH_MAX];
+    int count = 0;
+
+    memset(closure, 0, sizeof(*closure));
+    pthread_once(&system_once, load_system_search);
+
+    if (elf_open(binary, &elf) != 0) {
+        return -1;
+    }
+    if (elf.interp) {
+        closure->interp = strdup(elf.interp);
+    }
+    elf_close(&elf);
+
+    // $ORIGIN of the executable is the directory of its resolved path
+    char *origin = realpath(binary, real) ? dirname_of(real) : dirname_of(binary);
+    items[count].node = origin ? get_node(binary, origin) : NULL;
+    items[count].parent = -1;
+    free(origin);
+    if (!items[count].node || !items[count].node->valid) {
+        free(closure->interp);
+        closure->interp = NULL;
+        errno = ENOEXEC;
+        return -1;
+    }
+    count++;
+
+    // Breadth-first, like the loader; a name already seen is not loaded twice
+    for (int next = 0; next < count; next++) {
+        const struct lib_node *node = items[next].node;
+        for (int i = 0; i < node->needed_count; i++) {
+            const char *name = node->needed[i];
+            int seen = 0, from_cache;
+            for (int j = 0; j < closure->count && !seen; j++) {
+                seen = strcmp(closure->deps[j].name, name) == 0;
+            }
+            if (seen) continue;
+
+            // The interpreter is already loaded and answers to its own name
+            const char *path;
+            const char *interp_name = closure->interp ? strrchr(closure->interp, '/') : NULL;
+            if (interp_name && strcmp(interp_name + 1, name) == 0) {
+                add_dependency(closure, name, closure->interp);
+                continue;
+            }
+            path = resolve_name(name, items, next, &from_cache);
+            add_dependency(closure, name, path);
+            closure->used_cache |= from_cache;
+            if (path && count < MAX_CLOSURE) {
+                char *dir = dirname_of(path);
+                items[count].node = dir ? get_node(path, dir) : NULL;
+                items[count].parent = next;
+                free(dir);
+                if (items[count].node) {
+                    count++;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void free_lib_closure(struct lib_closure *closure) {
+    free(closure->deps);
+    free(closure->interp);
+    memset(closure, 0, sizeof(*closure));
+}
+
+const char *resolver_cache_file(void) {
+    return LOADER_CACHE;
+}
+
+// Host files whose changes can move a library the resolver would pick
+const char *const *resolver_config_files(void) {
+    static const char *const files[] = {
+        LOADER_CACHE,
+#ifdef LD_SO_CONF
+        LD_SO_CONF, LD_SO_CONF ".d",
+#endif
+        NULL
+    };
+    return files;
+}
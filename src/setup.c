@@ -0,0 +1,302 @@
+/*
+ * Setup protocol between an instance and its launcher
+ *
+ * The child reports over a socketpair while it builds its isolation:
+ * the handles the parent needs for cleanup, its namespace descriptors
+ * (SCM_RIGHTS), when each phase started and finally that it is ready
+ * to exec or which phase failed. Phase hooks only read the monotonic
+ * clock; the timestamps travel in one frame with READY or ERROR. It
+ * then waits until the parent answers with GO or ABORT, so the parent
+ * holds everything it needs before the application runs and can still
+ * cancel the launch. After GO the channel reaches EOF once execv
+ * succeeds (the socket is close-on-exec) or carries the exec error.
+ *
+ * Every frame is a 4-byte header (version, type, payload length)
+ * followed by the payload, sent with a single sendmsg(). Unknown types
+ * are skipped so either side can grow new messages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "common.h"
+
+#define SETUP_MAX_PAYLOAD PATH_MAX
+
+struct setup_header {
+    uint8_t version;
+    uint8_t type;
+    uint16_t length;
+};
+
+struct setup_error {
+    int32_t error;
+    uint32_t phase;
+};
+
+struct setup_times {
+    uint64_t start[SETUP_PHASE_COUNT];   /* [SETUP_PHASE_NONE]: setup began */
+    uint64_t end;
+};
+
+static const char *phase_names[SETUP_PHASE_COUNT] = {
+    "none", "user", "rootfs", "filesystem", "jail", "limits",
+    "network", "attach", "credentials", "exec"
+};
+
+static int channel_fd = -1;
+static int current_phase = SETUP_PHASE_NONE;
+static uint64_t phase_marks[SETUP_PHASE_COUNT];
+
+const char *setup_phase_name(int phase) {
+    return phase >= 0 && phase < SETUP_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+int setup_channel(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+void setup_report_init(struct setup_report *report) {
+    memset(report, 0, sizeof(*report));
+    report->jid = -1;
+    report->uid = (uid_t)-1;
+}
+
+static int send_frame(int fd, int type, const void *data, size_t len, const int *fds, int count) {
+    unsigned char frame[sizeof(struct setup_header) + SETUP_MAX_PAYLOAD];
+    struct setup_header header;
+
+    if (len > SETUP_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    header.version = SETUP_PROTOCOL_VERSION;
+    header.type = (uint8_t)type;
+    header.length = (uint16_t)len;
+    memcpy(frame, &header, sizeof(header));
+    if (len > 0) {
+        memcpy(frame + sizeof(header), data, len);
+    }
+    return send_fds(fd, fds, count, frame, sizeof(header) + len);
+}
+
+/* Child side */
+
+void setup_child_channel(int fd) {
+    channel_fd = fd;
+    current_phase = SETUP_PHASE_NONE;
+    memset(phase_marks, 0, sizeof(phase_marks));
+    phase_marks[SETUP_PHASE_NONE] = timing_now();
+}
+
+int setup_send(int type, const void *data, size_t len, const int *fds, int count) {
+    if (channel_fd < 0) {
+        return 0;
+    }
+    return send_frame(channel_fd, type, data, len, fds, count);
+}
+
+// Cheap enough to stay in every launch: a vDSO clock read and two stores
+void setup_phase(enum setup_phase phase) {
+    current_phase = phase;
+    phase_marks[phase] = timing_now();
+}
+
+static int send_times(void) {
+    struct setup_times times;
+
+    memcpy(times.start, phase_marks, sizeof(times.start));
+    times.end = timing_now();
+    return setup_send(SETUP_MSG_TIMES, &times, sizeof(times), NULL, 0);
+}
+
+void setup_fail(int error) {
+    struct setup_error payload;
+
+    payload.error = error;
+    payload.phase = (uint32_t)current_phase;
+    // After GO the timestamps have already been sent
+    if (current_phase != SETUP_PHASE_EXEC) {
+        send_times();
+    }
+    setup_send(SETUP_MSG_ERROR, &payload, sizeof(payload), NULL, 0);
+}
+
+// Barrier: returns 0 once the parent says GO, -1 if it aborts or is gone
+int setup_ready(void) {
+    struct setup_header header;
+    ssize_t n;
+
+    if (channel_fd < 0) {
+        return 0;
+    }
+    if (send_times() != 0 || setup_send(SETUP_MSG_READY, NULL, 0, NULL, 0) != 0) {
+        return -1;
+    }
+    while ((n = read(channel_fd, &header, sizeof(header))) < 0 && errno == EINTR) {
+    }
+    if (n != (ssize_t)sizeof(header) || header.version != SETUP_PROTOCOL_VERSION ||
+        header.type != SETUP_MSG_GO) {
+        errno = ECANCELED;
+        return -1;
+    }
+    current_phase = SETUP_PHASE_EXEC;
+    return 0;
+}
+
+/* Parent side */
+
+static int read_payload(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int fail(struct setup_report *report, int error) {
+    report->error = error;
+    return SETUP_FAILED;
+}
+
+static void store_namespaces(struct setup_report *report, const unsigned char *payload,
+                             uint16_t length, const int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t type = 0;
+        if ((i + 1) * sizeof(type) > length || report->ns_count == SETUP_MAX_NAMESPACES) {
+            close(fds[i]);
+            continue;
+        }
+        memcpy(&type, payload + i * sizeof(type), sizeof(type));
+        report->ns_types[report->ns_count] = type;
+        report->ns_fds[report->ns_count++] = fds[i];
+    }
+}
+
+// Handle one frame from the child
+int setup_step(int fd, struct setup_report *report) {
+    unsigned char payload[SETUP_MAX_PAYLOAD + 1];
+    struct setup_header header;
+    int fds[SETUP_MAX_NAMESPACES];
+
+    int count = recv_fds(fd, fds, SETUP_MAX_NAMESPACES, &header, sizeof(header));
+    if (count < 0) {
+        // EOF after GO: the close-on-exec channel went away with execv
+        if (report->released) {
+            report->executed = timing_now();
+            return SETUP_EXECUTED;
+        }
+        return fail(report, report->error ? report->error : EPIPE);
+    }
+    if (header.version != SETUP_PROTOCOL_VERSION || header.length > SETUP_MAX_PAYLOAD ||
+        read_payload(fd, payload, header.length) != 0) {
+        for (int i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        return fail(report, EPROTO);
+    }
+    payload[header.length] = '\0';
+
+    switch (header.type) {
+        case SETUP_MSG_TIMES: {
+            struct setup_times times;
+            memset(&times, 0, sizeof(times));
+            memcpy(&times, payload, header.length < sizeof(times) ? header.length : sizeof(times));
+            memcpy(report->phase_start, times.start, sizeof(report->phase_start));
+            report->setup_end = times.end;
+            break;
+        }
+        case SETUP_MSG_ERROR: {
+            struct setup_error error;
+            memset(&error, 0, sizeof(error));
+            memcpy(&error, payload, header.length < sizeof(error) ? header.length : sizeof(error));
+            if (error.phase < SETUP_PHASE_COUNT) {
+                report->phase = (int)error.phase;
+            }
+            // Backends without an errno report -1
+            return fail(report, error.error > 0 ? error.error : EIO);
+        }
+        case SETUP_MSG_JAIL: {
+            int32_t jid = -1;
+            memcpy(&jid, payload, header.length < sizeof(jid) ? header.length : sizeof(jid));
+            report->jid = jid;
+            break;
+        }
+        case SETUP_MSG_USER: {
+            uint32_t uid;
+            if (header.length >= sizeof(uid)) {
+                memcpy(&uid, payload, sizeof(uid));
+                report->uid = (uid_t)uid;
+                snprintf(report->username, sizeof(report->username), "%.*s",
+                         (int)sizeof(report->username) - 1, (const char *)payload + sizeof(uid));
+            }
+            break;
+        }
+        case SETUP_MSG_ROOT:
+            snprintf(report->root_path, sizeof(report->root_path), "%.*s",
+                     (int)sizeof(report->root_path) - 1, (const char *)payload);
+            break;
+        case SETUP_MSG_NAMESPACES:
+            store_namespaces(report, payload, header.length, fds, count);
+            count = 0;
+            break;
+        case SETUP_MSG_READY:
+            return SETUP_READY;
+        default:
+            break;
+    }
+
+    // Descriptors on any other message are not ours to keep
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+    return SETUP_PENDING;
+}
+
+// Handle frames until the child is ready, has exec'd or has failed
+int setup_receive(int fd, struct setup_report *report) {
+    int result;
+
+    while ((result = setup_step(fd, report)) == SETUP_PENDING) {
+    }
+    return result;
+}
+
+// Answer the barrier; without GO the child exits instead of exec'ing
+int setup_release(int fd, struct setup_report *report, int go) {
+    if (send_frame(fd, go ? SETUP_MSG_GO : SETUP_MSG_ABORT, NULL, 0, NULL, 0) != 0) {
+        return fail(report, errno);
+    }
+    if (!go) {
+        return fail(report, ECANCELED);
+    }
+    report->released = timing_now();
+    report->phase = SETUP_PHASE_EXEC;
+    return SETUP_PENDING;
+}
+
+void setup_close_namespaces(struct setup_report *report) {
+    for (int i = 0; i < report->ns_count; i++) {
+        close(report->ns_fds[i]);
+    }
+    report->ns_count = 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Printable string scanner for capability detection
+ *
+ * Finds runs of printable characters in a memory buffer, the way
+ * strings(1) does, without spawning a process. Bytes are classified a
+ * block at a time into a 64-bit mask (AVX2 or SSE2 where available,
+ * scalar otherwise) and runs are then found with bit scans, so long
+ * stretches of binary data or text cost a few instructions per block.
+ * The implementation is picked once from the running CPU's features.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRSCAN_X86 1
+#endif
+
+#define STRSCAN_BLOCK 64
+
+typedef uint64_t (*classify_fn)(const unsigned char *block);
+
+// Tab and 0x20-0x7e, matching strings(1)
+static inline int is_printable(unsigned char c) {
+    return (c >= 0x20 && c < 0x7f) || c == '\t';
+}
+
+static inline uint64_t classify_scalar(const unsigned char *block) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < STRSCAN_BLOCK; i++) {
+        mask |= (uint64_t)is_printable(block[i]) << i;
+    }
+    return mask;
+}
+
+#ifdef STRSCAN_X86
+// Signed compares: bytes >= 0x80 are negative and fall out of the range
+__attribute__((target("sse2")))
+static inline uint64_t classify_sse2(const unsigned char *block) {
+    const __m128i low = _mm_set1_epi8(0x1f);
+    const __m128i high = _mm_set1_epi8(0x7f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    uint64_t mask = 0;
+
+    for (int i = 0; i < STRSCAN_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high));
+        in = _mm_or_si128(in, _mm_cmpeq_epi8(v, tab));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(in) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t classify_avx2(const unsigned char *block) {
+    const __m256i low = _mm256_set1_epi8(0x1f);
+    const __m256i high = _mm256_set1_epi8(0x7f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    uint64_t mask = 0;
+
+    for (int i = 0; i < STRSCAN_BLOCK; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(high, v));
+        in = _mm256_or_si256(in, _mm256_cmpeq_epi8(v, tab));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(in) << i;
+    }
+    return mask;
+}
+#endif
+
+// The last partial block is classified from a zero-padded copy
+static inline uint64_t block_mask(const unsigned char *data, size_t size, size_t pos,
+                                  classify_fn classify) {
+    unsigned char tail[STRSCAN_BLOCK] = {0};
+
+    if (pos >= size) {
+        return 0;
+    }
+    if (size - pos >= STRSCAN_BLOCK) {
+        return classify(data + pos);
+    }
+    memcpy(tail, data + pos, size - pos);
+    return classify(tail);
+}
+
+/*
+ * Bit i of "starts" is set when bytes i..i+min_len-1 are all printable,
+ * using the next block's mask for the bytes past the end of this one.
+ * Only long enough runs have a start bit, so the many short printable
+ * fragments in binary data never reach the bit-scan loop at all.
+ */
+static inline __attribute__((always_inline))
+int scan_blocks(const unsigned char *data, size_t size, unsigned min_len,
+                int (*visit)(const char *str, size_t len, void *ctx), void *ctx,
+                classify_fn classify) {
+    uint64_t cur = block_mask(data, size, 0, classify);
+    size_t run_start = 0;
+    int in_run = 0;
+
+    for (size_t base = 0; base < size; base += STRSCAN_BLOCK) {
+        uint64_t next = block_mask(data, size, base + STRSCAN_BLOCK, classify);
+        uint64_t starts = cur;
+        for (unsigned k = 1; k < min_len; k++) {
+            starts &= (cur >> k) | (next << (64 - k));
+        }
+        int bit = 0;
+
+        if (in_run) {
+            if (cur == UINT64_MAX) {
+                cur = next;
+                continue;
+            }
+            bit = __builtin_ctzll(~cur);
+            in_run = 0;
+            if (visit((const char *)data + run_start, base + bit - run_start, ctx) != 0) {
+                return 1;
+            }
+        }
+        while (bit < STRSCAN_BLOCK && (starts >> bit) != 0) {
+            bit += __builtin_ctzll(starts >> bit);
+            run_start = base + bit;
+            uint64_t clear = ~cur >> bit;
+            if (clear == 0) {
+                in_run = 1;
+                break;
+            }
+            bit += __builtin_ctzll(clear);
+            if (visit((const char *)data + run_start, base + bit - run_start, ctx) != 0) {
+                return 1;
+            }
+        }
+        cur = next;
+    }
+    // Zero padding ends every run inside a partial block
+    if (in_run) {
+        return visit((const char *)data + run_start, size - run_start, ctx) != 0;
+    }
+    return 0;
+}
+
+typedef int (*scan_fn)(const unsigned char *data, size_t size, unsigned min_len,
+                       int (*visit)(const char *str, size_t len, void *ctx), void *ctx);
+
+static int scan_scalar(const unsigned char *data, size_t size, unsigned min_len,
+                       int (*visit)(const char *str, size_t len, void *ctx), void *ctx) {
+    return scan_blocks(data, size, min_len, visit, ctx, classify_scalar);
+}
+
+#ifdef STRSCAN_X86
+__attribute__((target("sse2")))
+static int scan_sse2(const unsigned char *data, size_t size, unsigned min_len,
+                     int (*visit)(const char *str, size_t len, void *ctx), void *ctx) {
+    return scan_blocks(data, size, min_len, visit, ctx, classify_sse2);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const unsigned char *data, size_t size, unsigned min_len,
+                     int (*visit)(const char *str, size_t len, void *ctx), void *ctx) {
+    return scan_blocks(data, size, min_len, visit, ctx, classify_avx2);
+}
+#endif
+
+static scan_fn scan;
+static const char *scan_name;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void pick_scanner(void) {
+    scan = scan_scalar;
+    scan_name = "scalar";
+#ifdef STRSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        scan_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+static void select_scanner(void) {
+    pthread_once(&scan_once, pick_scanner);
+}
+
+const char *strscan_implementation(void) {
+    select_scanner();
+    return scan_name;
+}
+
+// Calls visit for every printable run of at least min_len bytes; a
+// nonzero return from visit stops the scan and is reported as 1
+int strscan_printable(const unsigned char *data, size_t size, size_t min_len,
+                      int (*visit)(const char *str, size_t len, void *ctx), void *ctx) {
+    select_scanner();
+    if (min_len < 1) {
+        min_len = 1;
+    } else if (min_len > STRSCAN_BLOCK) {
+        min_len = STRSCAN_BLOCK;
+    }
+    return scan(data, size, (unsigned)min_len, visit, ctx);
+}
@@ -0,0 +1,278 @@
+/*
+ * Persistent root filesystem templates
+ *
+ * The directory skeleton an instance needs depends only on its
+ * capabilities, so it is built once per fingerprint under the state
+ * directory and layered beneath each instance root (overlayfs on
+ * Linux, unionfs on FreeBSD) instead of being recreated per launch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <dirent.h>
+#include <time.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/uio.h>
+#endif
+#include "common.h"
+
+#define TEMPLATE_MAX_IDLE (7 * 24 * 3600)  /* seconds unused before collection */
+#define TEMPLATE_MAX_HELD 16
+
+static const char *skeleton[] = {
+    "bin", "lib", "usr/lib", "usr/local/lib", "dev", "tmp", "libexec", "etc",
+    "proc", "var/log", "var/tmp", "var/run", NULL
+};
+
+// Templates this process uses, each pinned by a shared lock until exit
+static struct {
+    char path[PATH_MAX];
+    int fd;
+} held[TEMPLATE_MAX_HELD];
+static int held_count = 0;
+
+const char *template_state_dir(void) {
+    const char *dir = getenv("ISOLATE_STATE_DIR");
+    return (dir && *dir) ? dir : ISOLATE_STATE_DIR;
+}
+
+static int rule_is_dir(const struct file_rule *rule) {
+    struct stat st;
+    return stat(rule->path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Only what template_populate reads goes in; directory contents are
+// bind mounted at launch, so their changes never need a new template
+static unsigned long long template_fingerprint(const struct capabilities *caps) {
+    unsigned long long h = FNV_OFFSET;
+    int has_workspace = caps->workspace_path != NULL;
+
+    h = fnv1a64(h, &has_workspace, sizeof(has_workspace));
+    for (int i = 0; i < caps->file_count; i++) {
+        const struct file_rule *rule = &caps->files[i];
+        int is_dir = rule_is_dir(rule);
+
+        h = fnv1a64(h, rule->path, strlen(rule->path) + 1);
+        h = fnv1a64(h, &rule->permissions, sizeof(rule->permissions));
+        h = fnv1a64(h, &is_dir, sizeof(is_dir));
+    }
+    return h;
+}
+
+int template_populate(int dirfd, const struct capabilities *caps) {
+    for (int i = 0; skeleton[i]; i++) {
+        if (fsops_mkdirs(dirfd, skeleton[i], 0755) != 0) {
+            return -1;
+        }
+    }
+    fsops_chmod(dirfd, "tmp", 01777);
+    fsops_chmod(dirfd, "var/tmp", 01777);
+
+    if (caps->workspace_path) {
+        fsops_mkdirs(dirfd, "workspace", 0755);
+    }
+
+    // Mount points for directory rules, so instances never create them
+    for (int i = 0; i < caps->file_count; i++) {
+        const struct file_rule *rule = &caps->files[i];
+        if ((rule->permissions & (R_OK | W_OK | X_OK)) && rule->path[0] == '/' &&
+            rule_is_dir(rule)) {
+            fsops_mkdirs(dirfd, rule->path + 1, 0755);
+        }
+    }
+
+    return 0;
+}
+
+static int build_template(const char *path, const struct capabilities *caps) {
+    int fd = fsops_open_dir(path);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = template_populate(fd, caps);
+    close(fd);
+    return ret;
+}
+
+// Refresh the template's mtime and keep a shared lock on it for the life
+// of this process, so collection never removes a template under a running
+// instance. Forked keepers share the lock through the inherited descriptor.
+static int use_template(const char *path) {
+    struct stat st;
+
+    for (int i = 0; i < held_count; i++) {
+        if (strcmp(held[i].path, path) == 0) {
+            futimens(held[i].fd, NULL);
+            return 0;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    // A collector holds the exclusive lock while it removes the template
+    if (flock(fd, LOCK_SH | LOCK_NB) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+        close(fd);
+        return -1;
+    }
+    futimens(fd, NULL);
+
+    if (held_count < TEMPLATE_MAX_HELD) {
+        snprintf(held[held_count].path, sizeof(held[held_count].path), "%s", path);
+        held[held_count++].fd = fd;
+    } else {
+        close(fd);
+    }
+    return 0;
+}
+
+// Remove templates (and staging leftovers) nobody has used for
+// TEMPLATE_MAX_IDLE. Runs only after a build, which is the only way the
+// template directory grows.
+static void collect_templates(const char *templates, const char *keep) {
+    DIR *dir = opendir(templates);
+    struct dirent *entry;
+    time_t now = time(NULL);
+    char path[PATH_MAX];
+
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        int len = snprintf(path, sizeof(path), "%s/%s", templates, entry->d_name);
+        if (len < 0 || (size_t)len >= sizeof(path) || strcmp(path, keep) == 0) {
+            continue;
+        }
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) || now - st.st_mtime < TEMPLATE_MAX_IDLE) {
+            continue;
+        }
+
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            if (fsops_remove_tree(path) == 0) {
+                printf("Removed unused rootfs template %s\n", path);
+            }
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+int template_prepare(const struct capabilities *caps, char *path, size_t path_size) {
+    char templates[PATH_MAX];
+    char staging[PATH_MAX];
+    struct stat st;
+    int len;
+
+    len = snprintf(templates, sizeof(templates), "%s/templates", template_state_dir());
+    if (len < 0 || (size_t)len >= sizeof(templates) ||
+        snprintf(path, path_size, "%s/%016llx", templates, template_fingerprint(caps)) >= (int)path_size) {
+        path[0] = '\0';
+        return -1;
+    }
+
+    if (use_template(path) == 0) {
+        printf("Using rootfs template %s\n", path);
+        return 0;
+    }
+
+    if (fsops_mkdirs(AT_FDCWD, templates, 0755) != 0) {
+        fprintf(stderr, "Warning: Cannot create template directory %s: %s\n", templates, strerror(errno));
+        path[0] = '\0';
+        return -1;
+    }
+
+    // Build aside and publish atomically; a concurrent builder may win the rename
+    len = snprintf(staging, sizeof(staging), "%s.%d", path, getpid());
+    if (len < 0 || (size_t)len >= sizeof(staging)) {
+        path[0] = '\0';
+        return -1;
+    }
+    fsops_remove_tree(staging);
+    if (fsops_mkdirs(AT_FDCWD, staging, 0755) != 0 || build_template(staging, caps) != 0) {
+        fprintf(stderr, "Warning: Cannot build rootfs template: %s\n", strerror(errno));
+        fsops_remove_tree(staging);
+        path[0] = '\0';
+        return -1;
+    }
+    if (rename(staging, path) != 0) {
+        fsops_remove_tree(staging);
+        if (stat(path, &st) != 0) {
+            path[0] = '\0';
+            return -1;
+        }
+    }
+    if (use_template(path) != 0) {
+        path[0] = '\0';
+        return -1;
+    }
+
+    printf("Built rootfs template %s\n", path);
+    collect_templates(templates, path);
+    return 0;
+}
+
+#ifdef __linux__
+int template_mount(const char *template_path, const char *root) {
+    char upper[PATH_MAX];
+    char work[PATH_MAX];
+    char options[3 * PATH_MAX + 64];
+
+    // root is a fresh tmpfs; the overlay stacks on top of it and keeps
+    // its upper/work layers underneath
+    int fd = fsops_open_dir(root);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsops_mkdirs(fd, ".layers/upper", 0755);
+    if (ret == 0) {
+        ret = fsops_mkdirs(fd, ".layers/work", 0700);
+    }
+    close(fd);
+    if (ret != 0) {
+        return -1;
+    }
+
+    snprintf(upper, sizeof(upper), "%s/.layers/upper", root);
+    snprintf(work, sizeof(work), "%s/.layers/work", root);
+    snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s",
+             template_path, upper, work);
+    return fsops_mount_fs("overlay", root, MS_NOSUID, options);
+}
+#endif /* __linux__ */
+
+#ifdef __FreeBSD__
+int template_mount(const char *template_path, const char *root) {
+    struct iovec iov[8];
+    int n = 0;
+
+    // The instance directory stays the writable upper layer
+    iov[n].iov_base = "fstype"; iov[n++].iov_len = sizeof("fstype");
+    iov[n].iov_base = "unionfs"; iov[n++].iov_len = sizeof("unionfs");
+    iov[n].iov_base = "fspath"; iov[n++].iov_len = sizeof("fspath");
+    iov[n].iov_base = (void *)root; iov[n++].iov_len = strlen(root) + 1;
+    iov[n].iov_base = "target"; iov[n++].iov_len = sizeof("target");
+    iov[n].iov_base = (void *)template_path; iov[n++].iov_len = strlen(template_path) + 1;
+    iov[n].iov_base = "below"; iov[n++].iov_len = sizeof("below");
+    iov[n].iov_base = NULL; iov[n++].iov_len = 0;
+    return nmount(iov, n, 0);
+}
+#endif /* __FreeBSD__ */
@@ -0,0 +1,122 @@
+/*
+ * Launch timing
+ *
+ * The launcher and the setup child stamp the monotonic clock at every
+ * phase boundary. A stamp is a vDSO clock_gettime() and a store, so the
+ * hooks stay compiled in; -T only decides whether the report is printed.
+ * Both processes read the same clock (no time namespace is created), so
+ * the child's setup phases line up with the launcher's own stamps.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+
+#define TIMING_MAX_ROWS (SETUP_PHASE_COUNT + 8)
+
+struct timing_row {
+    const char *name;
+    const char *parent;         /* NULL for launch phases */
+    uint64_t start, end;
+};
+
+static uint64_t marks[TIMING_MARK_COUNT];
+
+void timing_mark(enum timing_mark mark) {
+    marks[mark] = timing_now();
+}
+
+int timing_parse_format(const char *name) {
+    if (strcmp(name, "table") == 0) {
+        return TIMING_TABLE;
+    }
+    if (strcmp(name, "json") == 0) {
+        return TIMING_JSON;
+    }
+    fprintf(stderr, "Error: Unknown timing format %s (use table or json)\n", name);
+    return -1;
+}
+
+static void add_row(struct timing_row *rows, int *count, const char *name, const char *parent,
+                    uint64_t start, uint64_t end) {
+    // Phases that never started or ended are left out
+    if (start == 0 || end < start || *count == TIMING_MAX_ROWS) {
+        return;
+    }
+    rows[*count].name = name;
+    rows[*count].parent = parent;
+    rows[*count].start = start;
+    rows[*count].end = end;
+    (*count)++;
+}
+
+// Setup phases run in backend order, so each one ends where the next starts
+static void add_setup_rows(struct timing_row *rows, int *count, const struct setup_report *report) {
+    uint64_t after = 0;
+
+    for (;;) {
+        int next = -1;
+        for (int phase = SETUP_PHASE_NONE + 1; phase < SETUP_PHASE_COUNT; phase++) {
+            uint64_t start = report->phase_start[phase];
+            if (start > after && (next < 0 || start < report->phase_start[next])) {
+                next = phase;
+            }
+        }
+        if (next < 0) {
+            return;
+        }
+
+        uint64_t end = report->setup_end;
+        for (int phase = SETUP_PHASE_NONE + 1; phase < SETUP_PHASE_COUNT; phase++) {
+            uint64_t start = report->phase_start[phase];
+            if (start > report->phase_start[next] && start < end) {
+                end = start;
+            }
+        }
+        add_row(rows, count, setup_phase_name(next), "setup", report->phase_start[next], end);
+        after = report->phase_start[next];
+    }
+}
+
+// Printed on stderr, so the instance's own output stays clean
+void timing_report(int format, const struct setup_report *report) {
+    struct timing_row rows[TIMING_MAX_ROWS];
+    uint64_t setup_start = report->phase_start[SETUP_PHASE_NONE];
+    uint64_t origin = marks[TIMING_START];
+    int count = 0;
+
+    if (format == TIMING_OFF) {
+        return;
+    }
+
+    add_row(rows, &count, "parse", NULL, marks[TIMING_START], marks[TIMING_FORK]);
+    add_row(rows, &count, "fork", NULL, marks[TIMING_FORK], setup_start);
+    add_row(rows, &count, "setup", NULL, setup_start, report->setup_end);
+    add_setup_rows(rows, &count, report);
+    add_row(rows, &count, "exec", NULL, report->setup_end, report->executed);
+    add_row(rows, &count, "first-byte", NULL, report->executed, marks[TIMING_FIRST_BYTE]);
+    add_row(rows, &count, "run", NULL, report->executed, marks[TIMING_EXITED]);
+    add_row(rows, &count, "teardown", NULL, marks[TIMING_EXITED], marks[TIMING_CLEANED]);
+    add_row(rows, &count, "total", NULL, marks[TIMING_START], marks[TIMING_CLEANED]);
+
+    if (format == TIMING_TABLE) {
+        fprintf(stderr, "%-16s %10s %12s\n", "phase", "start ms", "duration ms");
+    }
+    for (int i = 0; i < count; i++) {
+        double start = (double)(rows[i].start - origin) / 1e6;
+        double duration = (double)(rows[i].end - rows[i].start) / 1e6;
+
+        if (format == TIMING_JSON) {
+            fprintf(stderr, "{\"phase\":\"%s\",", rows[i].name);
+            if (rows[i].parent) {
+                fprintf(stderr, "\"parent\":\"%s\",", rows[i].parent);
+            }
+            fprintf(stderr, "\"start_ms\":%.3f,\"duration_ms\":%.3f}\n", start, duration);
+        } else {
+            fprintf(stderr, "%s%-*s %10.3f %12.3f\n", rows[i].parent ? "  " : "",
+                    rows[i].parent ? 14 : 16, rows[i].name, start, duration);
+        }
+    }
+}
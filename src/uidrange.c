@@ -0,0 +1,311 @@
+/*
+ * Ephemeral UID/GID range allocator
+ *
+ * "user: auto" instances get a host UID (and the same GID) from a
+ * reserved range instead of a password database entry. Allocation state
+ * is a bitmap in a small shared state file, claimed with atomic
+ * compare-and-swap so concurrent launches never take a lock. Each slot
+ * also records the process responsible for releasing it, so entries
+ * left behind by a crashed launcher can be reclaimed once no process
+ * runs under the UID any more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+#include "common.h"
+
+#define UID_RANGE_BASE 200000
+#define UID_RANGE_COUNT 65536
+#define UID_RANGE_MAX (1 << 20)
+#define SUBUID_FILE "/etc/subuid"
+#define SUBUID_OWNER "isolate"
+
+static uint64_t *bitmap;
+static int32_t *owners;
+static uid_t range_base;
+static unsigned int range_count;
+
+static int parse_range(const char *spec, unsigned long *base, unsigned long *count) {
+    char *end;
+
+    *base = strtoul(spec, &end, 10);
+    if (end == spec || *end != ':') {
+        return -1;
+    }
+    spec = end + 1;
+    *count = strtoul(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != '\n')) {
+        return -1;
+    }
+    return 0;
+}
+
+// ISOLATE_UID_RANGE=<base>:<count>, else an "isolate:<base>:<count>" subuid entry
+static void load_range(unsigned long *base, unsigned long *count) {
+    const char *spec = getenv("ISOLATE_UID_RANGE");
+    char line[256];
+
+    *base = UID_RANGE_BASE;
+    *count = UID_RANGE_COUNT;
+
+    if (spec && *spec) {
+        if (parse_range(spec, base, count) != 0) {
+            fprintf(stderr, "Warning: Invalid ISOLATE_UID_RANGE '%s', using default\n", spec);
+            *base = UID_RANGE_BASE;
+            *count = UID_RANGE_COUNT;
+        }
+        return;
+    }
+
+    FILE *file = fopen(SUBUID_FILE, "r");
+    if (!file) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        size_t len = strlen(SUBUID_OWNER);
+        if (strncmp(line, SUBUID_OWNER, len) == 0 && line[len] == ':') {
+            unsigned long b, c;
+            if (parse_range(line + len + 1, &b, &c) == 0) {
+                *base = b;
+                *count = c;
+            }
+            break;
+        }
+    }
+    fclose(file);
+}
+
+static int map_state(void) {
+    unsigned long base, count;
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (bitmap) {
+        return 0;
+    }
+
+    load_range(&base, &count);
+    count &= ~63UL;
+    if (base == 0 || count == 0 || count > UID_RANGE_MAX) {
+        fprintf(stderr, "UID range %lu:%lu is not usable\n", base, count);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // One file per range: a zero-filled file is a valid empty bitmap, so
+    // concurrent first users need no initialization handshake
+    snprintf(dir, sizeof(dir), "%s", template_state_dir());
+    if (fsops_mkdirs(AT_FDCWD, dir, 0755) != 0) {
+        return -1;
+    }
+    int len = snprintf(path, sizeof(path), "%s/uids-%lu-%lu", dir, base, count);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    size_t size = count / 8 + count * sizeof(int32_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    bitmap = map;
+    owners = (int32_t *)((char *)map + count / 8);
+    range_base = base;
+    range_count = count;
+    return 0;
+}
+
+static int claim_slot(unsigned int start_word, pid_t owner) {
+    unsigned int words = range_count / 64;
+
+    for (unsigned int i = 0; i < words; i++) {
+        unsigned int w = (start_word + i) % words;
+        uint64_t v = __atomic_load_n(&bitmap[w], __ATOMIC_ACQUIRE);
+
+        while (v != UINT64_MAX) {
+            int bit = __builtin_ctzll(~v);
+            if (__atomic_compare_exchange_n(&bitmap[w], &v, v | (1ULL << bit), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                unsigned int slot = w * 64 + bit;
+                __atomic_store_n(&owners[slot], owner, __ATOMIC_RELEASE);
+                return (int)slot;
+            }
+        }
+    }
+    return -1;
+}
+
+static void release_slot(unsigned int slot) {
+    __atomic_fetch_and(&bitmap[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELEASE);
+}
+
+static void mark_in_use(uint64_t *in_use, uid_t uid) {
+    if (uid >= range_base && uid < range_base + range_count) {
+        unsigned int slot = uid - range_base;
+        in_use[slot / 64] |= 1ULL << (slot % 64);
+    }
+}
+
+#ifdef __linux__
+// Real, effective, saved and filesystem UIDs of every process on the host
+static int scan_process_uids(uint64_t *in_use) {
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    char path[64];
+    char line[256];
+
+    if (!proc) {
+        return -1;
+    }
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%.32s/status", entry->d_name);
+        FILE *status = fopen(path, "r");
+        if (!status) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), status)) {
+            unsigned int uids[4];
+            if (sscanf(line, "Uid: %u %u %u %u", &uids[0], &uids[1], &uids[2], &uids[3]) == 4) {
+                for (int i = 0; i < 4; i++) {
+                    mark_in_use(in_use, uids[i]);
+                }
+                break;
+            }
+        }
+        fclose(status);
+    }
+    closedir(proc);
+    return 0;
+}
+#endif /* __linux__ */
+
+#ifdef __FreeBSD__
+// Jailed processes are listed too, so a running jail keeps its UID
+static int scan_process_uids(uint64_t *in_use) {
+    int mib[3] = { CTL_KERN, KERN_PROC, KERN_PROC_PROC };
+    struct kinfo_proc *procs = NULL;
+    size_t size = 0;
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        if (sysctl(mib, 3, NULL, &size, NULL, 0) != 0) {
+            break;
+        }
+        // Processes started since the size query need room too
+        size += size / 8;
+        struct kinfo_proc *grown = realloc(procs, size);
+        if (!grown) {
+            break;
+        }
+        procs = grown;
+        if (sysctl(mib, 3, procs, &size, NULL, 0) == 0) {
+            for (size_t i = 0; i < size / sizeof(*procs); i++) {
+                mark_in_use(in_use, procs[i].ki_uid);
+                mark_in_use(in_use, procs[i].ki_ruid);
+                mark_in_use(in_use, procs[i].ki_svuid);
+            }
+            free(procs);
+            return 0;
+        }
+        if (errno != ENOMEM) {
+            break;
+        }
+    }
+    free(procs);
+    return -1;
+}
+#endif /* __FreeBSD__ */
+
+// Free slots whose releasing process no longer exists. The instance can
+// outlive its launcher (a SIGKILLed launcher leaves the namespace or jail
+// running), so a slot is only freed once nothing runs under its UID.
+static int reclaim_stale(void) {
+    int reclaimed = 0;
+
+    uint64_t *in_use = calloc(range_count / 64, sizeof(*in_use));
+    if (!in_use) {
+        return 0;
+    }
+    if (scan_process_uids(in_use) != 0) {
+        free(in_use);
+        return 0;
+    }
+
+    for (unsigned int slot = 0; slot < range_count; slot++) {
+        int32_t owner = __atomic_load_n(&owners[slot], __ATOMIC_ACQUIRE);
+        if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH ||
+            (in_use[slot / 64] & (1ULL << (slot % 64)))) {
+            continue;
+        }
+        // Only the reclaimer that clears the owner may clear the bit
+        if (__atomic_compare_exchange_n(&owners[slot], &owner, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            release_slot(slot);
+            reclaimed++;
+        }
+    }
+    free(in_use);
+    return reclaimed;
+}
+
+int uid_range_acquire(pid_t owner, uid_t *uid) {
+    if (map_state() != 0) {
+        return -1;
+    }
+
+    // Spread concurrent launchers over different words
+    unsigned int start = (unsigned int)owner % (range_count / 64);
+    int slot = claim_slot(start, owner);
+    if (slot < 0 && reclaim_stale() > 0) {
+        slot = claim_slot(start, owner);
+    }
+    if (slot < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *uid = range_base + slot;
+    return 0;
+}
+
+void uid_range_release(uid_t uid) {
+    if (map_state() != 0 || uid < range_base || uid >= range_base + range_count) {
+        return;
+    }
+
+    // Clearing the owner first makes a repeated release a no-op
+    unsigned int slot = uid - range_base;
+    int32_t owner = __atomic_load_n(&owners[slot], __ATOMIC_ACQUIRE);
+    if (owner != 0 && __atomic_compare_exchange_n(&owners[slot], &owner, 0, 0,
+                                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        release_slot(slot);
+    }
+}